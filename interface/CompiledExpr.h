@@ -3,8 +3,11 @@
 
 #include "TTreeFormulaCached.h"
 #include "TTreeFunction.h"
+#include "ExprGraph.h"
 
 #include <memory>
+#include <vector>
+#include <utility>
 
 namespace multidraw {
 
@@ -17,37 +20,78 @@ namespace multidraw {
     CompiledExprSource() {}
     CompiledExprSource(char const* formula) : formula_(formula) {}
     CompiledExprSource(TTreeFunction const& function) : function_(function.clone()) {}
-    CompiledExprSource(CompiledExprSource const& orig) : formula_(orig.formula_), function_(orig.function_ ? orig.function_->clone() : nullptr) {}
+    CompiledExprSource(CompiledExprSource const& orig) : formula_(orig.formula_), function_(orig.function_ ? orig.function_->clone() : nullptr), perFile_(orig.perFile_) {}
 
     TString const& getFormula() const { return formula_; }
     TTreeFunction const* getFunction() const { return function_.get(); }
 
+    //! Declare that the expression is constant within each file (only meaningful for formulas)
+    void setPerFile(bool p) { perFile_ = p; }
+    bool getPerFile() const { return perFile_; }
+
     std::unique_ptr<CompiledExpr> compile(FormulaLibrary&, FunctionLibrary&) const;
 
+    //! String identifying the expression (functions are identified by their key or name)
+    TString getSignature() const;
+
   private:
     TString formula_{};
     std::unique_ptr<TTreeFunction> function_{};
+    bool perFile_{false};
   };
 
   class CompiledExpr {
   public:
     CompiledExpr(TTreeFormulaCached& formula) : formula_(&formula) {}
     CompiledExpr(TTreeFunction&);
+    CompiledExpr(ExprGraph::Node& node) : node_(&node) {}
     ~CompiledExpr() {}
 
+    //! Formula object (nullptr if the expression is a function or a decomposed expression)
     TTreeFormulaCached* getFormula() const { return formula_; }
     TTreeFunction* getFunction() const { return function_; }
+    ExprGraph::Node* getNode() const { return node_; }
+
+    //! Formula objects the expression is evaluated with
+    std::vector<TTreeFormulaCached*> getFormulas() const;
 
+    int getMultiplicity();
     unsigned getNdata();
     double evaluate(unsigned);
+    //! Values of all instances if the expression is a function with batch evaluation, nullptr otherwise
+    std::vector<double> const* getValues() { return function_ == nullptr ? nullptr : function_->getValues(); }
 
   private:
     TTreeFormulaCached* formula_{};
     TTreeFunction* function_{};
+    ExprGraph::Node* node_{};
   };
 
   typedef std::unique_ptr<CompiledExpr> CompiledExprPtr;
 
+  //! A set of expressions iterated in lock step.
+  /*!
+   * Formula objects are shared among consumers (see FormulaLibrary) and therefore cannot be bundled
+   * into a per-consumer TTreeFormulaManager. This class provides the equivalent synchronization:
+   * singlet formulas are broadcast to all iterations, and other expressions are iterated up to the
+   * shortest length.
+   */
+  class CompiledExprGroup {
+  public:
+    CompiledExprGroup() {}
+
+    void add(CompiledExpr&);
+    void clear() { exprs_.clear(); }
+    bool empty() const { return exprs_.empty(); }
+
+    //! Number of iterations in the current event. An empty group has one iteration.
+    unsigned getNdata();
+
+  private:
+    //! (expression, is a singlet formula)
+    std::vector<std::pair<CompiledExpr*, bool>> exprs_{};
+  };
+
 }
 
 #endif
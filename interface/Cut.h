@@ -2,18 +2,18 @@
 #define multidraw_Cut_h
 
 #include "ExprFiller.h"
+#include "CompiledExpr.h"
 
 #include "TString.h"
 
 #include <vector>
 #include <memory>
 
-class TTreeFormulaCached;
-
 namespace multidraw {
 
   class FormulaLibrary;
   class FunctionLibrary;
+  class ReweightLibrary;
 
   class Cut {
   public:
@@ -25,6 +25,7 @@ namespace multidraw {
 
     unsigned getNFillers() const { return fillers_.size(); }
     ExprFiller const* getFiller(unsigned i) const { return fillers_.at(i).get(); }
+    ExprFiller* getFiller(unsigned i) { return fillers_.at(i).get(); }
 
     void setCutExpr(char const* expr) { cutExpr_ = expr; }
     TString const& getCutExpr() const { return cutExpr_; }
@@ -35,17 +36,29 @@ namespace multidraw {
 
     void addFiller(ExprFillerPtr&& _filler) { fillers_.emplace_back(std::move(_filler)); }
 
-    void bindTree(FormulaLibrary&, FunctionLibrary&);
+    void bindTree(FormulaLibrary&, FunctionLibrary&, ReweightLibrary&);
     void unlinkTree();
-    std::unique_ptr<Cut> threadClone(FormulaLibrary&, FunctionLibrary&) const;
+    std::unique_ptr<Cut> threadClone(FormulaLibrary&, FunctionLibrary&, ReweightLibrary&) const;
 
     bool dependsOn(TTree const&) const;
 
+    //! String identifying the cut, categories, and fillers
+    TString getSignature() const;
+
     void initialize();
     bool evaluate();
+    //! Result of the last evaluate()
+    bool getPassed() const { return passed_; }
+    //! Category of each instance in the last evaluate() (-1 if the instance fails the cut)
+    std::vector<int> const& getCategoryIndex() const { return categoryIndex_; }
     void fillExprs(std::vector<double> const& eventWeights);
+    void finalize();
 
     unsigned getCount() const { return counter_; }
+    //! Override the count (used to merge the results of other processes and cached executions)
+    void setCount(unsigned c) { counter_ = c; }
+    //! Zero the counts of the cut and its fillers
+    void resetCounts();
 
   protected:
     TString name_{""};
@@ -57,9 +70,11 @@ namespace multidraw {
     unsigned counter_{0};
 
     std::vector<int> categoryIndex_{};
-    TTreeFormulaCached* compiledCut_{};
-    std::vector<TTreeFormulaCached*> compiledCategories_{};
-    TTreeFormulaCached* compiledCategorization_{};
+    bool passed_{false};
+    CompiledExprPtr compiledCut_{};
+    std::vector<CompiledExprPtr> compiledCategories_{};
+    CompiledExprPtr compiledCategorization_{};
+    CompiledExprGroup exprGroup_{};
   };
 
   typedef std::unique_ptr<Cut> CutPtr;
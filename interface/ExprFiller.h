@@ -3,6 +3,7 @@
 
 #include "TTreeFormulaCached.h"
 #include "Reweight.h"
+#include "ReweightLibrary.h"
 #include "CompiledExpr.h"
 
 #include "TString.h"
@@ -27,35 +28,62 @@ namespace multidraw {
 
     void setPrintLevel(int l) { printLevel_ = l; }
 
+    //! The filled object, or the object of the category (icat >= 0) if categorized
     TObject const& getObj(int icat = -1) const;
     TObject& getObj(int icat = -1);
 
+    //! Append all underlying objects (one per category if categorized) to the vector
+    void collectObjs(std::vector<TObject*>&);
+
     virtual unsigned getNdim() const = 0;
     TTreeFormulaCached* getFormula(unsigned i = 0) const { return compiledExprs_.at(i)->getFormula(); }
     void setReweight(ReweightSource const& source) { reweightSource_ = std::make_unique<ReweightSource>(source); }
     ReweightSource const* getReweightSource() const { return reweightSource_.get(); }
-    Reweight const* getReweight() const { return compiledReweight_.get(); }
+    Reweight const* getReweight() const { return sharedReweight_ == nullptr ? nullptr : &sharedReweight_->getReweight(); }
 
-    void bindTree(FormulaLibrary&, FunctionLibrary&);
+    void bindTree(FormulaLibrary&, FunctionLibrary&, ReweightLibrary&);
     void unlinkTree();
-    std::unique_ptr<ExprFiller> threadClone(FormulaLibrary&, FunctionLibrary&);
+    std::unique_ptr<ExprFiller> threadClone(FormulaLibrary&, FunctionLibrary&, ReweightLibrary&);
 
     void initialize();
-    void fill(std::vector<double> const& eventWeights, std::vector<int> const& categories);
+    virtual void fill(std::vector<double> const& eventWeights, std::vector<int> const& categories);
+    //! Called at the end of the event loop, before the objects are merged or returned
+    void finalize();
 
     //! Merge the underlying object into the main-thread object
     void mergeBack();
 
+    //! String identifying the filled objects and the expressions
+    virtual TString getSignature() const;
+
     unsigned getCount() const { return counter_; }
+    //! Override the count (used to merge the results of other processes and cached executions)
+    void setCount(unsigned c) { counter_ = c; }
+    //! Zero the fill and out-of-range counts
+    void resetCounts() { counter_ = 0; nOutOfRange_ = 0; }
+    //! Number of instances not filled because their category index exceeds the list of objects
+    unsigned getNOutOfRange() const { return nOutOfRange_; }
 
   protected:
     // Special copy constructor for cloning
     ExprFiller(TObject&, ExprFiller const&);
 
+    virtual void initialize_() {}
     virtual void doFill_(unsigned, int = -1) = 0;
+    virtual void finalize_() {}
     virtual ExprFiller* clone_() = 0;
     virtual void mergeBack_() = 0;
 
+    //! Out-of-range policy: instances with negative (failing) or out-of-range category indices are not filled
+    bool acceptCategory_(int icat, unsigned bound)
+    {
+      if (unsigned(icat) < bound)
+        return true;
+      if (icat >= 0)
+        ++nOutOfRange_;
+      return false;
+    }
+
     TObject& tobj_;
 
     std::vector<CompiledExprSource> sources_{};
@@ -64,13 +92,20 @@ namespace multidraw {
     unsigned counter_{0};
 
     ExprFiller* cloneSource_{nullptr};
+    //! Clone refers to the object of cloneSource_ and keeps its thread-local storage separately (tobj_ is not deleted)
+    bool sharesObj_{false};
 
     int printLevel_{0};
 
     std::vector<CompiledExprPtr> compiledExprs_{};
-    ReweightPtr compiledReweight_{nullptr};
+    CompiledExprGroup exprGroup_{};
+    //! Owned by the ReweightLibrary and possibly shared with other fillers
+    SharedReweight* sharedReweight_{nullptr};
 
     bool categorized_{false};
+    //! Number of objects if categorized, no bound otherwise (set in initialize())
+    unsigned categoryBound_{0};
+    unsigned nOutOfRange_{0};
   };
 
   typedef std::unique_ptr<ExprFiller> ExprFillerPtr;
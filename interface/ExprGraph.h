@@ -0,0 +1,97 @@
+#ifndef multidraw_ExprGraph_h
+#define multidraw_ExprGraph_h
+
+#include "ExprTree.h"
+#include "TTreeFormulaCached.h"
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+
+namespace multidraw {
+
+  class FormulaLibrary;
+
+  //! Graph of subexpressions shared among all expressions of a thread.
+  /*!
+   * Expressions are decomposed into arithmetic, logical, and comparison operators and elementary math
+   * functions, which are evaluated natively, and leaves (variables, TTreeFormula special functions,
+   * and anything else that cannot be decomposed), which are evaluated by formula objects taken from
+   * the FormulaLibrary. Nodes are identified by their canonical text (see ExprTree), so a subexpression
+   * appearing in several cuts, plots, and reweights is evaluated only once per event and instance.
+   * Expressions whose instance iteration cannot be reproduced node by node (empty subscripts [],
+   * Iteration$, multi-dimensional arrays) are not decomposed.
+   */
+  class ExprGraph {
+  public:
+    class Node {
+    public:
+      Node() {}
+
+      //! 0 if the node is a singlet
+      int getMultiplicity() const { return multiplicity_; }
+      unsigned getNdata();
+      //! Out-of-range instances return the value of the last instance (same as TTreeFormulaCached)
+      double evaluate(unsigned);
+
+      void resetCache() { ndata_ = -1; }
+
+      //! Append all formula objects under this node to the vector
+      void collectFormulas(std::vector<TTreeFormulaCached*>&) const;
+
+    private:
+      friend class ExprGraph;
+
+      enum Kind {
+        kConstant,
+        kLeaf,
+        kUnary,
+        kBinary,
+        kTernary
+      };
+
+      double compute_(unsigned);
+
+      Kind kind_{kConstant};
+      double constant_{0.};
+      TTreeFormulaCached* formula_{nullptr};
+      double (*unary_)(double){nullptr};
+      double (*binary_)(double, double){nullptr};
+      //! Logical operators evaluate the second operand only when needed
+      char shortCircuit_{0};
+      std::vector<Node*> args_{};
+      int multiplicity_{0};
+
+      int ndata_{-1};
+      std::vector<char> done_{};
+      std::vector<double> values_{};
+    };
+
+    ExprGraph(FormulaLibrary&, TTree&);
+    ~ExprGraph() {}
+
+    //! Return the root node of the decomposed expression.
+    /*!
+     * Returns nullptr if the expression cannot be decomposed or consists of a single leaf; the
+     * expression should then be evaluated by a formula object directly.
+     */
+    Node* getNode(char const* expr);
+
+    void resetCache();
+
+    unsigned size() const { return nodes_.size(); }
+
+  private:
+    Node& makeNode_(ExprTree::Node const&);
+    bool isDecomposable_(ExprTree::Node const&) const;
+
+    FormulaLibrary& library_;
+    TTree& tree_;
+
+    std::unordered_map<std::string, std::unique_ptr<Node>> nodes_{};
+  };
+
+}
+
+#endif
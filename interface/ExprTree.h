@@ -0,0 +1,64 @@
+#ifndef multidraw_ExprTree_h
+#define multidraw_ExprTree_h
+
+#include <string>
+#include <vector>
+#include <memory>
+
+class TTree;
+
+namespace multidraw {
+
+  //! Syntax tree of a TTreeFormula expression.
+  /*!
+   * Understands numbers, variables with array subscripts, function calls, and the unary, binary, and
+   * ternary operators of TFormula. Anything else (string literals, method calls through @, bitwise
+   * operators, etc.) makes the parse fail, in which case the expression should be treated as an opaque string.
+   * The tree is normalized upon construction: redundant parentheses are dropped, aliases of the given
+   * TTree are expanded, a > b is rewritten as b < a, and the two operands of commutative operators are
+   * put in lexicographical order of their canonical text. The operators are never reassociated, so the
+   * normalized expression evaluates to exactly the same value as the original.
+   */
+  class ExprTree {
+  public:
+    enum NodeType {
+      kNumber,
+      kVariable,
+      kCall,
+      kUnary,
+      kBinary,
+      kTernary
+    };
+
+    struct Node {
+      NodeType type{kNumber};
+      //! Number literal, variable name, function name, or operator
+      std::string name{};
+      //! Subscripts (nullptr for []), function arguments, or operands
+      std::vector<std::unique_ptr<Node>> args{};
+      //! Canonical text of the subtree
+      std::string text{};
+    };
+
+    typedef std::unique_ptr<Node> NodePtr;
+
+    //! Parse the expression. If a tree is given, its aliases are expanded.
+    ExprTree(char const* expr, TTree const* tree = nullptr);
+
+    bool isValid() const { return bool(root_); }
+    Node const* getRoot() const { return root_.get(); }
+
+    //! Canonical form of the expression. Returns the original expression if the parse failed.
+    std::string const& getCanonical() const { return canonical_; }
+
+    //! Shortcut for ExprTree(expr, tree).getCanonical()
+    static std::string canonicalize(char const* expr, TTree const* tree = nullptr);
+
+  private:
+    NodePtr root_{};
+    std::string canonical_{};
+  };
+
+}
+
+#endif
@@ -0,0 +1,278 @@
+#ifndef multidraw_FastAxis_h
+#define multidraw_FastAxis_h
+
+#include "TAxis.h"
+#include "TH1.h"
+#include "TString.h"
+
+#include <vector>
+#include <array>
+#include <unordered_map>
+#include <mutex>
+
+namespace multidraw {
+
+  //! Flat copy of a TAxis for bin lookups in the event loop.
+  /*!
+   * findBin returns the same bin number as TAxis::FindFixBin. Uniform axes use a multiply-and-truncate
+   * index computation. Variable axes are searched over a flat array of edges, with a linear count for short
+   * arrays (vectorizable) and a branch-free binary search otherwise.
+   */
+  class FastAxis {
+  public:
+    FastAxis() {}
+    FastAxis(TAxis const&);
+
+    int getNbins() const { return nbins_; }
+    double getBinLowEdge(int bin) const;
+
+    //! String identifying the binning (number of bins, limits, and the edges of a variable axis)
+    static TString getSignature(TAxis const&);
+    double getBinUpEdge(int bin) const { return getBinLowEdge(bin + 1); }
+
+    int findBin(double x) const
+    {
+      if (x < xmin_)
+        return 0;
+      if (!(x < xmax_)) // also catches NaN
+        return nbins_ + 1;
+      if (edges_.empty())
+        return 1 + int(nbins_ * (x - xmin_) / (xmax_ - xmin_));
+
+      return 1 + findVariable_(x);
+    }
+
+  private:
+    //! Index of the last edge <= x, for x within the axis range
+    int findVariable_(double x) const
+    {
+      double const* edges(edges_.data());
+      unsigned n(edges_.size());
+
+      if (n <= maxLinearSearch) {
+        int count(0);
+        for (unsigned i(0); i != n; ++i)
+          count += (edges[i] <= x);
+        return count - 1;
+      }
+
+      double const* base(edges);
+      while (n > 1) {
+        unsigned half(n / 2);
+        base = (base[half] <= x) ? base + half : base;
+        n -= half;
+      }
+      return base - edges;
+    }
+
+    static constexpr unsigned maxLinearSearch{32};
+
+    int nbins_{1};
+    double xmin_{0.};
+    double xmax_{1.};
+    //! Bin edges of a variable axis (empty for uniform axes)
+    std::vector<double> edges_{};
+  };
+
+  //! Direct access to the bin contents, sums of squared weights, and statistics of a histogram.
+  /*!
+   * Reproduces what TH1::Fill does with a given bin number (including the automatic creation of the sumw2
+   * array for weights other than 1), without the virtual calls. Statistics and the number of entries of the
+   * fills are accumulated in this object and added to the histogram by flush(). Only TH1D, TH1F, TH2D, and
+   * TH2F without buffers, extendable axes, or axis ranges are supported (set() returns false otherwise).
+   * Several objects can fill the same histogram (e.g. one histogram under several cuts): the sumw2 array is
+   * looked up in the histogram until it exists, so that an array created by another object is used.
+   */
+  class FastBinArray {
+  public:
+    FastBinArray() {}
+
+    //! Whether the histogram type and configuration allow direct filling
+    static bool isSupported(TH1 const&);
+
+    bool set(TH1&);
+
+    //! Add a weight to a bin and count an entry
+    void add(int bin, double w)
+    {
+      if (sumw2_ == nullptr && !isNotW_ && (w != 1. || hist_->GetSumw2N() != 0))
+        updateSumw2_(w);
+
+      if (dcontent_ != nullptr)
+        dcontent_[bin] += w;
+      else
+        fcontent_[bin] += w;
+
+      if (sumw2_ != nullptr)
+        sumw2_[bin] += w * w;
+
+      entries_ += 1.;
+    }
+
+    //! Statistics of the fills since the last flush (same layout as TH1::GetStats)
+    double* getStats() { return stats_; }
+    bool getStatOverflows() const { return statOverflows_; }
+
+    //! Add the statistics and the number of entries of the fills to the histogram
+    void flush();
+
+  private:
+    //! Take the sumw2 array of the histogram, or create it for a weight other than 1
+    void updateSumw2_(double w);
+
+    TH1* hist_{nullptr};
+    double* dcontent_{nullptr};
+    float* fcontent_{nullptr};
+    double* sumw2_{nullptr};
+    //! Histogram flagged kIsNotW (no automatic sumw2)
+    bool isNotW_{false};
+    bool statOverflows_{false};
+
+    double stats_[TH1::kNstat]{};
+    double entries_{0.};
+  };
+
+  //! Thread-local accumulator for a histogram supported by FastBinArray.
+  /*!
+   * Collects the bin contents, sums of squared weights, statistics, and the number of entries of the fills
+   * of one thread without copying the histogram. Storage is allocated at the first fill: a dense array for
+   * histograms with up to kMaxDenseCells cells, and a hash map of the filled cells for larger histograms.
+   * addTo() adds the accumulated fills to the histogram as TH1::Add would; nothing is done if there was no fill.
+   */
+  class LocalBinArray {
+  public:
+    enum {
+      kMaxDenseCells = 1 << 16
+    };
+
+    LocalBinArray() {}
+
+    //! Take the number of cells and the statistics settings of the histogram. The histogram is not modified.
+    void set(TH1 const&);
+
+    //! Add a weight to a bin and count an entry
+    void add(int bin, double w)
+    {
+      double* cell(nullptr);
+      if (nCells_ <= kMaxDenseCells) {
+        if (dense_.empty())
+          dense_.assign(2 * nCells_, 0.);
+        cell = &dense_[2 * bin];
+      }
+      else
+        cell = sparse_[bin].data();
+
+      cell[0] += w;
+      cell[1] += w * w;
+
+      if (w != 1.)
+        nonUnitWeights_ = true;
+
+      entries_ += 1.;
+    }
+
+    double* getStats() { return stats_; }
+    bool getStatOverflows() const { return statOverflows_; }
+
+    bool isFilled() const { return entries_ != 0.; }
+
+    //! Add the contents, statistics, and entries to the histogram
+    void addTo(TH1&) const;
+
+  private:
+    int nCells_{0};
+    bool statOverflows_{false};
+
+    //! Interleaved sum of weights and sum of squared weights
+    std::vector<double> dense_{};
+    std::unordered_map<int, std::array<double, 2>> sparse_{};
+    bool nonUnitWeights_{false};
+
+    double stats_[TH1::kNstat]{};
+    double entries_{0.};
+  };
+
+  //! Bin contents and sums of squared weights of a histogram filled concurrently by several threads.
+  /*!
+   * Bins are guarded by striped locks; each lock covers runs of eight consecutive cells. The arrays of the
+   * histogram are not aligned to cache lines (and eight cells of a TH1F are half a line), so neighboring
+   * stripes can share a cache line: this costs false sharing, not correctness. A histogram must have a
+   * single SharedBinArray and must not be filled by other means during the event loop. The
+   * sumw2 array is created at the first attach() unless the histogram is flagged kIsNotW. Statistics and
+   * entries are accumulated by each SharedBinFiller and added at detach().
+   */
+  class SharedBinArray {
+  public:
+    enum {
+      kNStripes = 64
+    };
+
+    SharedBinArray() {}
+
+    //! Register a filler. The first filler takes the arrays and the current statistics of the histogram.
+    void attach(TH1&);
+    //! Add the statistics and entries of a filler, write the totals to the histogram, and unregister the filler.
+    void detach(double const* stats, double entries);
+
+    void add(int bin, double w)
+    {
+      std::lock_guard<std::mutex> lock(stripes_[(bin >> 3) % kNStripes]);
+
+      if (dcontent_ != nullptr)
+        dcontent_[bin] += w;
+      else
+        fcontent_[bin] += w;
+
+      if (sumw2_ != nullptr)
+        sumw2_[bin] += w * w;
+    }
+
+    bool getStatOverflows() const { return statOverflows_; }
+
+  private:
+    std::mutex mutex_{};
+    std::mutex stripes_[kNStripes];
+    unsigned nUsers_{0};
+
+    TH1* hist_{nullptr};
+    double* dcontent_{nullptr};
+    float* fcontent_{nullptr};
+    double* sumw2_{nullptr};
+    bool statOverflows_{false};
+
+    double stats_[TH1::kNstat]{};
+    double entries_{0.};
+  };
+
+  //! Per-thread access to a SharedBinArray with thread-local statistics (same interface as FastBinArray)
+  class SharedBinFiller {
+  public:
+    SharedBinFiller() {}
+    SharedBinFiller(SharedBinFiller const&) = delete;
+    SharedBinFiller(SharedBinFiller&&);
+    ~SharedBinFiller() { flush(); }
+
+    void set(SharedBinArray&, TH1&);
+
+    void add(int bin, double w)
+    {
+      array_->add(bin, w);
+      entries_ += 1.;
+    }
+
+    double* getStats() { return stats_; }
+    bool getStatOverflows() const { return array_->getStatOverflows(); }
+
+    //! Detach from the shared array
+    void flush();
+
+  private:
+    SharedBinArray* array_{nullptr};
+
+    double stats_[TH1::kNstat]{};
+    double entries_{0.};
+  };
+
+}
+
+#endif
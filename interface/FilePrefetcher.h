@@ -0,0 +1,55 @@
+#ifndef multidraw_FilePrefetcher_h
+#define multidraw_FilePrefetcher_h
+
+#include "TChain.h"
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+namespace multidraw {
+
+  //! Background warm-up of the upcoming files of a chain.
+  /*!
+   * When the event loop moves to tree number N, the files N+1 to N+depth are handed to a background
+   * thread, which asks the kernel to read ahead the head (file header, first baskets) and the tail (keys,
+   * streamer info, TTree metadata) of each file. The subsequent file transition in the event loop then
+   * reads from the page cache instead of waiting for the storage. Only local files (including network
+   * file systems mounted locally) are prefetched; other protocols are skipped. The background thread
+   * uses only POSIX calls and does not touch any ROOT state.
+   */
+  class FilePrefetcher {
+  public:
+    //! Prefetch up to depth files ahead. If nTrees >= 0, only the first nTrees files of the chain are considered.
+    FilePrefetcher(TChain const&, unsigned depth, int nTrees = -1);
+    ~FilePrefetcher();
+
+    //! Schedule the prefetching of the files following the given tree number.
+    void setTreeNumber(int);
+
+  private:
+    //! Number of bytes to read ahead from each end of a file
+    static constexpr long long prefetchSize{4 * 1024 * 1024};
+
+    void run_();
+    static void prefetch_(std::string const& path);
+
+    //! Local paths of the chain elements (empty for non-local files)
+    std::vector<std::string> paths_{};
+    unsigned depth_{1};
+    //! Index of the first file not yet scheduled
+    unsigned next_{0};
+
+    std::deque<unsigned> queue_{};
+    std::mutex mutex_{};
+    std::condition_variable condition_{};
+    bool done_{false};
+    std::thread thread_{};
+  };
+
+}
+
+#endif
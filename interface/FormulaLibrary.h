@@ -2,11 +2,11 @@
 #define multidraw_FormulaLibrary_h
 
 #include "TTreeFormulaCached.h"
+#include "ExprGraph.h"
 
 #include "TString.h"
 
 #include <unordered_map>
-#include <list>
 #include <memory>
 
 class TTree;
@@ -18,15 +18,31 @@ namespace multidraw {
     FormulaLibrary(TTree&);
     ~FormulaLibrary() {}
 
-    //! Create a new formula object with a shared cache.
+    //! Return the formula object for the expression, compiling it at the first request.
     /*!
-     * ExprFiller uses a TTreeFormulaManager to aggregate formulas. Adding a formula to a manager overwrites
-     * an attribute of the formula object itself. Since the grouping can be different for each filler, this
-     * means we cannot cache the formulas themselves and reuse among the fillers.
+     * Formula objects are shared among all users of equivalent expressions; expressions are compared
+     * in their canonical form (see ExprTree), so e.g. "(x > 1)" and "x>1" map to the same object. Adding a formula to a
+     * TTreeFormulaManager overwrites an attribute of the formula object itself, so consumers that iterate
+     * over several expressions in lock step must not bundle the formulas in their own manager. Use
+     * CompiledExprGroup instead.
      */
     TTreeFormulaCached& getFormula(char const* expr, bool silent = false);
 
+    //! Declare that the formula evaluates to a constant within each file.
+    /*!
+     * The cached values of such formulas survive resetCache() and are recomputed only after
+     * updateFormulaLeaves(). Formulas that do not depend on any branch are marked automatically.
+     */
+    void setPerFile(TTreeFormulaCached&);
+
+    //! Decompose expressions into a graph of shared subexpressions (see ExprGraph) in CompiledExprSource::compile
+    void enableGraph();
+    //! Graph of shared subexpressions (nullptr unless enabled)
+    ExprGraph* getGraph() const { return graph_.get(); }
+
+    //! Call at each tree transition. Also resets the per-file caches.
     void updateFormulaLeaves();
+    //! Call at each new entry.
     void resetCache();
 
     void replaceAll(char const* from, char const* to);
@@ -36,8 +52,8 @@ namespace multidraw {
   private:
     TTree& tree_;
 
-    std::unordered_map<std::string, TTreeFormulaCached::CachePtr> caches_{};
-    std::list<std::unique_ptr<TTreeFormulaCached>> formulas_{};
+    std::unordered_map<std::string, std::unique_ptr<TTreeFormulaCached>> formulas_{};
+    std::unique_ptr<ExprGraph> graph_{};
   };
 
 }
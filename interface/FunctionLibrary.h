@@ -2,81 +2,141 @@
 #define multidraw_TTreeReaderLibrary_h
 
 #include "TTreeFunction.h"
+#include "TTreeFormulaCached.h"
 
 #include "TTreeReader.h"
 #include "TTreeReaderArray.h"
 #include "TTreeReaderValue.h"
+#include "TDataType.h"
 #include "TString.h"
 
 #include <unordered_map>
 #include <memory>
 #include <functional>
- 
-namespace multidraw {
+#include <typeinfo>
 
-  // Wrappers to facilitate replaceAll() of FunctionLibrary
-  // Background: Functions objects will already have obtained direct pointers to the
-  // TTreeReaderArray/Value objects. I didn't think far enough ahead when designing
-  // FunctionLibrary - another layer of indirection (e.g. handing a pointer of pointer)
-  // would have been better to realize a replaceAll feature. To keep the same memory
-  // address and still be able to replace the object, I use a wrapper + non-allocating
-  // operator new / delete.
+namespace multidraw {
 
-  class TTreeReaderObjectWrapper {
+  class FormulaLibrary;
+
+  //! Base class of the typed branch readers handed out by FunctionLibrary
+  /*!
+   * Plain branches with a single leaf of a basic type are read through the formula of the branch in the
+   * FormulaLibrary. The formula loads the leaf (library formulas do not reload branches already loaded for
+   * the current entry by other formulas), and the values are read directly from the leaf buffer without
+   * conversion. A branch used by expressions and functions is therefore deserialized once per entry. Other
+   * branches (objects, STL collections, leaf lists) are read through a TTreeReaderArray or TTreeReaderValue.
+   * Functions hold pointers to the readers, so replaceAll() swaps the underlying TTreeReader object in place.
+   */
+  class BranchReader {
   public:
-    TTreeReaderObjectWrapper() {}
-    virtual ~TTreeReaderObjectWrapper() {}
-    ROOT::Internal::TTreeReaderValueBase* get() const { return obj_; }
-    virtual void replace(TTreeReader& tr, char const* branchName = nullptr) = 0;
+    BranchReader(TTreeFormulaCached* formula, char const* typeName) : formula_(formula), typeName_(typeName) {}
+    virtual ~BranchReader() {}
+
+    //! True if the branch is read through the FormulaLibrary
+    bool isShared() const { return formula_ != nullptr; }
+    char const* getTypeName() const { return typeName_.c_str(); }
+
+    //! Point the TTreeReader object to another branch. Shared readers follow FormulaLibrary::replaceAll().
+    virtual void replace(TTreeReader& tr, char const* branchName) = 0;
+
+    //! ROOT name of the basic type (e.g. "Float_t"); empty for other types
+    template<typename T> static char const* typeName() { return TDataType::GetTypeName(TDataType::GetType(typeid(T))); }
 
   protected:
-    ROOT::Internal::TTreeReaderValueBase* obj_{nullptr};
+    //! Load the leaf for the current entry and return the number of values
+    std::size_t load_();
+    //! Load the leaf for the current entry and return its buffer
+    void* data_();
+
+    TTreeFormulaCached* formula_{nullptr};
+    std::string typeName_{};
   };
 
-  typedef std::unique_ptr<TTreeReaderObjectWrapper> TTreeReaderObjectPtr;
+  typedef std::unique_ptr<BranchReader> BranchReaderPtr;
 
+  //! Array branch reader with the accessors of TTreeReaderArray
   template<typename T>
-  class TTreeReaderArrayWrapper : public TTreeReaderObjectWrapper {
+  class BranchArrayReader : public BranchReader {
   public:
-    TTreeReaderArrayWrapper(TTreeReader& tr, char const* branchName);
-    ~TTreeReaderArrayWrapper();
-    void replace(TTreeReader& tr, char const* branchName = nullptr) override;
+    BranchArrayReader(TTreeReader& tr, char const* branchName, TTreeFormulaCached* formula);
+    void replace(TTreeReader& tr, char const* branchName) override;
+
+    std::size_t GetSize() { return reader_ ? reader_->GetSize() : load_(); }
+    T& At(std::size_t i) { return reader_ ? reader_->At(i) : static_cast<T*>(data_())[i]; }
+    T& operator[](std::size_t i) { return At(i); }
+
+  private:
+    std::unique_ptr<TTreeReaderArray<T>> reader_{};
   };
 
+  //! Scalar branch reader with the accessors of TTreeReaderValue
   template<typename T>
-  class TTreeReaderValueWrapper : public TTreeReaderObjectWrapper {
+  class BranchValueReader : public BranchReader {
   public:
-    TTreeReaderValueWrapper(TTreeReader& tr, char const* branchName);
-    ~TTreeReaderValueWrapper();
-    void replace(TTreeReader& tr, char const* branchName = nullptr) override;
+    BranchValueReader(TTreeReader& tr, char const* branchName, TTreeFormulaCached* formula);
+    void replace(TTreeReader& tr, char const* branchName) override;
+
+    T* Get() { return reader_ ? reader_->Get() : static_cast<T*>(data_()); }
+    T& operator*() { return *Get(); }
+    T* operator->() { return Get(); }
+
+  private:
+    std::unique_ptr<TTreeReaderValue<T>> reader_{};
   };
 
   class FunctionLibrary {
   public:
-    FunctionLibrary(TTree& tree) : reader_(new TTreeReader(&tree)) {}
+    //! Without a FormulaLibrary, all branches are read through the TTreeReader
+    FunctionLibrary(TTree& tree, FormulaLibrary* formulaLibrary = nullptr) : reader_(new TTreeReader(&tree)), formulaLibrary_(formulaLibrary) {}
     ~FunctionLibrary();
 
-    //! Set the TTreeReader entry number and call beginEvent() of all linked functions
+    //! Set the entry number and call beginEvent() of all linked non-lazy functions
+    /*!
+     * The TTreeReader is positioned immediately only if there are non-lazy functions. Otherwise it is
+     * positioned at the first prepareEvent() of a lazy function (see TTreeFunction::isLazy()). Branches read
+     * through the FormulaLibrary require the formula caches to be reset for the entry beforehand.
+     */
     void setEntry(long long iEntry);
 
+    long long getEntry() const { return entry_; }
+
+    //! Position the TTreeReader at the current entry if not done yet
+    void loadEntry() { if (!entryLoaded_) { reader_->SetEntry(entry_); entryLoaded_ = true; } }
+
+    //! Return the linked instance of the function. Functions with the same key share one instance.
     TTreeFunction& getFunction(TTreeFunction const&);
 
-    template<typename T> TTreeReaderArray<T>& getArray(char const*);
-    template<typename T> TTreeReaderValue<T>& getValue(char const*);
+    //! Reader of the branch (see BranchReader); one reader per branch is shared by all functions
+    template<typename T> BranchArrayReader<T>& getArray(char const*);
+    template<typename T> BranchValueReader<T>& getValue(char const*);
 
     // convenience
-    template<class T> void bindBranch(TTreeReaderArray<T>*&, char const*);
-    template<class T> void bindBranch(TTreeReaderValue<T>*&, char const*);
+    template<class T> void bindBranch(BranchArrayReader<T>*&, char const*);
+    template<class T> void bindBranch(BranchValueReader<T>*&, char const*);
 
-    // swap branch pointers
+    //! Swap branch pointers. Must be called after FormulaLibrary::replaceAll().
     void replaceAll(char const* from, char const* to);
 
     void addDestructorCallback(std::function<void(void)> const& f) { destructorCallbacks_.push_back(f); }
 
   private:
+    //! Formula of the branch if it can be read through the FormulaLibrary, nullptr otherwise
+    TTreeFormulaCached* getSharedFormula_(char const* bname, char const* typeName);
+
     std::unique_ptr<TTreeReader> reader_{};
-    std::unordered_map<std::string, TTreeReaderObjectPtr> branchReaders_{};
-    std::unordered_map<TTreeFunction const*, std::unique_ptr<TTreeFunction>> functions_{};
+    FormulaLibrary* formulaLibrary_{nullptr};
+    std::unordered_map<std::string, BranchReaderPtr> branchReaders_{};
+    std::vector<std::unique_ptr<TTreeFunction>> functions_{};
+    //! Linked instances indexed by the address of the source function
+    std::unordered_map<TTreeFunction const*, TTreeFunction*> functionsBySource_{};
+    //! Linked instances indexed by TTreeFunction::getKey()
+    std::unordered_map<std::string, TTreeFunction*> functionsByKey_{};
+    std::vector<TTreeFunction*> eagerFunctions_{};
+    std::vector<TTreeFunction*> lazyFunctions_{};
+
+    long long entry_{-1};
+    bool entryLoaded_{false};
 
     std::vector<std::function<void(void)>> destructorCallbacks_;
   };
@@ -86,53 +146,39 @@ namespace multidraw {
 #include <sstream>
 
 template<typename T>
-multidraw::TTreeReaderArrayWrapper<T>::TTreeReaderArrayWrapper(TTreeReader& _tr, char const* _branchName) :
-  TTreeReaderObjectWrapper()
+multidraw::BranchArrayReader<T>::BranchArrayReader(TTreeReader& _tr, char const* _branchName, TTreeFormulaCached* _formula) :
+  BranchReader(_formula, typeName<T>())
 {
-  void* mem{::operator new(sizeof(TTreeReaderArray<T>))};
-  obj_ = new(mem) TTreeReaderArray<T>(_tr, _branchName);
-}
-
-template<typename T>
-multidraw::TTreeReaderArrayWrapper<T>::~TTreeReaderArrayWrapper()
-{
-  static_cast<TTreeReaderArray<T>*>(obj_)->~TTreeReaderArray<T>();
-  ::operator delete(obj_);
+  if (formula_ == nullptr)
+    reader_.reset(new TTreeReaderArray<T>(_tr, _branchName));
 }
 
 template<typename T>
 void
-multidraw::TTreeReaderArrayWrapper<T>::replace(TTreeReader& _tr, char const* _branchName/* = nullptr*/)
-{
-  static_cast<TTreeReaderArray<T>*>(obj_)->~TTreeReaderArray<T>();
-  new(obj_) TTreeReaderArray<T>(_tr, _branchName);
-}
-
-template<typename T>
-multidraw::TTreeReaderValueWrapper<T>::TTreeReaderValueWrapper(TTreeReader& _tr, char const* _branchName) :
-  TTreeReaderObjectWrapper()
+multidraw::BranchArrayReader<T>::replace(TTreeReader& _tr, char const* _branchName)
 {
-  void* mem{::operator new(sizeof(TTreeReaderValue<T>))};
-  obj_ = new(mem) TTreeReaderValue<T>(_tr, _branchName);
+  if (reader_)
+    reader_.reset(new TTreeReaderArray<T>(_tr, _branchName));
 }
 
 template<typename T>
-multidraw::TTreeReaderValueWrapper<T>::~TTreeReaderValueWrapper()
+multidraw::BranchValueReader<T>::BranchValueReader(TTreeReader& _tr, char const* _branchName, TTreeFormulaCached* _formula) :
+  BranchReader(_formula, typeName<T>())
 {
-  static_cast<TTreeReaderValue<T>*>(obj_)->~TTreeReaderValue<T>();
-  ::operator delete(obj_);
+  if (formula_ == nullptr)
+    reader_.reset(new TTreeReaderValue<T>(_tr, _branchName));
 }
 
 template<typename T>
 void
-multidraw::TTreeReaderValueWrapper<T>::replace(TTreeReader& _tr, char const* _branchName/* = nullptr*/)
+multidraw::BranchValueReader<T>::replace(TTreeReader& _tr, char const* _branchName)
 {
-  static_cast<TTreeReaderValue<T>*>(obj_)->~TTreeReaderValue<T>();
-  new(obj_) TTreeReaderValue<T>(_tr, _branchName);
+  if (reader_)
+    reader_.reset(new TTreeReaderValue<T>(_tr, _branchName));
 }
 
 template<typename T>
-TTreeReaderArray<T>&
+multidraw::BranchArrayReader<T>&
 multidraw::FunctionLibrary::getArray(char const* _bname)
 {
   auto rItr(branchReaders_.find(_bname));
@@ -142,21 +188,20 @@ multidraw::FunctionLibrary::getArray(char const* _bname)
       ss << "Branch " << _bname << " does not exist" << std::endl;
       throw std::runtime_error(ss.str());
     }
-    auto* arr(new TTreeReaderArrayWrapper<T>(*reader_, _bname));
-    // TODO want to check if T is the correct type
+    auto* arr(new BranchArrayReader<T>(*reader_, _bname, getSharedFormula_(_bname, BranchReader::typeName<T>())));
     rItr = branchReaders_.emplace(_bname, arr).first;
   }
-  else if (dynamic_cast<TTreeReaderArray<T>*>(rItr->second->get()) == nullptr) {
+  else if (dynamic_cast<BranchArrayReader<T>*>(rItr->second.get()) == nullptr) {
     std::stringstream ss;
-    ss << "Branch " << _bname << " is not an array" << std::endl;
+    ss << "Branch " << _bname << " is not an array of " << BranchReader::typeName<T>() << std::endl;
     throw std::runtime_error(ss.str());
   }
 
-  return *static_cast<TTreeReaderArray<T>*>(rItr->second->get());
+  return *static_cast<BranchArrayReader<T>*>(rItr->second.get());
 }
 
 template<typename T>
-TTreeReaderValue<T>&
+multidraw::BranchValueReader<T>&
 multidraw::FunctionLibrary::getValue(char const* _bname)
 {
   auto rItr(branchReaders_.find(_bname));
@@ -166,47 +211,47 @@ multidraw::FunctionLibrary::getValue(char const* _bname)
       ss << "Branch " << _bname << " does not exist" << std::endl;
       throw std::runtime_error(ss.str());
     }
-    auto* val(new TTreeReaderValueWrapper<T>(*reader_, _bname));
-    rItr = branchReaders_.emplace(_bname, val).first; 
+    auto* val(new BranchValueReader<T>(*reader_, _bname, getSharedFormula_(_bname, BranchReader::typeName<T>())));
+    rItr = branchReaders_.emplace(_bname, val).first;
   }
-  else if (dynamic_cast<TTreeReaderValue<T>*>(rItr->second->get()) == nullptr) {
+  else if (dynamic_cast<BranchValueReader<T>*>(rItr->second.get()) == nullptr) {
     std::stringstream ss;
-    ss << "Branch " << _bname << " is not a value" << std::endl;
+    ss << "Branch " << _bname << " is not a value of " << BranchReader::typeName<T>() << std::endl;
     throw std::runtime_error(ss.str());
   }
 
-  return *static_cast<TTreeReaderValue<T>*>(rItr->second->get());
+  return *static_cast<BranchValueReader<T>*>(rItr->second.get());
 }
 
 template<class T>
 void
-multidraw::FunctionLibrary::bindBranch(TTreeReaderValue<T>*& _reader, char const* _bname)
+multidraw::FunctionLibrary::bindBranch(BranchValueReader<T>*& _reader, char const* _bname)
 {
   _reader = &getValue<T>(_bname);
 }
 
 template<class T>
 void
-multidraw::FunctionLibrary::bindBranch(TTreeReaderArray<T>*& _reader, char const* _bname)
+multidraw::FunctionLibrary::bindBranch(BranchArrayReader<T>*& _reader, char const* _bname)
 {
   _reader = &getArray<T>(_bname);
 }
 
-typedef TTreeReaderArray<Float_t> FloatArrayReader;
-typedef TTreeReaderValue<Float_t> FloatValueReader;
-typedef TTreeReaderArray<Double_t> DoubleArrayReader;
-typedef TTreeReaderValue<Double_t> DoubleValueReader;
-typedef TTreeReaderArray<Int_t> IntArrayReader;
-typedef TTreeReaderValue<Int_t> IntValueReader;
-typedef TTreeReaderArray<Bool_t> BoolArrayReader;
-typedef TTreeReaderValue<Bool_t> BoolValueReader;
-typedef TTreeReaderArray<UChar_t> UCharArrayReader;
-typedef TTreeReaderValue<UChar_t> UCharValueReader;
-typedef TTreeReaderArray<UInt_t> UIntArrayReader;
-typedef TTreeReaderValue<UInt_t> UIntValueReader;
-typedef TTreeReaderArray<Long64_t> LongArrayReader;
-typedef TTreeReaderValue<Long64_t> LongValueReader;
-typedef TTreeReaderValue<ULong64_t> ULong64ValueReader;
+typedef multidraw::BranchArrayReader<Float_t> FloatArrayReader;
+typedef multidraw::BranchValueReader<Float_t> FloatValueReader;
+typedef multidraw::BranchArrayReader<Double_t> DoubleArrayReader;
+typedef multidraw::BranchValueReader<Double_t> DoubleValueReader;
+typedef multidraw::BranchArrayReader<Int_t> IntArrayReader;
+typedef multidraw::BranchValueReader<Int_t> IntValueReader;
+typedef multidraw::BranchArrayReader<Bool_t> BoolArrayReader;
+typedef multidraw::BranchValueReader<Bool_t> BoolValueReader;
+typedef multidraw::BranchArrayReader<UChar_t> UCharArrayReader;
+typedef multidraw::BranchValueReader<UChar_t> UCharValueReader;
+typedef multidraw::BranchArrayReader<UInt_t> UIntArrayReader;
+typedef multidraw::BranchValueReader<UInt_t> UIntValueReader;
+typedef multidraw::BranchArrayReader<Long64_t> LongArrayReader;
+typedef multidraw::BranchValueReader<Long64_t> LongValueReader;
+typedef multidraw::BranchValueReader<ULong64_t> ULong64ValueReader;
 typedef std::unique_ptr<FloatArrayReader> FloatArrayReaderPtr;
 typedef std::unique_ptr<FloatValueReader> FloatValueReaderPtr;
 typedef std::unique_ptr<DoubleArrayReader> DoubleArrayReaderPtr;
@@ -3,6 +3,8 @@
 
 #include "Plot1DFiller.h"
 #include "Plot2DFiller.h"
+#include "PlotNDFiller.h"
+#include "PlotGroupFiller.h"
 #include "TreeFiller.h"
 #include "Cut.h"
 #include "Reweight.h"
@@ -21,6 +23,7 @@
 #include <atomic>
 #include <tuple>
 #include <array>
+#include <functional>
 
 #include <set> 
 
@@ -46,6 +49,11 @@ namespace multidraw {
    */
   class MultiDraw {
   public:
+    enum MultiplexingMode {
+      kThreads,
+      kProcesses
+    };
+
     //! Constructor.
     /*!
      * \param treeName  Name of the input tree.
@@ -96,7 +104,11 @@ namespace multidraw {
     void setCategorization(char const* cutName, char const* expr);
 
     //! Add a new alias, computed as a function of other branches
-    void addAlias(char const* name, char const* expr);
+    /*!
+     * If perFile is true, the expression is assumed to be constant within each input file (e.g. a
+     * dataset ID or a cross section branch) and is evaluated only once per file.
+     */
+    void addAlias(char const* name, char const* expr, bool perFile = false);
 
     //! Add a new alias, computed as a function of other branches
     void addAlias(char const* name, TTreeFunction const& func);
@@ -124,8 +136,9 @@ namespace multidraw {
      * the value of expr in every event is used as the weight. If instead a TH1,
      * TGraph, or TF1 is passed as the second argument, the value of expr is used
      * to look up the y value of the source object, which is used as the weight.
+     * If perFile is true, expr is evaluated only once per input file.
      */
-    void setReweight(char const* expr, TObject const* source = nullptr);
+    void setReweight(char const* expr, TObject const* source = nullptr, bool perFile = false);
 
     //! Set an overall reweight
     /*!
@@ -133,8 +146,9 @@ namespace multidraw {
      * the value of expr in every event is used as the weight. If instead a TH2
      * or TF2 is passed as the second argument, the value of xexpr and yexpr is used
      * to look up the z value of the source object, which is used as the weight.
+     * If perFile is true, xexpr and yexpr are evaluated only once per input file.
      */
-    void setReweight(char const* xexpr, char const* yexpr, TObject const* source = nullptr);
+    void setReweight(char const* xexpr, char const* yexpr, TObject const* source = nullptr, bool perFile = false);
 
     //! Set an overall reweight
     /*!
@@ -185,6 +199,24 @@ namespace multidraw {
     Plot2DFiller& addPlotList2D(TObjArray* histlist, char const* xexpr, char const* yexpr, char const* cutName, char const* reweight = "");
 
     Plot2DFiller& addPlotList2D(TObjArray* histlist, TTreeFunction const& xexpr, TTreeFunction const& yexpr, char const* cutName, char const* reweight = "");
+
+    //! Add an N-dimensional histogram (THn or THnSparse) to fill, with one expression per dimension.
+    /*!
+     * Not supported in the process multiplexing mode and with the incremental cache.
+     */
+    PlotNDFiller& addPlotND(THnBase* hist, std::vector<TString> const& exprs, char const* cutName = "", char const* reweight = "");
+
+    //! Add N-dimensional histograms to fill by a category group.
+    PlotNDFiller& addPlotListND(TObjArray* histlist, std::vector<TString> const& exprs, char const* cutName, char const* reweight = "");
+    
+    //! Add a group of 1D histograms filled with one expression under different cuts.
+    /*!
+     * Histograms are added to the returned group with PlotGroupFiller::addPlot() and addPlotList().
+     * The expression is evaluated once per instance for all histograms of the group.
+     */
+    PlotGroupFiller& addPlotGroup(char const* expr, char const* reweight = "");
+
+    PlotGroupFiller& addPlotGroup(TTreeFunction const& func, char const* reweight = "");
     
     //! Add a tree to fill.
     TreeFiller& addTree(TTree* tree, char const* cutName = "", char const* reweight = "");
@@ -201,6 +233,30 @@ namespace multidraw {
     //! Run and fill the plots and trees.
     void execute(long nEntries = -1, unsigned long firstEntry = 0);
 
+    //! Reuse the results of earlier executions stored in a cache file.
+    /*!
+     * When the path is not empty, execute() stores the histograms and trees filled from the input files
+     * into the given ROOT file, as a partial result per group of files processed together. Subsequent
+     * executions only process the files that are not covered by a cached group and add the cached partial
+     * results to the objects. A group is invalidated when any of its files changes (path, size, or
+     * modification time) or is removed from the input, and the entire cache is invalidated when the
+     * configuration (expressions, cuts, weights, binning, etc.) changes. Functions are identified by their
+     * key or name only. Cut and filler counts are cached together with the objects. Incremental execution
+     * cannot be combined with entry ranges, entry lists, friend trees, or tree-by-tree weights.
+     * If groupSize > 0, new files are processed and saved in groups of at most groupSize files.
+     */
+    void setIncrementalCache(char const* path, unsigned groupSize = 0);
+
+    //! Save the progress of execute() periodically.
+    /*!
+     * The input files are processed in groups of nFiles files, and the results of each group (histograms,
+     * trees, counts) are saved to the given file when the group is completed. If the job is interrupted,
+     * the next execute() call with the same configuration and inputs resumes after the last saved group.
+     * The checkpoint file is deleted when execute() completes. The same restrictions as in the incremental
+     * mode (see setIncrementalCache) apply. Pass an empty path to disable.
+     */
+    void setCheckpoint(char const* path, unsigned nFiles);
+
     //! Set input tree multiplexing.
     /*
      * If multiplex > 1, execute() will launch multiple processes to process parts of the input. This
@@ -208,6 +264,17 @@ namespace multidraw {
      */
     void setInputMultiplexing(unsigned mux) { inputMultiplexing_ = mux; }
 
+    //! Set how the input multiplexing is parallelized.
+    /*
+     * kThreads (default): parts of the input are processed in threads, filling thread-local clones of the
+     * histograms and trees that are merged at the end.
+     * kProcesses: worker processes are forked, avoiding the contention on the global state of ROOT.
+     * Histogram contents of the workers are summed in shared memory, and trees are written to temporary
+     * files in gSystem->TempDirectory() that are merged into the output trees at the end. TProfile and
+     * THnBase are not supported in this mode. Unlike in thread mode, cut and filler counts include all processes.
+     */
+    void setMultiplexingMode(MultiplexingMode m) { multiplexingMode_ = m; }
+
     //! Set the print level.
     /*
      * Level -1: silent
@@ -233,11 +300,29 @@ namespace multidraw {
      */
     void setAbortOnReadError(bool a) { doAbortOnReadError_ = a; }
 
+    //! Evaluate common subexpressions only once.
+    /*
+     * If true, string expressions of cuts, plots, and reweights are decomposed into a graph of
+     * subexpressions shared among all expressions, and each distinct subexpression is evaluated once
+     * per event and instance. Useful when many expressions contain the same complex terms.
+     */
+    void setFactorizeExpressions(bool f) { doFactorizeExpressions_ = f; }
+
+    //! Warm up the next files of the input while the current file is processed.
+    /*
+     * If n > 0, each thread asks the kernel in the background to read ahead the headers and metadata
+     * of the next n local input files, so that file transitions do not wait for the storage.
+     */
+    void setPrefetchFiles(unsigned n) { prefetchDepth_ = n; }
+
     long getTotalEvents() const { return totalEvents_; }
 
     unsigned numObjs() const;
 
   private:
+    friend class MultiDrawGroup;
+    friend class MultiDrawBatch;
+
     //! Handle addPlot and addTree with the same interface (requires a callback to generate the right object)
     Cut& findCut_(char const* cutName) const;
 
@@ -245,15 +330,26 @@ namespace multidraw {
     Plot2DFiller& addPlot2D_(TH2* hist, CompiledExprSource const& xsource, CompiledExprSource const& ysource, char const* cutName, char const* reweight);
     Plot1DFiller& addPlotList_(TObjArray* histlist, CompiledExprSource const& source, char const* cutName, char const* reweight, Plot1DFiller::OverflowMode mode);
     Plot2DFiller& addPlotList2D_(TObjArray* histlist, CompiledExprSource const& xsource, CompiledExprSource const& ysource, char const* cutName, char const* reweight);
+    PlotGroupFiller& addPlotGroup_(CompiledExprSource const& source, char const* reweight);
+
+    //! Throw if a histogram filled from shared threads is also filled by another filler of the drawers
+    static void checkSharedFill_(std::vector<MultiDraw const*> const&);
+
+    //! Cuts without fillers are skipped unless they are the event filter or used by a plot group of the filter
+    static bool isActiveCut_(Cut const& filter, TString const& name, Cut const& cut);
     
     struct SynchTools {
       std::thread::id mainThread;
       std::mutex mutex;
       std::condition_variable condition;
       bool mainDone{false};
+      //! Add the cut and filler counts of the thread clones to the main objects
+      bool mergeCounts{false};
       std::atomic_ullong totalEvents{0};
     };
 
+    class EventProcessor;
+
     //! Core of the execute function
     /*
       treeNumberOffset: The offset of the given tree with respect to the original
@@ -265,6 +361,23 @@ namespace multidraw {
     long executeOne_(long nEntries, unsigned long firstEntry, TChain&, SynchTools&, unsigned treeNumberOffset = 0, bool byTree = false);
 #endif
 
+    //! Estimated work of each file from the metadata (entry list, entries seen in earlier executions, or file size)
+    std::vector<double> estimateFileWork_(std::vector<TString> const& fileNames) const;
+    //! Split the files into nParts contiguous ranges of similar total work. Returns nParts + 1 boundary indices.
+    std::vector<unsigned> partitionFiles_(std::vector<TString> const& fileNames, unsigned nParts) const;
+
+    //! Execute over the current inputPaths_
+    void executeInputs_(long nEntries, unsigned long firstEntry);
+    //! Execute with the incremental cache (also used for checkpointing)
+    void executeIncremental_();
+    //! Collect the cuts used in executeOne_ and the histograms and trees filled by them
+    void collectOutputs_(std::vector<Cut*>&, std::vector<TH1*>&, std::vector<TTree*>&) const;
+    //! String identifying the configuration of the execution
+    TString getSignature_() const;
+
+    //! Run the tasks in forked processes and the main task in this process, and merge the results
+    void executeForked_(std::vector<std::function<void()>> const& tasks, std::function<void()> const& mainTask, SynchTools&);
+
     TString treeName_{"events"};
     std::vector<TString> inputPaths_{};
 
@@ -279,6 +392,7 @@ namespace multidraw {
     TString evtNumBranchName_{""};
 
     unsigned inputMultiplexing_{1};
+    MultiplexingMode multiplexingMode_{kThreads};
     unsigned prescale_{1};
 
     CutPtr filter_{};
@@ -295,8 +409,18 @@ namespace multidraw {
     int printLevel_{0};
     bool doTimeProfile_{false};
     bool doAbortOnReadError_{false};
+    bool doFactorizeExpressions_{false};
+    unsigned prefetchDepth_{0};
+    TString incrementalCachePath_{};
+    unsigned cacheGroupSize_{0};
+    bool removeCacheOnCompletion_{false};
+
+    //! Configurations filled in the same event loop (set by MultiDrawGroup during execution)
+    std::vector<MultiDraw*> companions_{};
 
     long long totalEvents_{0};
+    //! Number of entries of each input file seen in earlier executions
+    std::map<TString, long long> fileEntries_{};
   };
 
 }
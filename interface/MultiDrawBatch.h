@@ -0,0 +1,57 @@
+#ifndef multidraw_MultiDrawBatch_h
+#define multidraw_MultiDrawBatch_h
+
+#include "MultiDraw.h"
+
+#include <vector>
+
+namespace multidraw {
+
+  //! Run many independent MultiDraw objects on a common pool of threads.
+  /*!
+   * Usage
+   *  MultiDrawBatch batch(32);
+   *  for (auto& sample : samples)
+   *    batch.addDrawer(sample.drawer);
+   *  batch.execute();
+   *
+   * The input files of each drawer are split into contiguous work units (at most one per thread, using the
+   * same work estimate as the file partitioning of MultiDraw::execute), and the work units of all drawers
+   * are processed by the threads in the order of decreasing estimated work. Small and large samples are
+   * therefore interleaved and the threads stay busy until the end of the batch. Each work unit fills
+   * thread-local clones of the outputs of its drawer, which are merged back (including the cut and filler
+   * counts) when the unit is completed. The input multiplexing settings of the drawers are ignored. Drawers
+   * with friend trees, incremental cache, or checkpoints cannot be executed in a batch.
+   */
+  class MultiDrawBatch {
+  public:
+    MultiDrawBatch(unsigned nThreads = 1) : nThreads_(nThreads) {}
+
+    //! Add a drawer. The object must stay alive until execute() returns.
+    void addDrawer(MultiDraw&);
+
+    //! Set the number of worker threads.
+    void setNThreads(unsigned n) { nThreads_ = n; }
+
+    //! Set the print level.
+    /*
+     * Level -1: silent
+     * Level  0: print the number of completed work units
+     * Level  1: additionally print the number of events of each drawer
+     */
+    void setPrintLevel(int l) { printLevel_ = l; }
+
+    //! Process all drawers.
+    void execute();
+
+    unsigned getNDrawers() const { return drawers_.size(); }
+
+  private:
+    std::vector<MultiDraw*> drawers_{};
+    unsigned nThreads_{1};
+    int printLevel_{0};
+  };
+
+}
+
+#endif
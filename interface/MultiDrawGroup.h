@@ -0,0 +1,47 @@
+#ifndef multidraw_MultiDrawGroup_h
+#define multidraw_MultiDrawGroup_h
+
+#include "MultiDraw.h"
+
+#include <vector>
+
+namespace multidraw {
+
+  //! Run several MultiDraw configurations in one pass over their common input.
+  /*!
+   * Usage
+   *  MultiDrawGroup group;
+   *  group.addDrawer(analysis);
+   *  group.addDrawer(controlRegion);
+   *  group.execute();
+   *
+   * All drawers must have the same tree name, input paths, entry list, and branch replacements. The
+   * input is read once, and the aliases, filter, cuts, weights, and fillers of each drawer are evaluated
+   * against the same formula library, so that branches and expressions common to the drawers are read
+   * and evaluated only once per event. The outputs and weights of the drawers are kept separate. The
+   * execution settings (multiplexing, prefetching, print level, etc.) and the friend trees of the first
+   * drawer are used; the other drawers may not have friend trees. Alias names must be unique across the
+   * drawers. Incremental execution is not supported.
+   */
+  class MultiDrawGroup {
+  public:
+    MultiDrawGroup() {}
+
+    //! Add a drawer. The object must stay alive until execute() returns.
+    void addDrawer(MultiDraw&);
+
+    //! Run and fill the plots and trees of all drawers.
+    void execute(long nEntries = -1, unsigned long firstEntry = 0);
+
+    unsigned getNDrawers() const { return drawers_.size(); }
+
+  private:
+    //! Name of an alias of the drawer also defined in one of the first nDrawers drawers of the group (empty if none)
+    TString findAliasCollision_(MultiDraw const&, unsigned nDrawers) const;
+
+    std::vector<MultiDraw*> drawers_{};
+  };
+
+}
+
+#endif
@@ -2,10 +2,13 @@
 #define multidraw_Plot1DFiller_h
 
 #include "ExprFiller.h"
+#include "FastAxis.h"
 
 #include "TH1.h"
 #include "TObjArray.h"
 
+#include <map>
+
 namespace multidraw {
 
   //! A wrapper class for TH1
@@ -37,15 +40,79 @@ namespace multidraw {
 
     unsigned getNdim() const override { return 1; }
 
+    //! Fill the histograms directly from all threads instead of thread-local copies.
+    /*!
+     * Bins are updated under striped locks (see SharedBinArray), so the memory footprint does not depend
+     * on the number of threads and nothing is merged at the end, at the cost of lock contention. The sum
+     * of squared weights is always stored. Only TH1D and TH1F histograms without buffers, extendable axes,
+     * or axis ranges are supported.
+     */
+    void setSharedFill(bool);
+    bool getSharedFill() const { return sharedFill_; }
+
+    TString getSignature() const override;
+
   private:
+    friend class PlotGroupFiller;
+
     Plot1DFiller(TH1& hist, Plot1DFiller const&);
     Plot1DFiller(TObjArray& hist, Plot1DFiller const&);
 
+    void initialize_() override;
     void doFill_(unsigned, int icat = -1) override;
+    void finalize_() override;
     ExprFiller* clone_() override;
     void mergeBack_() override;
 
+    //! Fill an evaluated value with entryWeight_ (also used by PlotGroupFiller)
+    void fillValue_(double x, int icat);
+
+    //! Add entryWeight_ to the bin and update the statistics (Bins = FastBinArray or LocalBinArray)
+    template<class Bins> void fillBin_(Bins&, int bin, int nbins, double x);
+
     OverflowMode overflowMode_{kDefault};
+
+    //! Axis and fill method of each histogram, set up in initialize_()
+    /*!
+     * Thread clones share the histograms of the original filler. Their fills are collected in a LocalBinArray
+     * when possible, and in a full copy of the histogram otherwise.
+     */
+    struct FillTarget {
+      enum Mode {
+        kHist, //!< TH1::Fill of hist
+        kDirect, //!< bins
+        kLocal, //!< local (thread clones)
+        kShared //!< shared
+      };
+
+      FastAxis axis{};
+      Mode mode{kHist};
+      TH1* hist{nullptr};
+      FastBinArray bins{};
+      LocalBinArray local{};
+      SharedBinFiller shared{};
+      //! Thread-local copy of the histogram (thread clones in kHist mode)
+      std::unique_ptr<TH1> clone{};
+      //! Fills in kHist mode are collected and passed to FillN (except for profiles)
+      bool buffered{false};
+      std::vector<double> xBuffer{};
+      std::vector<double> wBuffer{};
+      double lastLowEdge{0.};
+      double lastUpEdge{0.};
+    };
+
+    //! Pass the buffered fills of the target to FillN
+    void flushBuffer_(FillTarget&);
+
+    enum {
+      kFillBufferSize = 256
+    };
+
+    std::vector<FillTarget> targets_{};
+
+    bool sharedFill_{false};
+    //! Keyed by histogram, used by the thread clones too (original filler only)
+    std::map<TH1 const*, std::unique_ptr<SharedBinArray>> sharedBins_{};
   };
 
 }
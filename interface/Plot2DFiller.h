@@ -2,10 +2,13 @@
 #define multidraw_Plot2DFiller_h
 
 #include "ExprFiller.h"
+#include "FastAxis.h"
 
 #include "TH2.h"
 #include "TObjArray.h"
 
+#include <map>
+
 namespace multidraw {
 
   //! A wrapper class for TH2
@@ -29,13 +32,66 @@ namespace multidraw {
 
     unsigned getNdim() const override { return 2; }
 
+    //! Fill the histograms directly from all threads instead of thread-local copies.
+    /*!
+     * Bins are updated under striped locks (see SharedBinArray), so the memory footprint does not depend
+     * on the number of threads and nothing is merged at the end, at the cost of lock contention. The sum
+     * of squared weights is always stored. Only TH2D and TH2F histograms without buffers, extendable axes,
+     * or axis ranges are supported.
+     */
+    void setSharedFill(bool);
+    bool getSharedFill() const { return sharedFill_; }
+
   private:
     Plot2DFiller(TH2& hist, Plot2DFiller const&);
     Plot2DFiller(TObjArray& histlist, Plot2DFiller const&);
 
+    void initialize_() override;
     void doFill_(unsigned, int icat = -1) override;
+    void finalize_() override;
     ExprFiller* clone_() override;
     void mergeBack_() override;
+
+    //! Add entryWeight_ to the bin and update the statistics (Bins = FastBinArray or LocalBinArray)
+    template<class Bins> void fillBin_(Bins&, int bin, bool inRange, double x, double y);
+
+    //! Axes and fill method of each histogram, set up in initialize_() (see Plot1DFiller)
+    struct FillTarget {
+      enum Mode {
+        kHist, //!< TH2::Fill of hist
+        kDirect, //!< bins
+        kLocal, //!< local (thread clones)
+        kShared //!< shared
+      };
+
+      FastAxis xaxis{};
+      FastAxis yaxis{};
+      Mode mode{kHist};
+      TH2* hist{nullptr};
+      FastBinArray bins{};
+      LocalBinArray local{};
+      SharedBinFiller shared{};
+      //! Thread-local copy of the histogram (thread clones in kHist mode)
+      std::unique_ptr<TH2> clone{};
+      //! Fills in kHist mode are collected and passed to FillN (except for profiles)
+      bool buffered{false};
+      std::vector<double> xBuffer{};
+      std::vector<double> yBuffer{};
+      std::vector<double> wBuffer{};
+    };
+
+    //! Pass the buffered fills of the target to FillN
+    void flushBuffer_(FillTarget&);
+
+    enum {
+      kFillBufferSize = 256
+    };
+
+    std::vector<FillTarget> targets_{};
+
+    bool sharedFill_{false};
+    //! Keyed by histogram, used by the thread clones too (original filler only)
+    std::map<TH1 const*, std::unique_ptr<SharedBinArray>> sharedBins_{};
   };
 
 }
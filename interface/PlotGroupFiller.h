@@ -0,0 +1,75 @@
+#ifndef multidraw_PlotGroupFiller_h
+#define multidraw_PlotGroupFiller_h
+
+#include "ExprFiller.h"
+#include "Plot1DFiller.h"
+#include "Cut.h"
+
+#include "TH1.h"
+#include "TObjArray.h"
+
+namespace multidraw {
+
+  //! One expression filled into histograms under many cuts
+  /*!
+   * The class is to be used within MultiDraw, and is instantiated by addPlotGroup(). Histograms are registered
+   * together with the name of the cut that selects them by addPlot() and addPlotList(). The expression is
+   * evaluated once per instance and event, and the value is filled into the histograms of all cuts that the
+   * instance passes, in the category the instance falls in. The result is identical to calling
+   * MultiDraw::addPlot() with the same expression and reweight for each histogram, but the evaluation cost
+   * does not grow with the number of histograms.
+   * The group is attached to the event filter and fills after all cuts of the event are evaluated. As for
+   * other fillers, its count is the number of instances filled, i.e. those that entered at least one histogram.
+   * The histogram array is named after the expression.
+   */
+  class PlotGroupFiller : public ExprFiller {
+  public:
+    PlotGroupFiller(CompiledExprSource const& expr, char const* reweight = "");
+    ~PlotGroupFiller();
+
+    //! Register a histogram filled for instances passing the cut (empty name = event filter)
+    Plot1DFiller& addPlot(TH1* hist, char const* cutName = "", Plot1DFiller::OverflowMode mode = Plot1DFiller::kDefault);
+    //! Register a list of histograms, one per category of the cut
+    Plot1DFiller& addPlotList(TObjArray* histlist, char const* cutName, Plot1DFiller::OverflowMode mode = Plot1DFiller::kDefault);
+
+    unsigned getNPlots() const { return members_.size(); }
+    Plot1DFiller const& getPlot(unsigned i) const { return *members_.at(i).filler; }
+    Plot1DFiller& getPlot(unsigned i) { return *members_.at(i).filler; }
+
+    unsigned getNdim() const override { return 1; }
+
+    //! True if any of the histograms is filled under the cut
+    bool hasCut(TString const& cutName) const;
+    //! Point the histograms to the cut objects used in the current thread
+    void bindCuts(Cut const& filter, std::vector<CutPtr> const& cuts);
+
+    void fill(std::vector<double> const& eventWeights, std::vector<int> const& categories) override;
+
+    TString getSignature() const override;
+
+  private:
+    PlotGroupFiller(TObjArray& hists, PlotGroupFiller const&);
+
+    void initialize_() override;
+    //! Not used; fill() is overridden
+    void doFill_(unsigned, int = -1) override {}
+    void finalize_() override;
+    ExprFiller* clone_() override;
+    void mergeBack_() override;
+
+    struct Member {
+      TString cutName{};
+      std::unique_ptr<Plot1DFiller> filler{};
+      //! Filled with a histogram list (one histogram per category)
+      bool categorized{false};
+      Cut const* cut{nullptr};
+    };
+
+    std::vector<Member> members_{};
+    //! Members whose cut passed in the current event
+    std::vector<Member*> activeMembers_{};
+  };
+
+}
+
+#endif
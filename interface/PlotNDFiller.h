@@ -0,0 +1,54 @@
+#ifndef multidraw_PlotNDFiller_h
+#define multidraw_PlotNDFiller_h
+
+#include "ExprFiller.h"
+
+#include "THnBase.h"
+#include "TObjArray.h"
+
+#include <vector>
+
+namespace multidraw {
+
+  //! A wrapper class for THnBase (THn and THnSparse)
+  /*!
+   * The class is to be used within MultiDraw, and is instantiated by addPlotND().
+   * Arguments:
+   *  hist     The actual histogram object (the user is responsible for creating it)
+   *  sources  Expressions whose evaluated values give the coordinates, one per histogram dimension
+   *  reweight If provided, evalutaed and used as weight for filling the histogram
+   * All expressions are iterated over in lock step, and each instance is filled with a single bin lookup.
+   * Thread-local copies are always THnSparse, so that a large dense THn is not replicated in every thread.
+   */
+  class PlotNDFiller : public ExprFiller {
+  public:
+    PlotNDFiller(THnBase& hist, std::vector<CompiledExprSource> const& sources, char const* reweight = "");
+    PlotNDFiller(TObjArray& histlist, std::vector<CompiledExprSource> const& sources, char const* reweight = "");
+    PlotNDFiller(PlotNDFiller const&);
+    ~PlotNDFiller() {}
+
+    THnBase const& getHist(int icat = -1) const { return static_cast<THnBase const&>(getObj(icat)); }
+    THnBase& getHist(int icat = -1) { return static_cast<THnBase&>(getObj(icat)); }
+
+    unsigned getNdim() const override { return sources_.size(); }
+
+  private:
+    PlotNDFiller(THnBase& hist, PlotNDFiller const&);
+    PlotNDFiller(TObjArray& histlist, PlotNDFiller const&);
+
+    void checkDimensions_();
+
+    void initialize_() override;
+    void doFill_(unsigned, int icat = -1) override;
+    ExprFiller* clone_() override;
+    void mergeBack_() override;
+
+    //! One per category, set up in initialize_()
+    std::vector<THnBase*> hists_{};
+    //! Coordinates of the current instance
+    std::vector<double> coords_{};
+  };
+
+}
+
+#endif
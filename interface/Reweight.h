@@ -3,18 +3,27 @@
 
 #include "TTreeFormulaCached.h"
 #include "CompiledExpr.h"
+#include "FastAxis.h"
 
 #include "TH1.h"
 #include "TGraph.h"
 #include "TF1.h"
 #include "TSpline.h"
 
-#include <functional>
+#include <array>
+#include <vector>
 
 class TSpline3;
 
 namespace multidraw {
 
+  //! Compiled reweight.
+  /*!
+   * The evaluation type is resolved at construction into an enum, and evaluateLoaded dispatches with a
+   * switch. In the event loop, reweights are handled as flat lists of non-factorized factors (see
+   * collectFactors): load() is called once per event for each factor, and evaluateLoaded() for each
+   * instance.
+   */
   class Reweight {
   public:
     Reweight() {}
@@ -27,22 +36,74 @@ namespace multidraw {
     virtual TObject const* getSource(unsigned i = 0) const { return source_; }
 
     virtual unsigned getNdata();
-    virtual double evaluate(unsigned i = 0) const { if (evaluate_) return evaluate_(i); else return 1.; }
+    //! Evaluate for the given instance, loading the expressions as necessary
+    virtual double evaluate(unsigned i = 0) const;
+
+    //! Append the non-factorized reweights whose product is this reweight
+    virtual void collectFactors(std::vector<Reweight*>& factors) { factors.push_back(this); }
+
+    //! Load the expressions for the current event and return the number of instances (same as getNdata)
+    unsigned load();
+    //! Evaluate for the given instance. load() must have been called for the current event.
+    double evaluateLoaded(unsigned i) const
+    {
+      switch (evalType_) {
+      case kRaw:
+        return exprs_[0]->evaluate(i);
+      case kTH1:
+        return evaluateTH1_(i);
+      case kTGraph:
+        return evaluateTGraph_(i);
+      case kTF1:
+        return evaluateTF1_(i);
+      case kTable:
+        return evaluateTable_(i);
+      default:
+        return 1.;
+      }
+    }
+
+    //! Replace the evaluation of a TGraph or TF1 source with a linear interpolation over a grid of nPoints per dimension
+    void tabulate(unsigned nPoints);
 
   protected:
+    enum EvalType {
+      kUnity,
+      kRaw,
+      kTH1,
+      kTGraph,
+      kTF1,
+      kTable
+    };
+
     void setEvalType_();
-    
-    double evaluateRaw_(unsigned);
-    double evaluateTH1_(unsigned);
-    double evaluateTGraph_(unsigned);
-    double evaluateTF1_(unsigned);
+
+    double evaluateTH1_(unsigned) const;
+    double evaluateTGraph_(unsigned) const;
+    double evaluateTF1_(unsigned) const;
+    double evaluateTable_(unsigned) const;
+
+    //! Exact value of a TGraph or TF1 source
+    double evaluateSource_(double const*) const;
 
     //! One entry per source dimension
     std::vector<CompiledExprPtr> exprs_{};
+    CompiledExprGroup exprGroup_{};
     TObject const* source_{nullptr};
     std::unique_ptr<TSpline3> spline_{};
 
-    std::function<double(unsigned)> evaluate_{};
+    //! Axes and bin contents of a histogram source
+    std::array<FastAxis, 2> histAxes_{};
+    std::vector<double> histContents_{};
+
+    //! Grid of a tabulated source
+    std::array<double, 2> gridMin_{};
+    std::array<double, 2> gridMax_{};
+    std::array<double, 2> gridInvStep_{};
+    std::array<unsigned, 2> gridN_{};
+    std::vector<double> gridValues_{};
+
+    EvalType evalType_{kUnity};
   };
 
   typedef std::unique_ptr<Reweight> ReweightPtr;
@@ -59,6 +120,8 @@ namespace multidraw {
     unsigned getNdata() override { return subReweights_[0]->getNdata(); }
     double evaluate(unsigned i = 0) const override { return subReweights_[0]->evaluate(i) * subReweights_[1]->evaluate(i); }
 
+    void collectFactors(std::vector<Reweight*>&) override;
+
   private:
     std::array<ReweightPtr, 2> subReweights_{};
   };
@@ -79,11 +142,29 @@ namespace multidraw {
       subReweights_[1] = std::make_unique<ReweightSource>(r2);
     }
 
+    //! Declare that all expressions are constant within each file
+    void setPerFile(bool);
+
+    //! Evaluate a TGraph or TF1 source by linear interpolation over a pre-tabulated grid
+    /*!
+     * The source is evaluated at nPoints equidistant points per dimension over its range (the x range of
+     * the graph points or the range of the function) when the reweight is compiled, and the per-event
+     * values are interpolated linearly between the grid points. Values outside the range are computed
+     * exactly. Pass 0 to disable (default). Histogram sources always use a flat copy of the bin contents.
+     */
+    void setTabulation(unsigned nPoints);
+
     ReweightPtr compile(FormulaLibrary&, FunctionLibrary&) const;
 
+    //! String identifying the expressions and the source object
+    TString getSignature() const;
+    //! Signature extended with the addresses of the source objects; equal keys imply identical weights within the process
+    TString getKey() const;
+
   private:
     std::vector<CompiledExprSource> exprs_{};
     TObject const* source_{nullptr};
+    unsigned tabulationPoints_{0};
 
     std::array<std::unique_ptr<ReweightSource>, 2> subReweights_;
   };
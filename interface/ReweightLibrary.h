@@ -0,0 +1,79 @@
+#ifndef multidraw_ReweightLibrary_h
+#define multidraw_ReweightLibrary_h
+
+#include "Reweight.h"
+
+#include <unordered_map>
+#include <vector>
+#include <memory>
+#include <string>
+
+namespace multidraw {
+
+  class FormulaLibrary;
+  class FunctionLibrary;
+
+  //! Compiled reweight shared among fillers, with a per-event cache of the per-instance weights
+  class SharedReweight {
+  public:
+    SharedReweight(ReweightPtr&&);
+    ~SharedReweight() {}
+
+    Reweight const& getReweight() const { return *reweight_; }
+
+    //! Product of all factors for instance i. Computed at the first request in each event.
+    double getWeight(unsigned i)
+    {
+      if (i < cacheEvents_.size() && cacheEvents_[i] == event_)
+        return weights_[i];
+      return computeWeight_(i);
+    }
+
+    //! Invalidate the cached weights
+    void resetCache() { ++event_; }
+
+  private:
+    double computeWeight_(unsigned);
+
+    ReweightPtr reweight_{};
+    //! Non-factorized components of reweight_
+    std::vector<Reweight*> factors_{};
+
+    std::vector<double> weights_{};
+    //! Event counter value at which each element of weights_ was computed
+    std::vector<unsigned long long> cacheEvents_{};
+    unsigned long long event_{1};
+    unsigned long long loadedEvent_{0};
+  };
+
+  //! Per-thread repository of reweights
+  /*!
+   * Fillers with equivalent reweight sources (see ReweightSource::getKey) share one compiled Reweight,
+   * so that the lookup in the histogram, graph, or function is performed once per instance and event
+   * regardless of the number of fillers.
+   */
+  class ReweightLibrary {
+  public:
+    ReweightLibrary(FormulaLibrary& formulaLibrary, FunctionLibrary& functionLibrary) : formulaLibrary_(formulaLibrary), functionLibrary_(functionLibrary) {}
+    ~ReweightLibrary() {}
+
+    //! Return the shared reweight for the source, compiling it at the first request.
+    SharedReweight& getReweight(ReweightSource const&);
+
+    //! Call at each new entry.
+    void resetCache();
+
+    unsigned size() const { return reweights_.size(); }
+
+  private:
+    FormulaLibrary& formulaLibrary_;
+    FunctionLibrary& functionLibrary_;
+
+    std::unordered_map<std::string, std::unique_ptr<SharedReweight>> reweights_{};
+    //! Same objects as in reweights_, for fast iteration
+    std::vector<SharedReweight*> reweightList_{};
+  };
+
+}
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef multidraw_SharedAccumulator_h
+#define multidraw_SharedAccumulator_h
+
+#include "TH1.h"
+
+#include <vector>
+#include <cstddef>
+
+#include <pthread.h>
+
+namespace multidraw {
+
+  //! Accumulator of histogram contents and counters across forked processes.
+  /*!
+   * Maps an anonymous shared memory region large enough to hold the bin contents, sums of squared
+   * weights, statistics, and number of entries of the given histograms, plus a number of integer
+   * counters. Worker processes forked after the construction add their results to the region under a
+   * process-shared mutex, and the parent process adds the sums to its own histograms once all workers
+   * have exited. The same list of histograms (i.e. the same objects in the same order) must be passed
+   * to all function calls. Profile histograms are not supported. If any worker histogram has a sumw2
+   * array, addTo() creates it in the parent histogram, with the unit-weight fills of the others included.
+   */
+  class SharedAccumulator {
+  public:
+    SharedAccumulator(std::vector<TH1*> const&, unsigned nCounters);
+    ~SharedAccumulator();
+
+    //! Add the contents of the histograms and the counter values to the shared region (called in the workers)
+    void add(std::vector<TH1*> const&, std::vector<unsigned long long> const& counters);
+    //! Add the accumulated contents to the histograms (called in the parent)
+    void addTo(std::vector<TH1*> const&) const;
+
+    unsigned long long getCounter(unsigned i) const { return counters_[i]; }
+
+  private:
+    std::vector<std::size_t> offsets_{};
+    unsigned nCounters_{0};
+
+    std::size_t size_{0};
+    char* region_{nullptr};
+    pthread_mutex_t* mutex_{nullptr};
+    unsigned long long* counters_{nullptr};
+    double* data_{nullptr};
+  };
+
+}
+
+#endif
@@ -9,14 +9,18 @@
 
 //! Cached version of TTreeFormula.
 /*!
- * Only the expression values are cached. GetNdata() must be called before calls to EvalInstance.
+ * Only the expression values and the number of data are cached. GetNdata() must be called before
+ * calls to EvalInstance. ResetCache() must be called at each new entry.
  * Note: override keyword in this class definition is commented out to avoid getting compiler
  * warnings (-Winconsistent-missing-override).
  */
 class TTreeFormulaCached : public TTreeFormula {
 public:
   struct Cache {
+    Int_t fNdata{-1};
     std::vector<std::pair<Bool_t, Double_t>> fValues{};
+    //! Values are constant within a file (the owner resets the cache only at file transitions)
+    Bool_t fPerFile{false};
   };
 
   typedef std::shared_ptr<Cache> CachePtr;
@@ -32,6 +36,7 @@ public:
   Double_t EvalInstance(Int_t, char const* [] = nullptr)/* override*/;
 
   CachePtr const& GetCache() const { return fCache; }
+  void ResetCache();
 
   TObjArray const* GetListOfLeaves() const { return &fLeaves; }
 
@@ -2,6 +2,8 @@
 #define multidraw_TTreeFunction_h
 
 #include <memory>
+#include <vector>
+#include <string>
 
 namespace multidraw {
 
@@ -14,21 +16,64 @@ namespace multidraw {
 
     virtual char const* getName() const = 0;
     virtual TTreeFunction* clone() const = 0;
+
+    //! Identity of the function, typically the name plus the parameters.
+    /*!
+     * Functions with the same non-empty key are assumed to compute the same values, and FunctionLibrary
+     * links and evaluates only one instance for all of them. The default empty key disables the sharing
+     * (the function object is identified by its address).
+     */
+    virtual std::string getKey() const { return ""; }
     
     std::unique_ptr<TTreeFunction> linkedCopy(FunctionLibrary&) const;
 
     bool isLinked() const { return linked_; }
 
+    //! Return true to defer beginEvent() and the reading of the entry to the first use in each event.
+    /*!
+     * Lazy functions are prepared only in events where they are actually evaluated, i.e. not in
+     * events rejected by the prescale, the good run list, or the filter. Their users must call
+     * prepareEvent() before getNdata() and evaluate(). CompiledExpr does this automatically, but a
+     * function calling another lazy function internally must do it itself.
+     */
+    virtual bool isLazy() const { return false; }
+
+    //! Run the deferred beginEvent() of a lazy function. No-op if already prepared in this event.
+    void prepareEvent() { if (pendingEntry_ >= 0) prepareEvent_(); }
+
     virtual void beginEvent(long long) {}
     virtual int getMultiplicity() { return 0; }
     virtual unsigned getNdata() = 0;
     virtual double evaluate(unsigned) = 0;
 
+    //! Optional batch interface: fill the (empty) vector with the values of all instances of the current event.
+    /*!
+     * Return false if not implemented. The values are computed once per event and read from getValues()
+     * by all users, which saves one virtual call per instance and user.
+     */
+    virtual bool evaluateBatch(std::vector<double>&) { return false; }
+
+    //! Values of all instances of the current event (nullptr if evaluateBatch is not implemented)
+    std::vector<double> const* getValues();
+
   protected:
     virtual void bindTree_(FunctionLibrary&) = 0;
 
   private:
+    friend class FunctionLibrary;
+
+    void prepareEvent_();
+
     bool linked_{false};
+    FunctionLibrary* library_{nullptr};
+    //! Entry number for which beginEvent() is pending (-1 if none)
+    long long pendingEntry_{-1};
+
+    //! Batch evaluation is not implemented
+    bool noBatch_{false};
+    //! Entry number for which values_ are filled
+    long long valuesEntry_{-1};
+    std::vector<double> values_{};
   };
 
   typedef std::unique_ptr<TTreeFunction> TTreeFunctionPtr;
@@ -29,18 +29,23 @@ namespace multidraw {
 
     unsigned getNdim() const override { return bvalues_.size(); }
 
+    TString getSignature() const override;
+
     static unsigned const NBRANCHMAX = 128;
 
   private:
     TreeFiller(TTree& tree, TreeFiller const&);
     TreeFiller(TObjArray& treelist, TreeFiller const&);
 
+    void initialize_() override;
     void doFill_(unsigned, int icat = -1) override;
     ExprFiller* clone_() override;
     void mergeBack_() override;
 
     std::vector<double> bvalues_{};
     std::vector<TString> bnames_{};
+    //! One per category, set up in initialize_()
+    std::vector<TTree*> trees_{};
   };
 
 }
@@ -2,11 +2,45 @@
 #include "../interface/FormulaLibrary.h"
 #include "../interface/FunctionLibrary.h"
 
+#include <algorithm>
+
+TString
+multidraw::CompiledExprSource::getSignature() const
+{
+  TString signature;
+  if (function_) {
+    std::string key(function_->getKey());
+    signature = "[" + TString(key.empty() ? function_->getName() : key.c_str()) + "]";
+  }
+  else
+    signature = formula_;
+
+  if (perFile_)
+    signature += "@file";
+
+  return signature;
+}
+
 std::unique_ptr<multidraw::CompiledExpr>
 multidraw::CompiledExprSource::compile(FormulaLibrary& _formulaLibrary, FunctionLibrary& _functionLibrary) const
 {
-  if (formula_.Length() != 0)
+  if (formula_.Length() != 0) {
+    if (perFile_) {
+      // Evaluated as a whole so that the single cached value is reused throughout the file
+      auto& formula(_formulaLibrary.getFormula(formula_));
+      _formulaLibrary.setPerFile(formula);
+      return std::make_unique<CompiledExpr>(formula);
+    }
+
+    auto* graph(_formulaLibrary.getGraph());
+    if (graph != nullptr) {
+      auto* node(graph->getNode(formula_));
+      if (node != nullptr)
+        return std::make_unique<CompiledExpr>(*node);
+    }
+
     return std::make_unique<CompiledExpr>(_formulaLibrary.getFormula(formula_));
+  }
   else
     return std::make_unique<CompiledExpr>(_functionLibrary.getFunction(*function_));
 }
@@ -18,13 +52,44 @@ multidraw::CompiledExpr::CompiledExpr(TTreeFunction& _function) :
     throw std::runtime_error("Unlinked TTreeFunction used to construct CompiledExpr");
 }
 
+std::vector<TTreeFormulaCached*>
+multidraw::CompiledExpr::getFormulas() const
+{
+  std::vector<TTreeFormulaCached*> formulas;
+  if (formula_ != nullptr)
+    formulas.push_back(formula_);
+  else if (node_ != nullptr)
+    node_->collectFormulas(formulas);
+
+  return formulas;
+}
+
+int
+multidraw::CompiledExpr::getMultiplicity()
+{
+  if (formula_ != nullptr)
+    return formula_->GetMultiplicity();
+  else if (node_ != nullptr)
+    return node_->getMultiplicity();
+  else
+    return function_->getMultiplicity();
+}
+
 unsigned
 multidraw::CompiledExpr::getNdata()
 {
   if (formula_ != nullptr)
     return formula_->GetNdata();
-  else
+  else if (node_ != nullptr)
+    return node_->getNdata();
+  else {
+    auto* values(function_->getValues());
+    if (values != nullptr)
+      return values->size();
+
+    function_->prepareEvent();
     return function_->getNdata();
+  }
 }
 
 double
@@ -32,6 +97,49 @@ multidraw::CompiledExpr::evaluate(unsigned _iD)
 {
   if (formula_ != nullptr)
     return formula_->EvalInstance(_iD);
-  else
+  else if (node_ != nullptr)
+    return node_->evaluate(_iD);
+  else {
+    auto* values(function_->getValues());
+    if (values != nullptr) {
+      // Same as TTreeFormulaCached: instance 0 is evaluated even when there is no value
+      if (values->empty())
+        return 0.;
+      return (*values)[std::min<std::size_t>(_iD, values->size() - 1)];
+    }
+
+    function_->prepareEvent();
     return function_->evaluate(_iD);
+  }
+}
+
+void
+multidraw::CompiledExprGroup::add(CompiledExpr& _expr)
+{
+  // Only formulas and graph nodes can be broadcast (they return the last value for out-of-range instances)
+  exprs_.emplace_back(&_expr, _expr.getFunction() == nullptr && _expr.getMultiplicity() == 0);
+}
+
+unsigned
+multidraw::CompiledExprGroup::getNdata()
+{
+  unsigned nD(-1);
+
+  for (auto& ee : exprs_) {
+    unsigned n(ee.first->getNdata());
+    if (n == 0)
+      return 0;
+
+    // singlets are broadcast
+    if (n == 1 && ee.second)
+      continue;
+
+    if (n < nD)
+      nD = n;
+  }
+
+  if (nD == unsigned(-1))
+    return 1;
+  else
+    return nD;
 }
@@ -4,7 +4,6 @@
 #include "../interface/FunctionLibrary.h"
 #include "../interface/TTreeFormulaCached.h"
 
-#include "TTreeFormulaManager.h"
 #include "TTree.h"
 
 #include <iostream>
@@ -57,29 +56,39 @@ multidraw::Cut::getNCategories() const
 }
 
 void
-multidraw::Cut::bindTree(FormulaLibrary& _formulaLibrary, FunctionLibrary& _functionLibrary)
+multidraw::Cut::bindTree(FormulaLibrary& _formulaLibrary, FunctionLibrary& _functionLibrary, ReweightLibrary& _reweightLibrary)
 {
   counter_ = 0;
 
   unlinkTree();
 
   if (cutExpr_.Length() != 0)
-    compiledCut_ = &_formulaLibrary.getFormula(cutExpr_);
+    compiledCut_ = CompiledExprSource(cutExpr_).compile(_formulaLibrary, _functionLibrary);
 
   if (categorizationExpr_.Length() != 0)
-    compiledCategorization_ = &_formulaLibrary.getFormula(categorizationExpr_);
+    compiledCategorization_ = CompiledExprSource(categorizationExpr_).compile(_formulaLibrary, _functionLibrary);
   else {
     for (auto& expr : categoryExprs_)
-      compiledCategories_.push_back(&_formulaLibrary.getFormula(expr));
+      compiledCategories_.push_back(CompiledExprSource(expr).compile(_formulaLibrary, _functionLibrary));
   }
 
   for (auto& filler : fillers_)
-    filler->bindTree(_formulaLibrary, _functionLibrary);
+    filler->bindTree(_formulaLibrary, _functionLibrary, _reweightLibrary);
+}
+
+void
+multidraw::Cut::resetCounts()
+{
+  counter_ = 0;
+  for (auto& filler : fillers_)
+    filler->resetCounts();
 }
 
 void
 multidraw::Cut::unlinkTree()
 {
+  exprGroup_.clear();
+
   compiledCut_ = nullptr;
 
   compiledCategorization_ = nullptr;
@@ -90,7 +99,7 @@ multidraw::Cut::unlinkTree()
 }
 
 multidraw::CutPtr
-multidraw::Cut::threadClone(FormulaLibrary& _formulaLibrary, FunctionLibrary& _functionLibrary) const
+multidraw::Cut::threadClone(FormulaLibrary& _formulaLibrary, FunctionLibrary& _functionLibrary, ReweightLibrary& _reweightLibrary) const
 {
   auto clone(std::make_unique<Cut>(name_, cutExpr_));
   clone->setPrintLevel(-1);
@@ -103,9 +112,9 @@ multidraw::Cut::threadClone(FormulaLibrary& _formulaLibrary, FunctionLibrary& _f
   }
 
   for (auto& filler : fillers_)
-    clone->addFiller(filler->threadClone(_formulaLibrary, _functionLibrary));
+    clone->addFiller(filler->threadClone(_formulaLibrary, _functionLibrary, _reweightLibrary));
 
-  clone->bindTree(_formulaLibrary, _functionLibrary);
+  clone->bindTree(_formulaLibrary, _functionLibrary, _reweightLibrary);
 
   return clone;
 }
@@ -116,14 +125,16 @@ multidraw::Cut::dependsOn(TTree const& _tree) const
   if (compiledCut_ == nullptr)
     return false;
 
-  auto doesDepend([&_tree](TTreeFormulaCached& _form)->bool {
-    for (int iL(0); iL != _form.GetListOfLeaves()->GetEntriesFast(); ++iL) {
-      auto* leaf(_form.GetLeaf(iL));
-      if (leaf == nullptr)
-        continue;
+  auto doesDepend([&_tree](CompiledExpr& _expr)->bool {
+    for (auto* form : _expr.getFormulas()) {
+      for (int iL(0); iL != form->GetListOfLeaves()->GetEntriesFast(); ++iL) {
+        auto* leaf(form->GetLeaf(iL));
+        if (leaf == nullptr)
+          continue;
 
-      if (leaf->GetBranch()->GetTree() == &_tree)
-        return true;
+        if (leaf->GetBranch()->GetTree() == &_tree)
+          return true;
+      }
     }
 
     return false;
@@ -135,7 +146,7 @@ multidraw::Cut::dependsOn(TTree const& _tree) const
   if (compiledCategorization_ != nullptr && doesDepend(*compiledCategorization_))
     return true;
 
-  for (auto* cat : compiledCategories_) {
+  for (auto& cat : compiledCategories_) {
     if (doesDepend(*cat))
       return true;
   }
@@ -143,25 +154,40 @@ multidraw::Cut::dependsOn(TTree const& _tree) const
   return false;
 }
 
+TString
+multidraw::Cut::getSignature() const
+{
+  TString signature(name_ + ":" + cutExpr_ + "{");
+  for (auto& expr : categoryExprs_)
+    signature += expr + ",";
+  signature += "}" + categorizationExpr_ + "{";
+
+  for (auto& filler : fillers_)
+    signature += filler->getSignature() + ";";
+  signature += "}";
+
+  return signature;
+}
+
 void
 multidraw::Cut::initialize()
 {
-  if (compiledCut_ == nullptr)
-    return;
+  // Cut and category expressions are iterated in lock step
+  exprGroup_.clear();
 
-  // Each formula object has a default manager
-  auto* formulaManager(compiledCut_->GetManager());
-  if (compiledCategorization_ != nullptr)
-    formulaManager->Add(compiledCategorization_);
-  else {
-    for (auto* cat : compiledCategories_)
-      formulaManager->Add(cat);
-  }
+  if (compiledCut_ != nullptr) {
+    exprGroup_.add(*compiledCut_);
 
-  formulaManager->Sync();
+    if (compiledCategorization_ != nullptr)
+      exprGroup_.add(*compiledCategorization_);
+    else {
+      for (auto& cat : compiledCategories_)
+        exprGroup_.add(*cat);
+    }
+  }
 
-  // It's probably more correct to pass the manager to filler here and synchronize all at the same time
-  // Currently Cut and ExprFiller use independent formula managers
+  // It's probably more correct to synchronize the fillers with the cut too
+  // Currently Cut and ExprFiller iterate independently
   for (auto& filler : fillers_)
     filler->initialize();
 }
@@ -172,20 +198,21 @@ multidraw::Cut::evaluate()
   unsigned nD(1);
   
   if (compiledCut_ != nullptr)
-    nD = compiledCut_->GetNdata();
+    nD = exprGroup_.getNdata();
 
   if (compiledCategorization_ != nullptr) {
-    compiledCategorization_->GetNdata();
-    compiledCategorization_->EvalInstance(0);
+    compiledCategorization_->getNdata();
+    compiledCategorization_->evaluate(0);
   }
   else {
-    for (auto* cat : compiledCategories_) {
-      cat->GetNdata();
-      cat->EvalInstance(0);
+    for (auto& cat : compiledCategories_) {
+      cat->getNdata();
+      cat->evaluate(0);
     }
   }
 
-  categoryIndex_.assign(nD, -1);
+  // Buffer is reused across events; every entry is written below
+  categoryIndex_.resize(nD);
 
   if (printLevel_ > 2)
     std::cout << "        " << getName() << " has " << nD << " iterations" << std::endl;
@@ -193,14 +220,16 @@ multidraw::Cut::evaluate()
   bool any(false);
 
   for (unsigned iD(0); iD != nD; ++iD) {
-    if (compiledCut_ != nullptr && compiledCut_->EvalInstance(iD) == 0.)
+    categoryIndex_[iD] = -1;
+
+    if (compiledCut_ != nullptr && compiledCut_->evaluate(iD) == 0.)
       continue;
 
     if (compiledCategorization_ != nullptr)
-      categoryIndex_[iD] = int(compiledCategorization_->EvalInstance(iD));
+      categoryIndex_[iD] = int(compiledCategorization_->evaluate(iD));
     else if (!compiledCategories_.empty()) {
       for (unsigned icat(0); icat != compiledCategories_.size(); ++icat) {
-        if (compiledCategories_[icat]->EvalInstance(iD) != 0.) {
+        if (compiledCategories_[icat]->evaluate(iD) != 0.) {
           categoryIndex_[iD] = icat;
           break;
         }
@@ -214,6 +243,8 @@ multidraw::Cut::evaluate()
     if (printLevel_ > 2)
       std::cout << "        " << getName() << " iteration " << iD << " pass (cat. index " << categoryIndex_[iD] << ")" << std::endl;
   }
+
+  passed_ = any;
   
   return any;
 }
@@ -226,3 +257,10 @@ multidraw::Cut::fillExprs(std::vector<double> const& _eventWeights)
   for (auto& filler : fillers_)
     filler->fill(_eventWeights, categoryIndex_);
 }
+
+void
+multidraw::Cut::finalize()
+{
+  for (auto& filler : fillers_)
+    filler->finalize();
+}
@@ -1,7 +1,8 @@
 #include "../interface/ExprFiller.h"
+#include "../interface/FastAxis.h"
 
 #include "TTree.h"
-#include "TTreeFormulaManager.h"
+#include "TH1.h"
 
 #include <iostream>
 #include <cstring>
@@ -40,14 +41,14 @@ multidraw::ExprFiller::~ExprFiller()
 {
   unlinkTree();
 
-  if (cloneSource_ != nullptr)
+  if (cloneSource_ != nullptr && !sharesObj_)
     delete &tobj_;
 }
 
 TObject const&
 multidraw::ExprFiller::getObj(int _icat/* = -1*/) const
 {
-  if (categorized_) {
+  if (categorized_ && _icat >= 0) {
     auto& array(static_cast<TObjArray const&>(tobj_));
     if (_icat >= array.GetEntriesFast())
       throw std::runtime_error(TString::Format("Category index out of bounds: index %d >= maximum %d", _icat, array.GetEntriesFast()).Data());
@@ -60,7 +61,7 @@ multidraw::ExprFiller::getObj(int _icat/* = -1*/) const
 TObject&
 multidraw::ExprFiller::getObj(int _icat/* = -1*/)
 {
-  if (categorized_) {
+  if (categorized_ && _icat >= 0) {
     auto& array(static_cast<TObjArray&>(tobj_));
     if (_icat >= array.GetEntriesFast())
       throw std::runtime_error(TString::Format("Category index out of bounds: index %d >= maximum %d", _icat, array.GetEntriesFast()).Data());
@@ -71,7 +72,56 @@ multidraw::ExprFiller::getObj(int _icat/* = -1*/)
 }
 
 void
-multidraw::ExprFiller::bindTree(FormulaLibrary& _formulaLibrary, FunctionLibrary& _functionLibrary)
+multidraw::ExprFiller::collectObjs(std::vector<TObject*>& _objs)
+{
+  if (categorized_) {
+    for (auto* obj : static_cast<TObjArray&>(tobj_))
+      _objs.push_back(obj);
+  }
+  else
+    _objs.push_back(&tobj_);
+}
+
+TString
+multidraw::ExprFiller::getSignature() const
+{
+  TString signature;
+
+  auto objSignature([&signature](TObject const& obj) {
+      signature += TString::Format("%s:%s", obj.IsA()->GetName(), obj.GetName());
+      if (obj.InheritsFrom(TH1::Class())) {
+        // Cached partial results can only be added to histograms with identical binning
+        auto& hist(static_cast<TH1 const&>(obj));
+        signature += TString::Format("(%d)", hist.GetNcells());
+        signature += "x" + FastAxis::getSignature(*hist.GetXaxis());
+        if (hist.GetDimension() > 1)
+          signature += "y" + FastAxis::getSignature(*hist.GetYaxis());
+        if (hist.GetDimension() > 2)
+          signature += "z" + FastAxis::getSignature(*hist.GetZaxis());
+      }
+      signature += ",";
+    });
+
+  if (categorized_) {
+    for (auto* obj : static_cast<TObjArray const&>(tobj_))
+      objSignature(*obj);
+  }
+  else
+    objSignature(tobj_);
+
+  signature += "{";
+  for (auto& source : sources_)
+    signature += source.getSignature() + ",";
+  signature += "}";
+
+  if (reweightSource_)
+    signature += "*" + reweightSource_->getSignature();
+
+  return signature;
+}
+
+void
+multidraw::ExprFiller::bindTree(FormulaLibrary& _formulaLibrary, FunctionLibrary& _functionLibrary, ReweightLibrary& _reweightLibrary)
 {
   unlinkTree();
 
@@ -79,49 +129,50 @@ multidraw::ExprFiller::bindTree(FormulaLibrary& _formulaLibrary, FunctionLibrary
     compiledExprs_.emplace_back(source.compile(_formulaLibrary, _functionLibrary));
 
   if (reweightSource_)
-    compiledReweight_ = reweightSource_->compile(_formulaLibrary, _functionLibrary);
+    sharedReweight_ = &_reweightLibrary.getReweight(*reweightSource_);
 
-  counter_ = 0;
+  resetCounts();
 }
 
 void
 multidraw::ExprFiller::unlinkTree()
 {
+  exprGroup_.clear();
   compiledExprs_.clear();
-  compiledReweight_ = nullptr;
+  sharedReweight_ = nullptr;
 }
 
 multidraw::ExprFillerPtr
-multidraw::ExprFiller::threadClone(FormulaLibrary& _formulaLibrary, FunctionLibrary& _functionLibrary)
+multidraw::ExprFiller::threadClone(FormulaLibrary& _formulaLibrary, FunctionLibrary& _functionLibrary, ReweightLibrary& _reweightLibrary)
 {
   ExprFillerPtr clone(clone_());
   clone->cloneSource_ = this;
   clone->setPrintLevel(-1);
-  clone->bindTree(_formulaLibrary, _functionLibrary);
+  clone->bindTree(_formulaLibrary, _functionLibrary, _reweightLibrary);
   return clone;
 }
 
 void
 multidraw::ExprFiller::initialize()
 {
-  // Manage all dimensions with a single manager
-  // manager instance will be owned collectively by the managed formulas (will be deleted when the last formula is deleted)
-  auto* manager{new TTreeFormulaManager()};
-  for (auto& expr : compiledExprs_) {
-    if (expr->getFormula() == nullptr)
-      continue;
-
-    manager->Add(expr->getFormula());
-  }
+  // Iterate over all dimensions in lock step
+  exprGroup_.clear();
+  for (auto& expr : compiledExprs_)
+    exprGroup_.add(*expr);
+
+  // Checked once per instance in fill(); doFill_ can index the objects without bounds checks
+  if (categorized_)
+    categoryBound_ = static_cast<TObjArray&>(tobj_).GetEntriesFast();
+  else
+    categoryBound_ = unsigned(-1);
 
-  manager->Sync();
+  initialize_();
 }
 
 void
 multidraw::ExprFiller::fill(std::vector<double> const& _eventWeights, std::vector<int> const& _categories)
 {
-  // All exprs and reweight exprs share the same manager
-  unsigned nD(compiledExprs_.at(0)->getNdata());
+  unsigned nD(exprGroup_.getNdata());
 
   if (printLevel_ > 3)
     std::cout << "          " << getObj().GetName() << "::fill() => " << nD << " iterations" << std::endl;
@@ -132,7 +183,7 @@ multidraw::ExprFiller::fill(std::vector<double> const& _eventWeights, std::vecto
   bool loaded(false);
 
   for (unsigned iD(0); iD != nD; ++iD) {
-    if (_categories[iD] < 0)
+    if (!acceptCategory_(_categories[iD], categoryBound_))
       continue;
 
     ++counter_;
@@ -152,18 +203,26 @@ multidraw::ExprFiller::fill(std::vector<double> const& _eventWeights, std::vecto
     else
       entryWeight_ = _eventWeights.back();
 
-    if (compiledReweight_ != nullptr)
-      entryWeight_ *= compiledReweight_->evaluate(iD);
+    if (sharedReweight_ != nullptr)
+      entryWeight_ *= sharedReweight_->getWeight(iD);
 
     doFill_(iD, _categories[iD]);
   }
 }
 
+void
+multidraw::ExprFiller::finalize()
+{
+  finalize_();
+}
+
 void
 multidraw::ExprFiller::mergeBack()
 {
   if (cloneSource_ == nullptr)
     return;
 
+  cloneSource_->nOutOfRange_ += nOutOfRange_;
+
   mergeBack_();
 }
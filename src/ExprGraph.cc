@@ -0,0 +1,340 @@
+#include "../interface/ExprGraph.h"
+#include "../interface/FormulaLibrary.h"
+
+#include "TTree.h"
+#include "TLeaf.h"
+#include "TMath.h"
+
+#include <stdexcept>
+#include <cstdlib>
+#include <cmath>
+
+namespace {
+
+  typedef double (*UnaryFunction)(double);
+  typedef double (*BinaryFunction)(double, double);
+
+  // Operators and the builtin functions of TFormula follow the conventions of TTreeFormula::EvalInstance
+  // (e.g. division by zero returns 0), so that the decomposed expression evaluates to the same value.
+  // TMath functions are called through TMethodCall by TTreeFormula and therefore have the usual semantics.
+
+  std::unordered_map<std::string, UnaryFunction> const unaryOperators{
+    {"-", [](double x)->double { return -x; }},
+    {"!", [](double x)->double { return x == 0. ? 1. : 0.; }}
+  };
+
+  std::unordered_map<std::string, BinaryFunction> const binaryOperators{
+    {"+", [](double x, double y)->double { return x + y; }},
+    {"-", [](double x, double y)->double { return x - y; }},
+    {"*", [](double x, double y)->double { return x * y; }},
+    {"/", [](double x, double y)->double { return y == 0. ? 0. : x / y; }},
+    {"^", [](double x, double y)->double { return TMath::Power(x, y); }},
+    {"<", [](double x, double y)->double { return x < y ? 1. : 0.; }},
+    {"<=", [](double x, double y)->double { return x <= y ? 1. : 0.; }},
+    {"==", [](double x, double y)->double { return x == y ? 1. : 0.; }},
+    {"!=", [](double x, double y)->double { return x != y ? 1. : 0.; }}
+  };
+
+  std::unordered_map<std::string, UnaryFunction> const unaryFunctions{
+    {"abs", [](double x)->double { return TMath::Abs(x); }},
+    {"sqrt", [](double x)->double { return TMath::Sqrt(TMath::Abs(x)); }},
+    {"log", [](double x)->double { return x > 0. ? TMath::Log(x) : 0.; }},
+    {"log10", [](double x)->double { return x > 0. ? TMath::Log10(x) : 0.; }},
+    {"sin", [](double x)->double { return TMath::Sin(x); }},
+    {"cos", [](double x)->double { return TMath::Cos(x); }},
+    {"tan", [](double x)->double { return TMath::Tan(x); }},
+    {"atan", [](double x)->double { return TMath::ATan(x); }},
+    {"sinh", [](double x)->double { return TMath::SinH(x); }},
+    {"cosh", [](double x)->double { return TMath::CosH(x); }},
+    {"tanh", [](double x)->double { return TMath::TanH(x); }},
+    {"TMath::Abs", [](double x)->double { return TMath::Abs(x); }},
+    {"TMath::Sqrt", [](double x)->double { return TMath::Sqrt(x); }},
+    {"TMath::Exp", [](double x)->double { return TMath::Exp(x); }},
+    {"TMath::Log", [](double x)->double { return TMath::Log(x); }},
+    {"TMath::Log10", [](double x)->double { return TMath::Log10(x); }},
+    {"TMath::Sin", [](double x)->double { return TMath::Sin(x); }},
+    {"TMath::Cos", [](double x)->double { return TMath::Cos(x); }},
+    {"TMath::Tan", [](double x)->double { return TMath::Tan(x); }},
+    {"TMath::ATan", [](double x)->double { return TMath::ATan(x); }},
+    {"TMath::SinH", [](double x)->double { return TMath::SinH(x); }},
+    {"TMath::CosH", [](double x)->double { return TMath::CosH(x); }},
+    {"TMath::TanH", [](double x)->double { return TMath::TanH(x); }}
+  };
+
+  std::unordered_map<std::string, BinaryFunction> const binaryFunctions{
+    {"atan2", [](double y, double x)->double { return TMath::ATan2(y, x); }},
+    {"pow", [](double x, double y)->double { return TMath::Power(x, y); }},
+    {"TMath::ATan2", [](double y, double x)->double { return TMath::ATan2(y, x); }},
+    {"TMath::Power", [](double x, double y)->double { return TMath::Power(x, y); }},
+    {"TMath::Hypot", [](double x, double y)->double { return TMath::Hypot(x, y); }},
+    {"TMath::Min", [](double x, double y)->double { return TMath::Min(x, y); }},
+    {"TMath::Max", [](double x, double y)->double { return TMath::Max(x, y); }}
+  };
+
+}
+
+unsigned
+multidraw::ExprGraph::Node::getNdata()
+{
+  if (ndata_ >= 0)
+    return ndata_;
+
+  switch (kind_) {
+  case kConstant:
+    ndata_ = 1;
+    return ndata_;
+
+  case kLeaf:
+    ndata_ = formula_->GetNdata();
+    return ndata_;
+
+  default:
+    break;
+  }
+
+  // Same synchronization as CompiledExprGroup: singlets are broadcast, arrays are iterated up to the shortest length
+  unsigned nD(-1);
+  for (auto* arg : args_) {
+    unsigned n(arg->getNdata());
+    if (n == 0) {
+      nD = 0;
+      break;
+    }
+
+    if (n == 1 && arg->multiplicity_ == 0)
+      continue;
+
+    if (n < nD)
+      nD = n;
+  }
+
+  if (nD == unsigned(-1))
+    nD = 1;
+
+  ndata_ = nD;
+  done_.assign(nD, 0);
+  values_.resize(nD);
+
+  return ndata_;
+}
+
+double
+multidraw::ExprGraph::Node::evaluate(unsigned _iD)
+{
+  if (kind_ == kConstant)
+    return constant_;
+
+  unsigned nD(getNdata());
+  if (nD == 0)
+    return 0.;
+
+  if (_iD >= nD)
+    _iD = nD - 1;
+
+  if (kind_ == kLeaf)
+    return compute_(_iD);
+
+  if (done_[_iD] == 0) {
+    values_[_iD] = compute_(_iD);
+    done_[_iD] = 1;
+  }
+
+  return values_[_iD];
+}
+
+double
+multidraw::ExprGraph::Node::compute_(unsigned _iD)
+{
+  switch (kind_) {
+  case kConstant:
+    return constant_;
+
+  case kLeaf:
+    // TTreeFormula loads the branches at instance 0
+    if (_iD != 0)
+      formula_->EvalInstance(0);
+    return formula_->EvalInstance(_iD);
+
+  case kUnary:
+    return unary_(args_[0]->evaluate(_iD));
+
+  case kBinary:
+    if (shortCircuit_ == '&') {
+      if (args_[0]->evaluate(_iD) == 0.)
+        return 0.;
+      return args_[1]->evaluate(_iD) != 0. ? 1. : 0.;
+    }
+    else if (shortCircuit_ == '|') {
+      if (args_[0]->evaluate(_iD) != 0.)
+        return 1.;
+      return args_[1]->evaluate(_iD) != 0. ? 1. : 0.;
+    }
+    else
+      return binary_(args_[0]->evaluate(_iD), args_[1]->evaluate(_iD));
+
+  case kTernary:
+    if (args_[0]->evaluate(_iD) != 0.)
+      return args_[1]->evaluate(_iD);
+    else
+      return args_[2]->evaluate(_iD);
+  }
+
+  return 0.;
+}
+
+void
+multidraw::ExprGraph::Node::collectFormulas(std::vector<TTreeFormulaCached*>& _formulas) const
+{
+  if (formula_ != nullptr)
+    _formulas.push_back(formula_);
+
+  for (auto* arg : args_)
+    arg->collectFormulas(_formulas);
+}
+
+multidraw::ExprGraph::ExprGraph(FormulaLibrary& _library, TTree& _tree) :
+  library_(_library),
+  tree_(_tree)
+{
+}
+
+multidraw::ExprGraph::Node*
+multidraw::ExprGraph::getNode(char const* _expr)
+{
+  ExprTree exprTree(_expr, &tree_);
+  if (!exprTree.isValid())
+    return nullptr;
+
+  auto& root(*exprTree.getRoot());
+  if (!isDecomposable_(root))
+    return nullptr;
+
+  Node* node(nullptr);
+  try {
+    node = &makeNode_(root);
+  }
+  catch (std::exception&) {
+    // Let the caller compile the expression as a whole (and report errors if it is invalid)
+    return nullptr;
+  }
+
+  if (node->kind_ == Node::kLeaf)
+    return nullptr;
+
+  return node;
+}
+
+void
+multidraw::ExprGraph::resetCache()
+{
+  for (auto& nn : nodes_)
+    nn.second->resetCache();
+}
+
+multidraw::ExprGraph::Node&
+multidraw::ExprGraph::makeNode_(ExprTree::Node const& _exprNode)
+{
+  auto nItr(nodes_.find(_exprNode.text));
+  if (nItr != nodes_.end())
+    return *nItr->second;
+
+  std::unique_ptr<Node> node(new Node);
+  node->kind_ = Node::kLeaf;
+
+  switch (_exprNode.type) {
+  case ExprTree::kNumber:
+    node->kind_ = Node::kConstant;
+    node->constant_ = std::strtod(_exprNode.name.c_str(), nullptr);
+    break;
+
+  case ExprTree::kUnary:
+    {
+      auto uItr(unaryOperators.find(_exprNode.name));
+      if (uItr != unaryOperators.end()) {
+        node->kind_ = Node::kUnary;
+        node->unary_ = uItr->second;
+      }
+    }
+    break;
+
+  case ExprTree::kBinary:
+    if (_exprNode.name == "&&" || _exprNode.name == "||") {
+      node->kind_ = Node::kBinary;
+      node->shortCircuit_ = _exprNode.name[0];
+    }
+    else {
+      auto bItr(binaryOperators.find(_exprNode.name));
+      if (bItr != binaryOperators.end()) {
+        node->kind_ = Node::kBinary;
+        node->binary_ = bItr->second;
+      }
+    }
+    break;
+
+  case ExprTree::kCall:
+    if (_exprNode.args.size() == 1) {
+      auto fItr(unaryFunctions.find(_exprNode.name));
+      if (fItr != unaryFunctions.end()) {
+        node->kind_ = Node::kUnary;
+        node->unary_ = fItr->second;
+      }
+    }
+    else if (_exprNode.args.size() == 2) {
+      auto fItr(binaryFunctions.find(_exprNode.name));
+      if (fItr != binaryFunctions.end()) {
+        node->kind_ = Node::kBinary;
+        node->binary_ = fItr->second;
+      }
+    }
+    break;
+
+  case ExprTree::kTernary:
+    node->kind_ = Node::kTernary;
+    break;
+
+  case ExprTree::kVariable:
+    break;
+  }
+
+  if (node->kind_ == Node::kLeaf) {
+    // Not decomposable -> evaluate with a formula
+    node->formula_ = &library_.getFormula(_exprNode.text.c_str(), true);
+    node->multiplicity_ = node->formula_->GetMultiplicity();
+
+    // Fixed-size and multi-dimensional arrays follow index matching rules that we do not reproduce
+    if (node->multiplicity_ > 1)
+      throw std::runtime_error("Fixed-size array in " + _exprNode.text);
+
+    for (int iL(0); iL != node->formula_->GetListOfLeaves()->GetEntriesFast(); ++iL) {
+      auto* leaf(node->formula_->GetLeaf(iL));
+      if (leaf != nullptr && leaf->GetLeafCount() != nullptr && leaf->GetLenStatic() > 1)
+        throw std::runtime_error("Multi-dimensional array in " + _exprNode.text);
+    }
+  }
+  else {
+    for (auto& arg : _exprNode.args) {
+      node->args_.push_back(&makeNode_(*arg));
+      if (node->args_.back()->multiplicity_ != 0)
+        node->multiplicity_ = 1;
+    }
+  }
+
+  return *nodes_.emplace(_exprNode.text, std::move(node)).first->second;
+}
+
+bool
+multidraw::ExprGraph::isDecomposable_(ExprTree::Node const& _exprNode) const
+{
+  if (_exprNode.type == ExprTree::kVariable && _exprNode.name == "Iteration$")
+    return false;
+
+  for (auto& arg : _exprNode.args) {
+    // Empty subscripts [] couple the iterations of different leaves
+    if (!arg)
+      return false;
+    if (!isDecomposable_(*arg))
+      return false;
+  }
+
+  return true;
+}
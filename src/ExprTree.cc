@@ -0,0 +1,469 @@
+#include "../interface/ExprTree.h"
+
+#include "TTree.h"
+
+#include <stdexcept>
+#include <cstdlib>
+#include <cstdio>
+#include <cctype>
+#include <cstring>
+#include <utility>
+
+namespace {
+
+  typedef multidraw::ExprTree::Node Node;
+  typedef multidraw::ExprTree::NodePtr NodePtr;
+
+  //! Binary operators from the lowest to the highest precedence (unary operators and the power operator come after)
+  //! Bitwise operators are not supported because their precedence relative to comparisons differs between C and TFormula
+  std::vector<std::vector<std::string>> const binaryOperators{
+    {"||"},
+    {"&&"},
+    {"==", "!="},
+    {"<", "<=", ">", ">="},
+    {"+", "-"},
+    {"*", "/", "%"}
+  };
+
+  unsigned const powerPrecedence(binaryOperators.size());
+
+  unsigned
+  precedence(std::string const& _op)
+  {
+    if (_op == "^" || _op == "**")
+      return powerPrecedence;
+
+    for (unsigned iP(0); iP != binaryOperators.size(); ++iP) {
+      for (auto& op : binaryOperators[iP]) {
+        if (op == _op)
+          return iP;
+      }
+    }
+
+    throw std::logic_error("Unknown operator " + _op);
+  }
+
+  bool
+  isCommutative(std::string const& _op)
+  {
+    return _op == "+" || _op == "*" || _op == "&&" || _op == "||" || _op == "==" || _op == "!=";
+  }
+
+  //! Operators for which we keep the parentheses even when the precedence tells they are redundant
+  bool
+  isFragile(std::string const& _op)
+  {
+    unsigned prec(precedence(_op));
+    return prec == 2 || prec == 3 || prec == powerPrecedence;
+  }
+
+  //! Shortest representation of the number that converts back to the same value
+  std::string
+  formatNumber(double _value)
+  {
+    char buf[32];
+    for (int precision : {15, 16, 17}) {
+      std::snprintf(buf, sizeof(buf), "%.*g", precision, _value);
+      if (std::strtod(buf, nullptr) == _value)
+        break;
+    }
+    return buf;
+  }
+
+  class Parser {
+  public:
+    Parser(char const* _expr, TTree const* _tree, unsigned _depth) : expr_(_expr), tree_(_tree), depth_(_depth) {}
+
+    NodePtr
+    parse()
+    {
+      if (depth_ > 16)
+        throw std::runtime_error("Alias nesting too deep");
+
+      auto node(parseTernary_());
+      skipSpace_();
+      if (expr_[pos_] != '\0')
+        throw std::runtime_error("Trailing characters");
+
+      return node;
+    }
+
+  private:
+    void
+    skipSpace_()
+    {
+      while (std::isspace(expr_[pos_]))
+        ++pos_;
+    }
+
+    //! Binary operator at the current position (empty string if none)
+    std::string
+    peekOperator_()
+    {
+      skipSpace_();
+
+      char const* c(expr_ + pos_);
+      for (char const* op : {"||", "&&", "==", "!=", "<=", ">=", "**"}) {
+        if (std::strncmp(c, op, 2) == 0)
+          return op;
+      }
+      if (std::strncmp(c, "<<", 2) == 0 || std::strncmp(c, ">>", 2) == 0 || *c == '&' || *c == '|')
+        throw std::runtime_error("Bitwise operators are not supported");
+      if (*c != '\0' && std::strchr("<>+-*/%^", *c) != nullptr)
+        return std::string(1, *c);
+
+      return "";
+    }
+
+    void
+    expect_(char _c)
+    {
+      skipSpace_();
+      if (expr_[pos_] != _c)
+        throw std::runtime_error(std::string("Expected ") + _c);
+      ++pos_;
+    }
+
+    NodePtr
+    makeNode_(multidraw::ExprTree::NodeType _type, std::string const& _name)
+    {
+      auto node(std::make_unique<Node>());
+      node->type = _type;
+      node->name = _name;
+      return node;
+    }
+
+    NodePtr
+    parseTernary_()
+    {
+      auto cond(parseBinary_(0));
+
+      skipSpace_();
+      if (expr_[pos_] != '?')
+        return cond;
+
+      ++pos_;
+
+      auto node(makeNode_(multidraw::ExprTree::kTernary, "?:"));
+      node->args.push_back(std::move(cond));
+      node->args.push_back(parseTernary_());
+      expect_(':');
+      node->args.push_back(parseTernary_());
+      return node;
+    }
+
+    NodePtr
+    parseBinary_(unsigned _level)
+    {
+      if (_level == binaryOperators.size())
+        return parseUnary_();
+
+      auto lhs(parseBinary_(_level + 1));
+
+      while (true) {
+        auto op(peekOperator_());
+        if (op.empty() || op == "^" || op == "**" || precedence(op) != _level)
+          return lhs;
+
+        pos_ += op.size();
+
+        auto node(makeNode_(multidraw::ExprTree::kBinary, op));
+        node->args.push_back(std::move(lhs));
+        node->args.push_back(parseBinary_(_level + 1));
+        lhs = std::move(node);
+      }
+    }
+
+    NodePtr
+    parseUnary_()
+    {
+      skipSpace_();
+
+      char c(expr_[pos_]);
+      if (c == '~')
+        throw std::runtime_error("Bitwise operators are not supported");
+
+      if (c == '-' || c == '+' || c == '!') {
+        ++pos_;
+        auto node(makeNode_(multidraw::ExprTree::kUnary, std::string(1, c)));
+        node->args.push_back(parseUnary_());
+        return node;
+      }
+
+      return parsePower_();
+    }
+
+    NodePtr
+    parsePower_()
+    {
+      auto base(parsePrimary_());
+
+      auto op(peekOperator_());
+      if (op != "^" && op != "**")
+        return base;
+
+      pos_ += op.size();
+
+      auto node(makeNode_(multidraw::ExprTree::kBinary, "^"));
+      node->args.push_back(std::move(base));
+      node->args.push_back(parseUnary_());
+      return node;
+    }
+
+    NodePtr
+    parsePrimary_()
+    {
+      skipSpace_();
+
+      char c(expr_[pos_]);
+
+      if (c == '(') {
+        ++pos_;
+        auto node(parseTernary_());
+        expect_(')');
+        return node;
+      }
+
+      if (std::isdigit(c) || (c == '.' && std::isdigit(expr_[pos_ + 1])))
+        return parseNumber_();
+
+      if (std::isalpha(c) || c == '_')
+        return parseName_();
+
+      throw std::runtime_error("Unexpected character");
+    }
+
+    NodePtr
+    parseNumber_()
+    {
+      char const* begin(expr_ + pos_);
+      char const* end(begin);
+      while (std::isdigit(*end) || *end == '.')
+        ++end;
+      if (*end == 'e' || *end == 'E') {
+        ++end;
+        if (*end == '+' || *end == '-')
+          ++end;
+        if (!std::isdigit(*end))
+          throw std::runtime_error("Invalid number");
+        while (std::isdigit(*end))
+          ++end;
+      }
+
+      if (std::isalpha(*end) || *end == '_')
+        throw std::runtime_error("Invalid number");
+
+      std::string literal(begin, end);
+      pos_ += end - begin;
+
+      char* parsed(nullptr);
+      double value(std::strtod(literal.c_str(), &parsed));
+      if (*parsed != '\0')
+        throw std::runtime_error("Invalid number");
+
+      return makeNode_(multidraw::ExprTree::kNumber, formatNumber(value));
+    }
+
+    NodePtr
+    parseName_()
+    {
+      unsigned begin(pos_);
+      while (true) {
+        char c(expr_[pos_]);
+        if (std::isalnum(c) || c == '_' || c == '$' || c == '.')
+          ++pos_;
+        else if (c == ':' && expr_[pos_ + 1] == ':')
+          pos_ += 2;
+        else
+          break;
+      }
+
+      std::string name(expr_ + begin, expr_ + pos_);
+
+      if (expr_[pos_] == '(') {
+        ++pos_;
+        auto node(makeNode_(multidraw::ExprTree::kCall, name));
+        skipSpace_();
+        if (expr_[pos_] == ')') {
+          ++pos_;
+          return node;
+        }
+        while (true) {
+          node->args.push_back(parseTernary_());
+          skipSpace_();
+          if (expr_[pos_] == ',') {
+            ++pos_;
+            continue;
+          }
+          expect_(')');
+          return node;
+        }
+      }
+
+      auto node(makeNode_(multidraw::ExprTree::kVariable, name));
+
+      while (true) {
+        // no skipSpace_ here: subscripts must follow the name immediately
+        if (expr_[pos_] != '[')
+          break;
+
+        ++pos_;
+        skipSpace_();
+        if (expr_[pos_] == ']') {
+          ++pos_;
+          node->args.emplace_back(nullptr);
+        }
+        else {
+          node->args.push_back(parseTernary_());
+          expect_(']');
+        }
+      }
+
+      if (expr_[pos_] == '.' || expr_[pos_] == '@')
+        throw std::runtime_error("Member access of subscripted variables is not supported");
+
+      if (node->args.empty() && tree_ != nullptr) {
+        char const* alias(tree_->GetAlias(name.c_str()));
+        if (alias != nullptr)
+          return Parser(alias, tree_, depth_ + 1).parse();
+      }
+
+      return node;
+    }
+
+    char const* expr_;
+    TTree const* tree_;
+    unsigned depth_;
+    unsigned pos_{0};
+  };
+
+  //! Canonical text of a child node when printed under the given parent
+  std::string
+  wrap(Node const& _parent, Node const& _child, bool _rhs)
+  {
+    bool needParen(false);
+
+    switch (_child.type) {
+    case multidraw::ExprTree::kNumber:
+      needParen = _child.name[0] == '-' && _parent.type != multidraw::ExprTree::kCall;
+      break;
+    case multidraw::ExprTree::kVariable:
+    case multidraw::ExprTree::kCall:
+      break;
+    case multidraw::ExprTree::kUnary:
+    case multidraw::ExprTree::kTernary:
+      needParen = _parent.type != multidraw::ExprTree::kCall;
+      break;
+    case multidraw::ExprTree::kBinary:
+      if (_parent.type == multidraw::ExprTree::kBinary) {
+        unsigned pprec(precedence(_parent.name));
+        unsigned cprec(precedence(_child.name));
+        if (cprec < pprec)
+          needParen = true;
+        else if (cprec == pprec)
+          needParen = _rhs || isFragile(_child.name);
+        else
+          needParen = isFragile(_child.name) || isFragile(_parent.name);
+      }
+      else
+        needParen = _parent.type != multidraw::ExprTree::kCall;
+      break;
+    }
+
+    if (needParen)
+      return "(" + _child.text + ")";
+    else
+      return _child.text;
+  }
+
+  //! Normalize the subtree in place and set the canonical texts
+  void
+  normalize(Node& _node)
+  {
+    for (auto& arg : _node.args) {
+      if (arg)
+        normalize(*arg);
+    }
+
+    switch (_node.type) {
+    case multidraw::ExprTree::kNumber:
+      _node.text = _node.name;
+      return;
+
+    case multidraw::ExprTree::kVariable:
+      _node.text = _node.name;
+      for (auto& sub : _node.args) {
+        if (sub)
+          _node.text += "[" + sub->text + "]";
+        else
+          _node.text += "[]";
+      }
+      return;
+
+    case multidraw::ExprTree::kCall:
+      _node.text = _node.name + "(";
+      for (unsigned iA(0); iA != _node.args.size(); ++iA) {
+        if (iA != 0)
+          _node.text += ",";
+        _node.text += _node.args[iA]->text;
+      }
+      _node.text += ")";
+      return;
+
+    case multidraw::ExprTree::kUnary:
+      if (_node.name == "+") {
+        // drop the unary plus
+        NodePtr operand(std::move(_node.args[0]));
+        _node = std::move(*operand);
+        return;
+      }
+      if (_node.name == "-" && _node.args[0]->type == multidraw::ExprTree::kNumber) {
+        // fold the sign into the literal
+        double value(-std::strtod(_node.args[0]->name.c_str(), nullptr));
+        _node.type = multidraw::ExprTree::kNumber;
+        _node.name = formatNumber(value);
+        _node.args.clear();
+        _node.text = _node.name;
+        return;
+      }
+      _node.text = _node.name + wrap(_node, *_node.args[0], false);
+      return;
+
+    case multidraw::ExprTree::kBinary:
+      if (_node.name == ">" || _node.name == ">=") {
+        _node.name = (_node.name == ">" ? "<" : "<=");
+        std::swap(_node.args[0], _node.args[1]);
+      }
+      else if (isCommutative(_node.name) && _node.args[1]->text < _node.args[0]->text)
+        std::swap(_node.args[0], _node.args[1]);
+
+      _node.text = wrap(_node, *_node.args[0], false) + _node.name + wrap(_node, *_node.args[1], true);
+      return;
+
+    case multidraw::ExprTree::kTernary:
+      _node.text = wrap(_node, *_node.args[0], false) + "?" + wrap(_node, *_node.args[1], false) + ":" + wrap(_node, *_node.args[2], false);
+      return;
+    }
+  }
+
+}
+
+multidraw::ExprTree::ExprTree(char const* _expr, TTree const* _tree/* = nullptr*/) :
+  canonical_(_expr)
+{
+  try {
+    root_ = Parser(_expr, _tree, 0).parse();
+  }
+  catch (std::runtime_error&) {
+    return;
+  }
+
+  normalize(*root_);
+  canonical_ = root_->text;
+}
+
+std::string
+multidraw::ExprTree::canonicalize(char const* _expr, TTree const* _tree/* = nullptr*/)
+{
+  return ExprTree(_expr, _tree).getCanonical();
+}
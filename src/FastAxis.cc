@@ -0,0 +1,283 @@
+#include "../interface/FastAxis.h"
+
+#include "TH1D.h"
+#include "TH1F.h"
+#include "TProfile.h"
+#include "TProfile2D.h"
+#include "TArrayD.h"
+
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+
+multidraw::FastAxis::FastAxis(TAxis const& _axis) :
+  nbins_(_axis.GetNbins()),
+  xmin_(_axis.GetXmin()),
+  xmax_(_axis.GetXmax())
+{
+  auto* xbins(_axis.GetXbins());
+  if (xbins->fN != 0)
+    edges_.assign(xbins->fArray, xbins->fArray + xbins->fN);
+}
+
+/*static*/
+TString
+multidraw::FastAxis::getSignature(TAxis const& _axis)
+{
+  TString signature(TString::Format("%d[%.17g,%.17g]", _axis.GetNbins(), _axis.GetXmin(), _axis.GetXmax()));
+
+  auto* xbins(_axis.GetXbins());
+  for (int iE(0); iE < xbins->fN; ++iE)
+    signature += TString::Format("%c%.17g", iE == 0 ? '{' : ',', xbins->fArray[iE]);
+  if (xbins->fN != 0)
+    signature += "}";
+
+  return signature;
+}
+
+double
+multidraw::FastAxis::getBinLowEdge(int _bin) const
+{
+  // Same as TAxis::GetBinLowEdge
+  if (!edges_.empty() && _bin > 0 && _bin <= nbins_ + 1)
+    return edges_[_bin - 1];
+
+  double binWidth((xmax_ - xmin_) / nbins_);
+  return xmin_ + (_bin - 1) * binWidth;
+}
+
+bool
+multidraw::FastBinArray::isSupported(TH1 const& _hist)
+{
+  if (_hist.InheritsFrom(TProfile::Class()) || _hist.InheritsFrom(TProfile2D::Class()))
+    return false;
+
+  if (_hist.GetDimension() > 2 || _hist.GetBuffer() != nullptr)
+    return false;
+
+  TAxis const* axes[2]{_hist.GetXaxis(), _hist.GetYaxis()};
+  for (auto* axis : axes) {
+    // GetStats recomputes the statistics from the bin contents when an axis range is set
+    if (axis->CanExtend() || axis->TestBit(TAxis::kAxisRange))
+      return false;
+  }
+
+  return dynamic_cast<TArrayD const*>(&_hist) != nullptr || dynamic_cast<TArrayF const*>(&_hist) != nullptr;
+}
+
+bool
+multidraw::FastBinArray::set(TH1& _hist)
+{
+  hist_ = nullptr;
+  dcontent_ = nullptr;
+  fcontent_ = nullptr;
+  sumw2_ = nullptr;
+
+  if (!isSupported(_hist))
+    return false;
+
+  if (auto* array = dynamic_cast<TArrayD*>(&_hist))
+    dcontent_ = array->fArray;
+  else if (auto* array = dynamic_cast<TArrayF*>(&_hist))
+    fcontent_ = array->fArray;
+  else
+    return false;
+
+  hist_ = &_hist;
+
+  if (_hist.GetSumw2N() != 0)
+    sumw2_ = _hist.GetSumw2()->GetArray();
+
+  isNotW_ = _hist.TestBit(TH1::kIsNotW);
+
+#if ROOT_VERSION_CODE >= ROOT_VERSION(6,18,0)
+  statOverflows_ = _hist.GetStatOverflowsBehaviour();
+#else
+  statOverflows_ = TH1::GetStatOverflows();
+#endif
+
+  // GetStats may compute the statistics from the bin contents. Store them before the first fill so that flush()
+  // reads back the statistics without the fills and adds the accumulated ones.
+  double stats[TH1::kNstat]{};
+  _hist.GetStats(stats);
+  _hist.PutStats(stats);
+
+  std::fill(stats_, stats_ + TH1::kNstat, 0.);
+  entries_ = 0.;
+
+  return true;
+}
+
+void
+multidraw::FastBinArray::flush()
+{
+  if (hist_ == nullptr || entries_ == 0.)
+    return;
+
+  double stats[TH1::kNstat]{};
+  hist_->GetStats(stats);
+  for (unsigned iS(0); iS != TH1::kNstat; ++iS)
+    stats[iS] += stats_[iS];
+
+  hist_->PutStats(stats);
+  hist_->SetEntries(hist_->GetEntries() + entries_);
+
+  std::fill(stats_, stats_ + TH1::kNstat, 0.);
+  entries_ = 0.;
+}
+
+void
+multidraw::FastBinArray::updateSumw2_(double _w)
+{
+  if (hist_->GetSumw2N() != 0) {
+    // Created by another filler of the same histogram
+    sumw2_ = hist_->GetSumw2()->GetArray();
+    return;
+  }
+
+  if (_w == 1.)
+    return;
+
+  // Same as TH1::Fill. Sumw2 copies the contents into the sumw2 array only if the histogram has entries, and
+  // the fills are not counted in the histogram yet; all fills so far had unit weight, so we copy ourselves.
+  hist_->Sumw2();
+  sumw2_ = hist_->GetSumw2()->GetArray();
+
+  for (int iB(0); iB != hist_->GetNcells(); ++iB)
+    sumw2_[iB] = std::abs(hist_->GetBinContent(iB));
+}
+
+void
+multidraw::LocalBinArray::set(TH1 const& _hist)
+{
+  nCells_ = _hist.GetNcells();
+
+#if ROOT_VERSION_CODE >= ROOT_VERSION(6,18,0)
+  statOverflows_ = _hist.GetStatOverflowsBehaviour();
+#else
+  statOverflows_ = TH1::GetStatOverflows();
+#endif
+}
+
+void
+multidraw::LocalBinArray::addTo(TH1& _hist) const
+{
+  if (!isFilled())
+    return;
+
+  // GetStats may compute the statistics from the bin contents, so it must be called before the contents change
+  double stats[TH1::kNstat]{};
+  _hist.GetStats(stats);
+  for (unsigned iS(0); iS != TH1::kNstat; ++iS)
+    stats[iS] += stats_[iS];
+
+  double entries(_hist.GetEntries() + entries_);
+
+  // Same as TH1::Fill
+  if (nonUnitWeights_ && _hist.GetSumw2N() == 0 && !_hist.TestBit(TH1::kIsNotW))
+    _hist.Sumw2();
+
+  double* sumw2(_hist.GetSumw2N() == 0 ? nullptr : _hist.GetSumw2()->GetArray());
+
+  auto addCell([&_hist, sumw2](int bin, double const* cell) {
+      _hist.AddBinContent(bin, cell[0]);
+      if (sumw2 != nullptr)
+        sumw2[bin] += cell[1];
+    });
+
+  if (!dense_.empty()) {
+    for (int iB(0); iB != nCells_; ++iB) {
+      if (dense_[2 * iB + 1] != 0.)
+        addCell(iB, &dense_[2 * iB]);
+    }
+  }
+  else {
+    for (auto& binCell : sparse_)
+      addCell(binCell.first, binCell.second.data());
+  }
+
+  _hist.PutStats(stats);
+  _hist.SetEntries(entries);
+}
+
+void
+multidraw::SharedBinArray::attach(TH1& _hist)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  if (nUsers_++ != 0)
+    return;
+
+  // First user; all earlier fills are written to the histogram
+  hist_ = &_hist;
+  dcontent_ = nullptr;
+  fcontent_ = nullptr;
+
+  if (auto* array = dynamic_cast<TArrayD*>(&_hist))
+    dcontent_ = array->fArray;
+  else if (auto* array = dynamic_cast<TArrayF*>(&_hist))
+    fcontent_ = array->fArray;
+  else
+    throw std::runtime_error(TString::Format("Histogram %s cannot be filled from shared threads", _hist.GetName()).Data());
+
+  // The weights of the other threads are not known in advance
+  if (_hist.GetSumw2N() == 0 && !_hist.TestBit(TH1::kIsNotW))
+    _hist.Sumw2();
+
+  sumw2_ = (_hist.GetSumw2N() == 0 ? nullptr : _hist.GetSumw2()->GetArray());
+
+#if ROOT_VERSION_CODE >= ROOT_VERSION(6,18,0)
+  statOverflows_ = _hist.GetStatOverflowsBehaviour();
+#else
+  statOverflows_ = TH1::GetStatOverflows();
+#endif
+
+  _hist.GetStats(stats_);
+  entries_ = _hist.GetEntries();
+}
+
+void
+multidraw::SharedBinArray::detach(double const* _stats, double _entries)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  for (unsigned iS(0); iS != TH1::kNstat; ++iS)
+    stats_[iS] += _stats[iS];
+  entries_ += _entries;
+
+  // Totals are written at every detach so that the histogram is consistent whenever no filler is attached
+  hist_->PutStats(stats_);
+  hist_->SetEntries(entries_);
+
+  --nUsers_;
+}
+
+multidraw::SharedBinFiller::SharedBinFiller(SharedBinFiller&& _orig) :
+  array_(_orig.array_),
+  entries_(_orig.entries_)
+{
+  std::copy(_orig.stats_, _orig.stats_ + TH1::kNstat, stats_);
+  _orig.array_ = nullptr;
+}
+
+void
+multidraw::SharedBinFiller::set(SharedBinArray& _array, TH1& _hist)
+{
+  flush();
+
+  _array.attach(_hist);
+  array_ = &_array;
+
+  std::fill(stats_, stats_ + TH1::kNstat, 0.);
+  entries_ = 0.;
+}
+
+void
+multidraw::SharedBinFiller::flush()
+{
+  if (array_ == nullptr)
+    return;
+
+  array_->detach(stats_, entries_);
+  array_ = nullptr;
+}
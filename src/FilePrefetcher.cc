@@ -0,0 +1,103 @@
+#include "../interface/FilePrefetcher.h"
+
+#include "TObjArray.h"
+#include "TUrl.h"
+
+#include <cstring>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+multidraw::FilePrefetcher::FilePrefetcher(TChain const& _chain, unsigned _depth, int _nTrees/* = -1*/) :
+  depth_(_depth)
+{
+  // Resolve the paths here; the background thread must not use ROOT
+  for (auto* elem : *_chain.GetListOfFiles()) {
+    if (_nTrees >= 0 && paths_.size() == unsigned(_nTrees))
+      break;
+
+    TUrl url(elem->GetTitle(), kTRUE);
+    if (std::strcmp(url.GetProtocol(), "file") == 0)
+      paths_.emplace_back(url.GetFile());
+    else
+      paths_.emplace_back();
+  }
+
+  thread_ = std::thread(&FilePrefetcher::run_, this);
+}
+
+multidraw::FilePrefetcher::~FilePrefetcher()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    done_ = true;
+    queue_.clear();
+  }
+  condition_.notify_one();
+
+  thread_.join();
+}
+
+void
+multidraw::FilePrefetcher::setTreeNumber(int _treeNumber)
+{
+  if (next_ <= unsigned(_treeNumber))
+    next_ = _treeNumber + 1;
+
+  unsigned end(std::min(_treeNumber + 1 + depth_, unsigned(paths_.size())));
+  if (next_ >= end)
+    return;
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (; next_ != end; ++next_) {
+      if (!paths_[next_].empty())
+        queue_.push_back(next_);
+    }
+  }
+  condition_.notify_one();
+}
+
+void
+multidraw::FilePrefetcher::run_()
+{
+  while (true) {
+    unsigned index(0);
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      condition_.wait(lock, [this]() { return done_ || !queue_.empty(); });
+      if (done_)
+        return;
+
+      index = queue_.front();
+      queue_.pop_front();
+    }
+
+    prefetch_(paths_[index]);
+  }
+}
+
+void
+multidraw::FilePrefetcher::prefetch_(std::string const& _path)
+{
+  // Opening the file is what stalls on slow storage; the read-ahead itself is asynchronous
+  int fd(open(_path.c_str(), O_RDONLY));
+  if (fd < 0)
+    return;
+
+  struct stat st;
+  if (fstat(fd, &st) == 0) {
+    long long size(st.st_size);
+    if (size <= 2 * prefetchSize) {
+      posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    }
+    else {
+      posix_fadvise(fd, 0, prefetchSize, POSIX_FADV_WILLNEED);
+      posix_fadvise(fd, size - prefetchSize, prefetchSize, POSIX_FADV_WILLNEED);
+    }
+  }
+
+  close(fd);
+}
@@ -1,9 +1,36 @@
 #include "../interface/FormulaLibrary.h"
+#include "../interface/ExprTree.h"
 
 #include <cstring>
 #include <iostream>
 #include <sstream>
 
+namespace {
+
+  bool
+  isConstant(multidraw::ExprTree::Node const& _node)
+  {
+    if (_node.type == multidraw::ExprTree::kVariable)
+      return false;
+
+    if (_node.type == multidraw::ExprTree::kCall) {
+      // method calls on global objects (e.g. gRandom.Rndm()) and random number generators are not constant
+      TString name(_node.name.c_str());
+      name.ToLower();
+      if (name.Contains(".") || name.Contains("rndm") || name.Contains("random"))
+        return false;
+    }
+
+    for (auto& arg : _node.args) {
+      if (arg && !isConstant(*arg))
+        return false;
+    }
+
+    return true;
+  }
+
+}
+
 multidraw::FormulaLibrary::FormulaLibrary(TTree& _tree) :
   tree_(_tree)
 {
@@ -14,14 +41,16 @@ multidraw::FormulaLibrary::getFormula(char const* _expr, bool _silent/* = false*
 {
   if (_expr == nullptr || std::strlen(_expr) == 0)
     throw std::invalid_argument("Empty expression");
-  
-  std::shared_ptr<TTreeFormulaCached::Cache> cache;
 
-  auto fItr(caches_.find(_expr));
-  if (fItr != caches_.end())
-    cache = fItr->second;
+  // Equivalent expressions share the formula object
+  ExprTree exprTree(_expr, &tree_);
+  std::string const& key(exprTree.getCanonical());
+
+  auto fItr(formulas_.find(key));
+  if (fItr != formulas_.end())
+    return *fItr->second;
 
-  auto* formula(NewTTreeFormulaCached("formula", _expr, &tree_, cache, _silent));
+  auto* formula(NewTTreeFormulaCached("formula", _expr, &tree_, nullptr, _silent));
   if (formula == nullptr) {
     std::stringstream ss;
     ss << "Failed to compile expression \"" << _expr << "\"";
@@ -30,37 +59,70 @@ multidraw::FormulaLibrary::getFormula(char const* _expr, bool _silent/* = false*
     throw std::invalid_argument(ss.str());
   }
 
-  if (fItr == caches_.end())
-    caches_.emplace(std::string(_expr), formula->GetCache());
+  // Do not reload the branches already loaded for the current entry by other formulas
+  formula->SetQuickLoad(kTRUE);
 
-  formulas_.emplace_back(formula);
+  formulas_.emplace(key, formula);
+
+  // Expressions without any variable (after alias expansion) are constants
+  if (exprTree.isValid() && isConstant(*exprTree.getRoot()))
+    setPerFile(*formula);
 
   return *formula;
 }
 
+void
+multidraw::FormulaLibrary::setPerFile(TTreeFormulaCached& _formula)
+{
+  if (_formula.GetCache())
+    _formula.GetCache()->fPerFile = true;
+}
+
+void
+multidraw::FormulaLibrary::enableGraph()
+{
+  if (!graph_)
+    graph_ = std::make_unique<ExprGraph>(*this, tree_);
+}
+
 void
 multidraw::FormulaLibrary::updateFormulaLeaves()
 {
-  for (auto& form : formulas_)
-    form->UpdateFormulaLeaves();
+  for (auto& ef : formulas_) {
+    ef.second->UpdateFormulaLeaves();
+    ef.second->ResetCache();
+  }
 }
 
 void
 multidraw::FormulaLibrary::resetCache()
 {
-  for (auto& ec : caches_)
-    ec.second->fValues.clear();
+  for (auto& ef : formulas_) {
+    auto& cache(ef.second->GetCache());
+    if (cache && cache->fPerFile)
+      continue;
+
+    ef.second->ResetCache();
+  }
+
+  if (graph_)
+    graph_->resetCache();
 }
 
 void
 multidraw::FormulaLibrary::replaceAll(char const* _from, char const* _to)
 {
   bool replaced{false};
-  for (auto& formula : formulas_) {
-    if (formula->ReplaceLeaf(_from, _to))
+  for (auto& ef : formulas_) {
+    if (ef.second->ReplaceLeaf(_from, _to))
       replaced = true;
   }
 
-  if (replaced)
-    resetCache();
+  if (replaced) {
+    for (auto& ef : formulas_)
+      ef.second->ResetCache();
+
+    if (graph_)
+      graph_->resetCache();
+  }
 }
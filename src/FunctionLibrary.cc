@@ -1,4 +1,57 @@
 #include "../interface/FunctionLibrary.h"
+#include "../interface/FormulaLibrary.h"
+
+#include "TBranch.h"
+#include "TLeaf.h"
+
+#include <cstring>
+
+namespace {
+
+  //! The single leaf of a plain branch of basic type; nullptr for other branches
+  TLeaf*
+  plainLeaf(TBranch& _branch)
+  {
+    if (_branch.IsA() != TBranch::Class() || _branch.GetNleaves() != 1)
+      return nullptr;
+
+    auto* leaf(static_cast<TLeaf*>(_branch.GetListOfLeaves()->At(0)));
+    // Character strings are not arrays of values
+    if (leaf->InheritsFrom("TLeafC"))
+      return nullptr;
+
+    return leaf;
+  }
+
+  void
+  checkLeafType(TLeaf const& _leaf, char const* _bname, char const* _typeName)
+  {
+    if (std::strcmp(_leaf.GetTypeName(), _typeName) == 0)
+      return;
+
+    std::stringstream ss;
+    ss << "Branch " << _bname << " is of type " << _leaf.GetTypeName() << ", not " << _typeName;
+    throw std::runtime_error(ss.str());
+  }
+
+}
+
+std::size_t
+multidraw::BranchReader::load_()
+{
+  std::size_t size(formula_->GetNdata());
+  if (size != 0) // evaluating the first instance loads the leaf
+    formula_->EvalInstance(0);
+
+  return size;
+}
+
+void*
+multidraw::BranchReader::data_()
+{
+  load_();
+  return formula_->GetLeaf(0)->GetValuePointer();
+}
 
 multidraw::FunctionLibrary::~FunctionLibrary()
 {
@@ -9,19 +62,64 @@ multidraw::FunctionLibrary::~FunctionLibrary()
 void
 multidraw::FunctionLibrary::setEntry(long long _iEntry)
 {
-  reader_->SetEntry(_iEntry);
-  for (auto& fct : functions_)
-    fct.second->beginEvent(_iEntry);
+  entry_ = _iEntry;
+  entryLoaded_ = false;
+
+  for (auto* fct : lazyFunctions_)
+    fct->pendingEntry_ = _iEntry;
+
+  if (eagerFunctions_.empty())
+    return;
+
+  loadEntry();
+  for (auto* fct : eagerFunctions_)
+    fct->beginEvent(_iEntry);
 }
 
 multidraw::TTreeFunction&
 multidraw::FunctionLibrary::getFunction(TTreeFunction const& _source)
 {
-  auto fItr(functions_.find(&_source));
-  if (fItr == functions_.end())
-    fItr = functions_.emplace(&_source, _source.linkedCopy(*this)).first;
+  auto fItr(functionsBySource_.find(&_source));
+  if (fItr != functionsBySource_.end())
+    return *fItr->second;
+
+  std::string key(_source.getKey());
+  if (!key.empty()) {
+    auto kItr(functionsByKey_.find(key));
+    if (kItr != functionsByKey_.end()) {
+      functionsBySource_.emplace(&_source, kItr->second);
+      return *kItr->second;
+    }
+  }
+
+  functions_.push_back(_source.linkedCopy(*this));
+  auto* fct(functions_.back().get());
+
+  functionsBySource_.emplace(&_source, fct);
+  if (!key.empty())
+    functionsByKey_.emplace(key, fct);
+
+  if (fct->isLazy())
+    lazyFunctions_.push_back(fct);
+  else
+    eagerFunctions_.push_back(fct);
+
+  return *fct;
+}
+
+TTreeFormulaCached*
+multidraw::FunctionLibrary::getSharedFormula_(char const* _bname, char const* _typeName)
+{
+  if (formulaLibrary_ == nullptr)
+    return nullptr;
 
-  return *fItr->second.get();
+  auto* leaf(plainLeaf(*reader_->GetTree()->GetBranch(_bname)));
+  if (leaf == nullptr)
+    return nullptr;
+
+  checkLeafType(*leaf, _bname, _typeName);
+
+  return &formulaLibrary_->getFormula(_bname);
 }
 
 void
@@ -31,5 +129,20 @@ multidraw::FunctionLibrary::replaceAll(char const* _from, char const* _to)
   if (fItr == branchReaders_.end())
     return;
 
-  fItr->second->replace(*reader_, _to);
+  auto& branchReader(*fItr->second);
+
+  if (branchReader.isShared()) {
+    // The formula already points to the new leaf; its buffer must hold the same type
+    auto* branch(reader_->GetTree()->GetBranch(_to));
+    TLeaf* leaf(branch == nullptr ? nullptr : plainLeaf(*branch));
+    if (leaf == nullptr) {
+      std::stringstream ss;
+      ss << "Cannot replace branch " << _from << " with " << _to << ": not a plain branch";
+      throw std::runtime_error(ss.str());
+    }
+
+    checkLeafType(*leaf, _to, branchReader.getTypeName());
+  }
+  else
+    branchReader.replace(*reader_, _to);
 }
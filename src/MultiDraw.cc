@@ -1,19 +1,21 @@
 #include "../interface/MultiDraw.h"
 #include "../interface/FormulaLibrary.h"
 #include "../interface/FunctionLibrary.h"
+#include "../interface/ReweightLibrary.h"
+#include "../interface/SharedAccumulator.h"
+#include "../interface/FilePrefetcher.h"
 
 #include "TFile.h"
+#include "TSystem.h"
 #include "TBranch.h"
 #include "TGraph.h"
 #include "TF1.h"
 #include "TError.h"
-#include "TLeafF.h"
-#include "TLeafD.h"
-#include "TLeafI.h"
-#include "TLeafL.h"
 #include "TEntryList.h"
 #include "TTreeFormulaManager.h"
 #include "TChainElement.h"
+#include "TParameter.h"
+#include "TKey.h"
 
 #include <stdexcept>
 #include <cstring>
@@ -24,6 +26,12 @@
 #include <numeric>
 #include <memory>
 #include <unordered_map>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+
+#include <unistd.h>
+#include <sys/wait.h>
 
 multidraw::MultiDraw::MultiDraw(char const* _treeName/* = "events"*/) :
   treeName_{_treeName},
@@ -40,6 +48,7 @@ multidraw::MultiDraw::MultiDraw(MultiDraw const& _orig) :
   weightBranchName_{_orig.weightBranchName_},
   evtNumBranchName_{_orig.evtNumBranchName_},
   inputMultiplexing_{_orig.inputMultiplexing_},
+  multiplexingMode_{_orig.multiplexingMode_},
   prescale_{_orig.prescale_},
   filter_(new Cut("", _orig.filter_->getCutExpr())),
   aliases_{_orig.aliases_},
@@ -49,6 +58,11 @@ multidraw::MultiDraw::MultiDraw(MultiDraw const& _orig) :
   printLevel_{_orig.printLevel_},
   doTimeProfile_{_orig.doTimeProfile_},
   doAbortOnReadError_{_orig.doAbortOnReadError_},
+  doFactorizeExpressions_{_orig.doFactorizeExpressions_},
+  prefetchDepth_{_orig.prefetchDepth_},
+  incrementalCachePath_{_orig.incrementalCachePath_},
+  cacheGroupSize_{_orig.cacheGroupSize_},
+  removeCacheOnCompletion_{_orig.removeCacheOnCompletion_},
   totalEvents_{_orig.totalEvents_}
 {
   for (auto const& ft : _orig.friendTrees_)
@@ -130,12 +144,13 @@ multidraw::MultiDraw::setCategorization(char const* _cutName, char const* _expr)
 }
 
 void
-multidraw::MultiDraw::addAlias(char const* _name, char const* _expr)
+multidraw::MultiDraw::addAlias(char const* _name, char const* _expr, bool _perFile/* = false*/)
 {
   if (_name == nullptr || std::strlen(_name) == 0)
     throw std::invalid_argument("Cannot add an alias with no name");
 
   aliases_.emplace_back(_name, CompiledExprSource(_expr));
+  aliases_.back().second.setPerFile(_perFile);
 }
 
 void
@@ -162,15 +177,17 @@ multidraw::MultiDraw::removeCut(char const* _name)
 }
 
 void
-multidraw::MultiDraw::setReweight(char const* _expr, TObject const* _source/* = nullptr*/)
+multidraw::MultiDraw::setReweight(char const* _expr, TObject const* _source/* = nullptr*/, bool _perFile/* = false*/)
 {
   globalReweightSource_ = std::make_unique<ReweightSource>(_expr, _source);
+  globalReweightSource_->setPerFile(_perFile);
 }
 
 void
-multidraw::MultiDraw::setReweight(char const* _xexpr, char const* _yexpr, TObject const* _source/* = nullptr*/)
+multidraw::MultiDraw::setReweight(char const* _xexpr, char const* _yexpr, TObject const* _source/* = nullptr*/, bool _perFile/* = false*/)
 {
   globalReweightSource_ = std::make_unique<ReweightSource>(_xexpr, _yexpr, _source);
+  globalReweightSource_->setPerFile(_perFile);
 }
 
 void
@@ -252,6 +269,76 @@ multidraw::MultiDraw::addPlotList2D(TObjArray* _histlist, TTreeFunction const& _
   return addPlotList2D_(_histlist, CompiledExprSource(_xfunc), CompiledExprSource(_yfunc), _cutName, _reweight);
 }
 
+multidraw::PlotNDFiller&
+multidraw::MultiDraw::addPlotND(THnBase* _hist, std::vector<TString> const& _exprs, char const* _cutName/* = ""*/, char const* _reweight/* = ""*/)
+{
+  if (printLevel_ > 1) {
+    std::cout << "\nAdding plot " << _hist->GetName() << " with expressions";
+    for (auto& expr : _exprs)
+      std::cout << " " << expr;
+    std::cout << std::endl;
+    if (_cutName != nullptr && std::strlen(_cutName) != 0)
+      std::cout << " Cut: " << _cutName << std::endl;
+    if (_reweight != nullptr && std::strlen(_reweight) != 0)
+      std::cout << " Reweight: " << _reweight << std::endl;
+  }
+
+  auto& cut(findCut_(_cutName));
+
+  std::vector<CompiledExprSource> sources;
+  for (auto& expr : _exprs)
+    sources.emplace_back(expr);
+
+  auto* filler(new PlotNDFiller(*_hist, sources, _reweight));
+
+  cut.addFiller(std::unique_ptr<ExprFiller>(filler));
+
+  return *filler;
+}
+
+multidraw::PlotNDFiller&
+multidraw::MultiDraw::addPlotListND(TObjArray* _histlist, std::vector<TString> const& _exprs, char const* _cutName/* = ""*/, char const* _reweight/* = ""*/)
+{
+  if (printLevel_ > 1) {
+    std::cout << "\nAdding plot list with expressions";
+    for (auto& expr : _exprs)
+      std::cout << " " << expr;
+    std::cout << std::endl;
+    if (_cutName != nullptr && std::strlen(_cutName) != 0)
+      std::cout << " Cut: " << _cutName << std::endl;
+    if (_reweight != nullptr && std::strlen(_reweight) != 0)
+      std::cout << " Reweight: " << _reweight << std::endl;
+  }
+
+  auto& cut(findCut_(_cutName));
+
+  int ncat(cut.getNCategories());
+  if (ncat != -1 && ncat !=_histlist->GetEntries())
+    throw std::runtime_error("Size of histogram list does not match the number of categories");
+
+  std::vector<CompiledExprSource> sources;
+  for (auto& expr : _exprs)
+    sources.emplace_back(expr);
+
+  auto* filler(new PlotNDFiller(*_histlist, sources, _reweight));
+
+  cut.addFiller(std::unique_ptr<ExprFiller>(filler));
+
+  return *filler;
+}
+
+multidraw::PlotGroupFiller&
+multidraw::MultiDraw::addPlotGroup(char const* _expr, char const* _reweight/* = ""*/)
+{
+  return addPlotGroup_(CompiledExprSource(_expr), _reweight);
+}
+
+multidraw::PlotGroupFiller&
+multidraw::MultiDraw::addPlotGroup(TTreeFunction const& _func, char const* _reweight/* = ""*/)
+{
+  return addPlotGroup_(CompiledExprSource(_func), _reweight);
+}
+
 multidraw::TreeFiller&
 multidraw::MultiDraw::addTree(TTree* _tree, char const* _cutName/* = ""*/, char const* _reweight/* = ""*/)
 {
@@ -428,6 +515,90 @@ multidraw::MultiDraw::addPlotList2D_(TObjArray* _histlist, CompiledExprSource co
   return *filler;
 }
 
+multidraw::PlotGroupFiller&
+multidraw::MultiDraw::addPlotGroup_(CompiledExprSource const& _source, char const* _reweight/* = ""*/)
+{
+  if (printLevel_ > 1) {
+    std::cout << "\nAdding plot group with ";
+    if (_source.getFormula().Length() != 0)
+      std::cout << "expression " << _source.getFormula() << std::endl;
+    else
+      std::cout << "function " << _source.getFunction()->getName() << std::endl;
+    if (_reweight != nullptr && std::strlen(_reweight) != 0)
+      std::cout << " Reweight: " << _reweight << std::endl;
+  }
+
+  // Groups fill after all cuts are evaluated (see EventProcessor::processEvent)
+  auto* filler(new PlotGroupFiller(_source, _reweight));
+
+  filter_->addFiller(std::unique_ptr<ExprFiller>(filler));
+
+  return *filler;
+}
+
+/*static*/
+void
+multidraw::MultiDraw::checkSharedFill_(std::vector<MultiDraw const*> const& _drawers)
+{
+  // Number of fillers of each object, and whether any of them fills from shared threads
+  std::map<TObject const*, std::pair<unsigned, bool>> usage;
+
+  auto addFiller([&usage](ExprFiller& filler) {
+      bool shared(false);
+      if (auto* plot1D = dynamic_cast<Plot1DFiller*>(&filler))
+        shared = plot1D->getSharedFill();
+      else if (auto* plot2D = dynamic_cast<Plot2DFiller*>(&filler))
+        shared = plot2D->getSharedFill();
+
+      std::vector<TObject*> objs;
+      filler.collectObjs(objs);
+      for (auto* obj : objs) {
+        auto& use(usage[obj]);
+        ++use.first;
+        use.second = use.second || shared;
+      }
+    });
+
+  auto addCut([&addFiller](Cut& cut) {
+      for (unsigned iF(0); iF != cut.getNFillers(); ++iF) {
+        auto* filler(cut.getFiller(iF));
+        if (auto* group = dynamic_cast<PlotGroupFiller*>(filler)) {
+          for (unsigned iP(0); iP != group->getNPlots(); ++iP)
+            addFiller(group->getPlot(iP));
+        }
+        else
+          addFiller(*filler);
+      }
+    });
+
+  for (auto* drawer : _drawers) {
+    addCut(*drawer->filter_);
+    for (auto& namecut : drawer->cuts_)
+      addCut(*namecut.second);
+  }
+
+  for (auto& objUse : usage) {
+    if (objUse.second.second && objUse.second.first > 1)
+      throw std::runtime_error(TString::Format("Histogram %s is filled from shared threads and cannot be filled by another filler", objUse.first->GetName()).Data());
+  }
+}
+
+/*static*/
+bool
+multidraw::MultiDraw::isActiveCut_(Cut const& _filter, TString const& _name, Cut const& _cut)
+{
+  if (_name.Length() == 0 || _cut.getNFillers() != 0)
+    return true;
+
+  for (unsigned iF(0); iF != _filter.getNFillers(); ++iF) {
+    auto* group(dynamic_cast<PlotGroupFiller const*>(_filter.getFiller(iF)));
+    if (group != nullptr && group->hasCut(_name))
+      return true;
+  }
+
+  return false;
+}
+
 unsigned
 multidraw::MultiDraw::numObjs() const
 {
@@ -437,8 +608,350 @@ multidraw::MultiDraw::numObjs() const
   return n;
 }
 
+void
+multidraw::MultiDraw::setIncrementalCache(char const* _path, unsigned _groupSize/* = 0*/)
+{
+  incrementalCachePath_ = _path;
+  cacheGroupSize_ = _groupSize;
+  removeCacheOnCompletion_ = false;
+}
+
+void
+multidraw::MultiDraw::setCheckpoint(char const* _path, unsigned _nFiles)
+{
+  if (_nFiles == 0)
+    throw std::invalid_argument("Checkpoint interval must be at least one file");
+
+  incrementalCachePath_ = _path;
+  cacheGroupSize_ = _nFiles;
+  removeCacheOnCompletion_ = true;
+}
+
 void
 multidraw::MultiDraw::execute(long _nEntries/* = -1*/, unsigned long _firstEntry/* = 0*/)
+{
+  std::vector<MultiDraw const*> drawers{this};
+  drawers.insert(drawers.end(), companions_.begin(), companions_.end());
+  checkSharedFill_(drawers);
+
+  if (incrementalCachePath_.Length() != 0) {
+    if (_nEntries != -1 || _firstEntry != 0)
+      throw std::runtime_error("Incremental execution cannot be limited to a range of entries");
+
+    executeIncremental_();
+  }
+  else
+    executeInputs_(_nEntries, _firstEntry);
+}
+
+void
+multidraw::MultiDraw::executeIncremental_()
+{
+  if (entryList_ != nullptr || !friendTrees_.empty() || !treeWeights_.empty() || !treeReweightSources_.empty())
+    throw std::runtime_error("Incremental execution is not possible with entry lists, friend trees, or tree-by-tree weights");
+
+  // Identify the input files by path, size, and modification time
+  std::vector<TString> fileNames;
+  std::vector<TString> identities;
+  {
+    TChain chain(treeName_);
+    for (auto& path : inputPaths_)
+      chain.Add(path);
+
+    for (auto* elem : *chain.GetListOfFiles()) {
+      fileNames.emplace_back(elem->GetTitle());
+
+      FileStat_t stat;
+      if (gSystem->GetPathInfo(fileNames.back(), stat) == 0)
+        identities.push_back(TString::Format("%s|%lld|%ld", fileNames.back().Data(), stat.fSize, stat.fMtime));
+      else
+        identities.push_back(fileNames.back()); // cannot detect changes
+    }
+  }
+
+  // Stored in full; with a hash, a collision would silently mix in results of another configuration
+  TString signature(getSignature_());
+
+  std::unique_ptr<TFile> cacheFile(TFile::Open(incrementalCachePath_, "update"));
+  if (!cacheFile || cacheFile->IsZombie())
+    throw std::runtime_error(("Failed to open incremental cache " + incrementalCachePath_).Data());
+
+  auto* storedSignature(dynamic_cast<TNamed*>(cacheFile->Get("signature")));
+  if (storedSignature == nullptr || signature != storedSignature->GetTitle()) {
+    // Configuration has changed - all partial results are invalid
+    if (printLevel_ > 0 && storedSignature != nullptr)
+      std::cout << "Configuration changed; discarding the incremental cache" << std::endl;
+
+    cacheFile->Close();
+    cacheFile.reset(TFile::Open(incrementalCachePath_, "recreate"));
+    if (!cacheFile || cacheFile->IsZombie())
+      throw std::runtime_error(("Failed to open incremental cache " + incrementalCachePath_).Data());
+
+    TNamed signatureObj("signature", signature);
+    cacheFile->WriteTObject(&signatureObj);
+  }
+
+  // A group is usable only if all of its files are still in the input and unchanged
+  std::set<TString> currentIdentities(identities.begin(), identities.end());
+  std::set<TString> cachedIdentities;
+  std::vector<TDirectory*> groups;
+  std::vector<TString> staleGroups;
+  int maxGroupIndex(-1);
+
+  for (auto* key : *cacheFile->GetListOfKeys()) {
+    TString name(key->GetName());
+    if (!name.BeginsWith("group_"))
+      continue;
+
+    maxGroupIndex = std::max(maxGroupIndex, std::atoi(name.Data() + 6));
+
+    auto* group(static_cast<TDirectory*>(cacheFile->Get(name)));
+    auto* files(static_cast<TNamed*>(group->Get("files")));
+
+    std::vector<TString> groupIdentities;
+    bool valid(files != nullptr);
+    if (valid) {
+      std::istringstream ss(files->GetTitle());
+      std::string identity;
+      while (std::getline(ss, identity)) {
+        groupIdentities.emplace_back(identity);
+        if (currentIdentities.count(groupIdentities.back()) == 0 || cachedIdentities.count(groupIdentities.back()) != 0)
+          valid = false;
+      }
+    }
+
+    if (valid) {
+      cachedIdentities.insert(groupIdentities.begin(), groupIdentities.end());
+      groups.push_back(group);
+    }
+    else
+      staleGroups.push_back(name);
+  }
+
+  for (auto& name : staleGroups)
+    cacheFile->Delete(name + ";*");
+
+  std::vector<TString> newFiles;
+  std::vector<TString> newIdentities;
+  for (unsigned iF(0); iF != fileNames.size(); ++iF) {
+    if (cachedIdentities.count(identities[iF]) != 0)
+      continue;
+
+    newFiles.push_back(fileNames[iF]);
+    newIdentities.push_back(identities[iF]);
+  }
+
+  if (printLevel_ > 0) {
+    std::cout << "Incremental execution: " << (fileNames.size() - newFiles.size()) << " files in " << groups.size();
+    std::cout << " cached groups, " << newFiles.size() << " files to process" << std::endl;
+  }
+
+  std::vector<Cut*> cuts;
+  std::vector<TH1*> hists;
+  std::vector<TTree*> outputTrees;
+  collectOutputs_(cuts, hists, outputTrees);
+
+  // Cut and filler counts, in the order of collectOutputs_
+  auto getCounts([&cuts]() {
+      std::vector<unsigned long long> counts;
+      for (auto* cut : cuts) {
+        counts.push_back(cut->getCount());
+        for (unsigned iF(0); iF != cut->getNFillers(); ++iF)
+          counts.push_back(cut->getFiller(iF)->getCount());
+      }
+      return counts;
+    });
+
+  long long totalEvents(0);
+  std::vector<unsigned long long> totalCounts(getCounts().size(), 0);
+
+  unsigned groupSize(cacheGroupSize_ == 0 ? newFiles.size() : cacheGroupSize_);
+  int groupIndex(maxGroupIndex);
+
+  for (unsigned iFirst(0); iFirst < newFiles.size(); iFirst += groupSize) {
+    unsigned iEnd(std::min(iFirst + groupSize, unsigned(newFiles.size())));
+    std::vector<TString> groupFiles(newFiles.begin() + iFirst, newFiles.begin() + iEnd);
+
+    // Fill the new files into emptied histograms so that they can be saved as a partial result
+    std::vector<std::unique_ptr<TH1>> originals;
+    bool currentTH1AddDirectory(TH1::AddDirectoryStatus());
+    TH1::AddDirectory(false);
+    for (auto* hist : hists) {
+      originals.emplace_back(static_cast<TH1*>(hist->Clone()));
+      hist->Reset();
+    }
+    TH1::AddDirectory(currentTH1AddDirectory);
+
+    std::vector<long long> treeOffsets;
+    for (auto* tree : outputTrees)
+      treeOffsets.push_back(tree->GetEntries());
+
+    inputPaths_.swap(groupFiles);
+    try {
+      executeInputs_(-1, 0);
+    }
+    catch (...) {
+      inputPaths_.swap(groupFiles);
+      throw;
+    }
+    inputPaths_.swap(groupFiles);
+
+    totalEvents += totalEvents_;
+
+    auto* group(cacheFile->mkdir(TString::Format("group_%d", ++groupIndex)));
+
+    TString identityList;
+    for (unsigned iF(iFirst); iF != iEnd; ++iF)
+      identityList += newIdentities[iF] + "\n";
+
+    TNamed files("files", identityList);
+    group->WriteTObject(&files);
+    TParameter<Long64_t> events("events", totalEvents_);
+    group->WriteTObject(&events);
+
+    auto counts(getCounts());
+    TString countList;
+    for (unsigned iC(0); iC != counts.size(); ++iC) {
+      totalCounts[iC] += counts[iC];
+      countList += TString::Format("%llu,", counts[iC]);
+    }
+    TNamed countsObj("counts", countList);
+    group->WriteTObject(&countsObj);
+
+    for (unsigned iH(0); iH != hists.size(); ++iH) {
+      group->WriteTObject(hists[iH], TString::Format("obj%u", iH));
+      hists[iH]->Add(originals[iH].get());
+    }
+
+    for (unsigned iT(0); iT != outputTrees.size(); ++iT) {
+      auto* tree(outputTrees[iT]);
+      auto* partial(tree->CopyTree("", "", tree->GetEntries() - treeOffsets[iT], treeOffsets[iT]));
+      partial->SetDirectory(group);
+      partial->Write(TString::Format("tree%u", iT));
+      delete partial;
+    }
+
+    // Make the group readable even if the process is killed before the cache file is closed
+    group->SaveSelf(kTRUE);
+    cacheFile->SaveSelf(kTRUE);
+    cacheFile->Flush();
+
+    if (printLevel_ > 0 && iEnd != newFiles.size())
+      std::cout << "Saved " << iEnd << " / " << newFiles.size() << " files to " << incrementalCachePath_ << std::endl;
+  }
+
+  for (auto* group : groups) {
+    for (unsigned iH(0); iH != hists.size(); ++iH) {
+      auto* partial(dynamic_cast<TH1*>(group->Get(TString::Format("obj%u", iH))));
+      if (partial == nullptr)
+        throw std::runtime_error(TString::Format("Incremental cache is missing histogram %u", iH).Data());
+
+      if (!hists[iH]->Add(partial))
+        throw std::runtime_error(TString::Format("Failed to add the cached partial result to histogram %s", hists[iH]->GetName()).Data());
+    }
+
+    for (unsigned iT(0); iT != outputTrees.size(); ++iT) {
+      auto* partial(dynamic_cast<TTree*>(group->Get(TString::Format("tree%u", iT))));
+      if (partial == nullptr)
+        throw std::runtime_error(TString::Format("Incremental cache is missing tree %u", iT).Data());
+
+      TObjArray arr;
+      arr.Add(partial);
+      outputTrees[iT]->Merge(&arr);
+    }
+
+    auto* events(dynamic_cast<TParameter<Long64_t>*>(group->Get("events")));
+    if (events != nullptr)
+      totalEvents += events->GetVal();
+
+    auto* counts(dynamic_cast<TNamed*>(group->Get("counts")));
+    if (counts != nullptr) {
+      std::istringstream ss(counts->GetTitle());
+      std::string count;
+      for (unsigned iC(0); iC != totalCounts.size() && std::getline(ss, count, ','); ++iC)
+        totalCounts[iC] += std::stoull(count);
+    }
+  }
+
+  cacheFile->Close();
+
+  if (removeCacheOnCompletion_)
+    gSystem->Unlink(incrementalCachePath_);
+
+  totalEvents_ = totalEvents;
+
+  unsigned iC(0);
+  for (auto* cut : cuts) {
+    cut->setCount(totalCounts[iC++]);
+    for (unsigned iF(0); iF != cut->getNFillers(); ++iF)
+      cut->getFiller(iF)->setCount(totalCounts[iC++]);
+  }
+}
+
+void
+multidraw::MultiDraw::collectOutputs_(std::vector<Cut*>& _cuts, std::vector<TH1*>& _hists, std::vector<TTree*>& _trees) const
+{
+  unsigned firstCut(_cuts.size());
+
+  _cuts.push_back(filter_.get());
+  for (auto& namecut : cuts_) {
+    if (!isActiveCut_(*filter_, namecut.first, *namecut.second)) // skipped in executeOne_
+      continue;
+    _cuts.push_back(namecut.second.get());
+  }
+
+  for (unsigned iC(firstCut); iC != _cuts.size(); ++iC) {
+    auto* cut(_cuts[iC]);
+    for (unsigned iF(0); iF != cut->getNFillers(); ++iF) {
+      std::vector<TObject*> objs;
+      cut->getFiller(iF)->collectObjs(objs);
+
+      for (auto* obj : objs) {
+        if (obj->InheritsFrom(TH1::Class()))
+          _hists.push_back(static_cast<TH1*>(obj));
+        else if (obj->InheritsFrom(TTree::Class()))
+          _trees.push_back(static_cast<TTree*>(obj));
+        else if (obj->InheritsFrom(THnBase::Class()))
+          throw std::runtime_error(TString::Format("N-dimensional histogram %s cannot be used in the process multiplexing mode or with an incremental cache", obj->GetName()).Data());
+        else
+          throw std::runtime_error(TString::Format("Object %s is neither a histogram nor a tree", obj->GetName()).Data());
+      }
+    }
+  }
+
+  for (auto* companion : companions_)
+    companion->collectOutputs_(_cuts, _hists, _trees);
+}
+
+TString
+multidraw::MultiDraw::getSignature_() const
+{
+  TString signature(treeName_ + ";" + goodRunBranch_[0] + "," + goodRunBranch_[1] + "{");
+  for (auto& run : goodRuns_) {
+    for (unsigned v : run.second)
+      signature += TString::Format("%u:%u,", run.first, v);
+  }
+  signature += "};" + weightBranchName_ + ";" + evtNumBranchName_ + TString::Format(";%u;%.17g;", prescale_, globalWeight_);
+
+  if (globalReweightSource_)
+    signature += globalReweightSource_->getSignature();
+
+  signature += ";aliases{";
+  for (auto& alias : aliases_)
+    signature += alias.first + "=" + alias.second.getSignature() + ",";
+  signature += "};" + filter_->getSignature() + ";";
+
+  for (auto& namecut : cuts_)
+    signature += namecut.second->getSignature() + ";";
+
+  for (auto& replacement : branchReplacements_)
+    signature += replacement.first + ">" + replacement.second + ",";
+
+  return signature;
+}
+
+void
+multidraw::MultiDraw::executeInputs_(long _nEntries, unsigned long _firstEntry)
 {
   totalEvents_ = 0;
 
@@ -498,7 +1011,7 @@ multidraw::MultiDraw::execute(long _nEntries/* = -1*/, unsigned long _firstEntry
       fileNames.emplace_back(elem->GetTitle());
 
     std::vector<std::unique_ptr<TChain>> trees;
-    std::vector<std::unique_ptr<std::thread>> threads;
+    std::vector<std::function<void()>> tasks;
 
     // threads will clone the histograms; need to disable adding to gDirectory
     bool currentTH1AddDirectory(TH1::AddDirectoryStatus());
@@ -530,17 +1043,16 @@ multidraw::MultiDraw::execute(long _nEntries/* = -1*/, unsigned long _firstEntry
 
       if (printLevel_ > 0) {
         std::cout << "Splitting task over " << nTrees;
-        std::cout << " files in " << inputMultiplexing_ << " threads" << std::endl;
+        std::cout << " files in " << inputMultiplexing_ << (multiplexingMode_ == kProcesses ? " processes" : " threads") << std::endl;
       }
 
-      unsigned nFilesPerThread(nTrees / inputMultiplexing_);
-      // main thread processes the residuals too
-      unsigned nFilesMainThread(nTrees - nFilesPerThread * (inputMultiplexing_ - 1));
+      // Contiguous ranges of files with balanced estimated work; main thread processes the first range
+      auto boundaries(partitionFiles_(fileNames, inputMultiplexing_));
 
       for (unsigned iT(0); iT != inputMultiplexing_ - 1; ++iT) {
         auto* tree(new TChain(treeName_));
 
-        unsigned treeNumberOffset(nFilesMainThread + iT * nFilesPerThread);
+        unsigned treeNumberOffset(boundaries[iT + 1]);
         TEntryList* threadElist{nullptr};
 
         if (entryList_ != nullptr) {
@@ -548,7 +1060,7 @@ multidraw::MultiDraw::execute(long _nEntries/* = -1*/, unsigned long _firstEntry
           threadElist->SetDirectory(nullptr);
         }
 
-        for (unsigned iS(treeNumberOffset); iS != treeNumberOffset + nFilesPerThread; ++iS) {
+        for (unsigned iS(treeNumberOffset); iS != boundaries[iT + 2]; ++iS) {
           auto& fileName(fileNames[iS]);
           tree->Add(fileName);
           if (threadElist != nullptr)
@@ -558,11 +1070,11 @@ multidraw::MultiDraw::execute(long _nEntries/* = -1*/, unsigned long _firstEntry
         if (threadElist != nullptr)
           tree->SetEntryList(threadElist);
 
-        threads.emplace_back(new std::thread(threadTask, -1, 0, tree, treeNumberOffset));
+        tasks.emplace_back(std::bind(threadTask, -1, 0, tree, treeNumberOffset));
         trees.emplace_back(tree);
       }
 
-      nEntriesMain = nFilesMainThread;
+      nEntriesMain = boundaries[1];
       byTreeMain = true;
     }
     else {
@@ -631,7 +1143,7 @@ multidraw::MultiDraw::execute(long _nEntries/* = -1*/, unsigned long _firstEntry
         if (threadElist != nullptr)
           tree->SetEntryList(threadElist);
 
-        threads.push_back(std::make_unique<std::thread>(threadTask, nPerThread, threadFirstEntry, tree, treeNumberOffset));
+        tasks.emplace_back(std::bind(threadTask, nPerThread, threadFirstEntry, tree, treeNumberOffset));
         trees.emplace_back(tree);
 
         firstEntry += nPerThread;
@@ -644,25 +1156,38 @@ multidraw::MultiDraw::execute(long _nEntries/* = -1*/, unsigned long _firstEntry
 #endif
     }
 
-    // Started N-1 threads. Process the rest of events (staring from 0) in the main thread
-
+    // Set up N-1 tasks. Process the rest of events (staring from 0) in the main thread
+    auto mainTask([&]() {
 #if ROOT_VERSION_CODE < ROOT_VERSION(6,12,0)
-    executeOne_(nEntriesMain, firstEntryMain, mainTree, synchTools, 0, treeOffsetsMain, byTreeMain);
+        this->executeOne_(nEntriesMain, firstEntryMain, mainTree, synchTools, 0, treeOffsetsMain, byTreeMain);
 #else
-    executeOne_(nEntriesMain, firstEntryMain, mainTree, synchTools, 0, byTreeMain);
+        this->executeOne_(nEntriesMain, firstEntryMain, mainTree, synchTools, 0, byTreeMain);
 #endif
+      });
 
-    {
-      std::unique_lock<std::mutex> lock(synchTools.mutex);
-      synchTools.mainDone = true;
-      synchTools.condition.notify_all();
+    if (multiplexingMode_ == kProcesses) {
+      executeForked_(tasks, mainTask, synchTools);
     }
+    else {
+      // Cut and filler counts (reported and cached by the incremental execution) must cover all threads
+      synchTools.mergeCounts = true;
+
+      std::vector<std::unique_ptr<std::thread>> threads;
+      for (auto& task : tasks)
+        threads.push_back(std::make_unique<std::thread>(task));
+
+      mainTask();
 
-    // Let all threads join first before destroying the trees
-    for (auto& thread : threads)
-      thread->join();
+      {
+        std::unique_lock<std::mutex> lock(synchTools.mutex);
+        synchTools.mainDone = true;
+        synchTools.condition.notify_all();
+      }
 
-    threads.clear();
+      // Let all threads join first before destroying the trees
+      for (auto& thread : threads)
+        thread->join();
+    }
 
     // Tree deletion should not be concurrent with THx deletion, which happens during the last part of executeOne_ (in Cut dtors)
     for (unsigned iT(0); iT != inputMultiplexing_ - 1; ++iT) {
@@ -690,7 +1215,14 @@ multidraw::MultiDraw::execute(long _nEntries/* = -1*/, unsigned long _firstEntry
           if (this->printLevel_ > 1) {
             for (unsigned iF(0); iF != cut.getNFillers(); ++iF) {
               auto* filler(cut.getFiller(iF));
-              std::cout << "          " << filler->getObj().GetName() << ": " << filler->getCount() << std::endl;
+              std::cout << "          " << filler->getObj().GetName() << ": " << filler->getCount();
+              // A plot group counts each instance once, however many of its histograms it is filled into
+              auto* group(dynamic_cast<PlotGroupFiller const*>(filler));
+              if (group != nullptr)
+                std::cout << " (shared by " << group->getNPlots() << " histograms)";
+              if (filler->getNOutOfRange() != 0)
+                std::cout << " (" << filler->getNOutOfRange() << " out of category range)";
+              std::cout << std::endl;
             }
           }
         });
@@ -699,7 +1231,7 @@ multidraw::MultiDraw::execute(long _nEntries/* = -1*/, unsigned long _firstEntry
 
       for (auto& namecut : cuts_) {
         auto& cut(*namecut.second);
-        if (namecut.first.Length() != 0 && cut.getNFillers() == 0) // skip non-default cut with no filler
+        if (!isActiveCut_(*filter_, namecut.first, cut)) // skip non-default cut with no filler
           continue;
 
         printCut(cut);
@@ -708,97 +1240,370 @@ multidraw::MultiDraw::execute(long _nEntries/* = -1*/, unsigned long _firstEntry
   }
 }
 
-typedef std::chrono::steady_clock SteadyClock;
-
-double
-millisec(SteadyClock::duration const& interval)
+std::vector<double>
+multidraw::MultiDraw::estimateFileWork_(std::vector<TString> const& _fileNames) const
 {
-  return std::chrono::duration_cast<std::chrono::nanoseconds>(interval).count() * 1.e-6;
-}
+  unsigned nFiles(_fileNames.size());
 
-// Global to be used by functions executed within expressions
-namespace multidraw {
-  thread_local TTree* currentTree{nullptr};
+  // Estimate the work per file from metadata that does not require opening the files. In order of preference:
+  // number of entries in the entry list, number of entries seen in earlier executions, size on disk, 1.
+  std::vector<double> weights;
+
+  if (entryList_ != nullptr) {
+    for (auto& fileName : _fileNames) {
+      auto* elist(entryList_->GetEntryList(treeName_, fileName));
+      weights.push_back(elist == nullptr ? 0. : elist->GetN());
+    }
+  }
+  else {
+    for (auto& fileName : _fileNames) {
+      auto eItr(fileEntries_.find(fileName));
+      if (eItr == fileEntries_.end())
+        break;
+      weights.push_back(eItr->second);
+    }
+
+    if (weights.size() != nFiles) {
+      weights.clear();
+
+      for (auto& fileName : _fileNames) {
+        FileStat_t stat;
+        if (gSystem->GetPathInfo(fileName, stat) != 0)
+          break;
+        weights.push_back(stat.fSize);
+      }
+    }
+
+    if (weights.size() != nFiles)
+      weights.assign(nFiles, 1.);
+  }
+
+  return weights;
 }
 
-long
-#if ROOT_VERSION_CODE < ROOT_VERSION(6,12,0)
-multidraw::MultiDraw::executeOne_(long _nEntries, unsigned long _firstEntry, TChain& _tree, SynchTools& _synchTools, unsigned _treeNumberOffset/* = 0*/, Long64_t* _treeOffsets/* = nullptr*/, bool _byTree/* = false*/)
-#else
-multidraw::MultiDraw::executeOne_(long _nEntries, unsigned long _firstEntry, TChain& _tree, SynchTools& _synchTools, unsigned _treeNumberOffset/* = 0*/, bool _byTree/* = false*/)
-#endif
+std::vector<unsigned>
+multidraw::MultiDraw::partitionFiles_(std::vector<TString> const& _fileNames, unsigned _nParts) const
 {
-  // treeNumberOffset: The offset of the given tree with respect to the original
+  unsigned nFiles(_fileNames.size());
 
-  std::vector<SteadyClock::duration> cutTimers;
-  SteadyClock::duration ioTimer(SteadyClock::duration::zero());
-  SteadyClock::duration eventTimer(SteadyClock::duration::zero());
-  SteadyClock::time_point start;
+  auto weights(estimateFileWork_(_fileNames));
 
-  bool isMainThread(std::this_thread::get_id() == _synchTools.mainThread);
+  double total(std::accumulate(weights.begin(), weights.end(), 0.));
 
-  int printLevel(-1);
-  bool doTimeProfile(false);
+  // Close each range at the file whose midpoint crosses the target cumulative weight, with at least one file per range
+  std::vector<unsigned> boundaries{0};
+  double sum(0.);
+  unsigned iF(0);
+  for (unsigned iP(1); iP != _nParts; ++iP) {
+    double target(total * iP / _nParts);
+    while (iF < nFiles - (_nParts - iP) && (iF == boundaries.back() || sum + weights[iF] * 0.5 <= target))
+      sum += weights[iF++];
 
-  if (isMainThread) {
-    printLevel = printLevel_;
-    doTimeProfile = doTimeProfile_;
+    boundaries.push_back(iF);
   }
+  boundaries.push_back(nFiles);
 
-  if (_tree.GetNtrees() == 0) {
-    // TTreeFormula compilation crashes if there is no tree in the chain
-    if (printLevel >= 0)
-      std::cout << "Input tree is empty." << std::endl;
+  if (printLevel_ > 1) {
+    std::cout << "File partitioning:";
+    for (unsigned iP(0); iP != _nParts; ++iP)
+      std::cout << " " << (boundaries[iP + 1] - boundaries[iP]);
+    std::cout << std::endl;
+  }
 
-    return 0;
+  return boundaries;
+}
+
+void
+multidraw::MultiDraw::executeForked_(std::vector<std::function<void()>> const& _tasks, std::function<void()> const& _mainTask, SynchTools& _synchTools)
+{
+  // Objects and counters are identified by their order, which is the same in all processes
+  std::vector<Cut*> cuts;
+  std::vector<TH1*> hists;
+  std::vector<TTree*> outputTrees;
+  collectOutputs_(cuts, hists, outputTrees);
+
+  unsigned nCounters(1); // total events
+  for (auto* cut : cuts)
+    nCounters += 1 + cut->getNFillers();
+
+  SharedAccumulator accumulator(hists, nCounters);
+
+  std::vector<TString> outputPaths;
+  if (!outputTrees.empty()) {
+    for (unsigned iW(0); iW != _tasks.size(); ++iW)
+      outputPaths.emplace_back(TString::Format("%s/multidraw_%d_%u.root", gSystem->TempDirectory(), gSystem->GetPid(), iW));
   }
 
-  currentTree = &_tree;
+  // Buffered output would be printed by every child
+  std::cout.flush();
+  std::fflush(nullptr);
 
-  // Create the repository of all TTreeFormulas
-  FormulaLibrary library(_tree);
-  // and of all TTreeFunctions
-  FunctionLibrary flibrary(_tree);
+  std::vector<pid_t> pids;
+  for (unsigned iW(0); iW != _tasks.size(); ++iW) {
+    pid_t pid(fork());
+    if (pid < 0)
+      break;
 
-  // If we have custom-defined aliases, must compile them before cuts and fillers refer to them
-  struct AliasSpec {
-    TBranch* nbranch{nullptr};
-    TBranch* vbranch{nullptr};
+    if (pid != 0) {
+      pids.push_back(pid);
+      continue;
+    }
+
+    // Worker process from here. Objects are copies of the parent's; fill them from scratch and report the differences.
+    int status(0);
+
+    try {
+      printLevel_ = -1;
+      doTimeProfile_ = false;
+      for (auto* companion : companions_) {
+        companion->printLevel_ = -1;
+        companion->doTimeProfile_ = false;
+      }
+
+      for (auto* hist : hists)
+        hist->Reset();
+
+      // Baskets must not be written to the file of the parent process
+      std::unique_ptr<TFile> outputFile;
+      if (!outputTrees.empty()) {
+        outputFile.reset(TFile::Open(outputPaths[iW], "recreate"));
+        if (!outputFile || outputFile->IsZombie())
+          throw std::runtime_error(("Failed to open " + outputPaths[iW]).Data());
+
+        for (auto* tree : outputTrees) {
+          tree->Reset();
+          tree->SetDirectory(outputFile.get());
+        }
+      }
+
+      _tasks[iW]();
+
+      std::vector<unsigned long long> counters{_synchTools.totalEvents};
+      for (auto* cut : cuts) {
+        counters.push_back(cut->getCount());
+        for (unsigned iF(0); iF != cut->getNFillers(); ++iF)
+          counters.push_back(cut->getFiller(iF)->getCount());
+      }
+
+      accumulator.add(hists, counters);
+
+      if (outputFile) {
+        outputFile->cd();
+        for (unsigned iT(0); iT != outputTrees.size(); ++iT)
+          outputTrees[iT]->Write(TString::Format("tree%u", iT));
+        outputFile->Close();
+      }
+    }
+    catch (std::exception& ex) {
+      std::cerr << "Worker process " << iW << ": " << ex.what() << std::endl;
+      status = 1;
+    }
+
+    std::cout.flush();
+    // Skip all destructors and exit handlers, which may write to files shared with the parent
+    _exit(status);
+  }
+
+  bool forkFailed(pids.size() != _tasks.size());
+
+  std::exception_ptr mainException;
+  if (!forkFailed) {
+    try {
+      _mainTask();
+    }
+    catch (...) {
+      mainException = std::current_exception();
+    }
+  }
+
+  unsigned nFailed(0);
+  for (pid_t pid : pids) {
+    int status(0);
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      ++nFailed;
+  }
+
+  for (auto& path : outputPaths) {
+    if (nFailed != 0 || forkFailed || mainException) {
+      gSystem->Unlink(path);
+      continue;
+    }
+
+    std::unique_ptr<TFile> source(TFile::Open(path));
+    if (!source || source->IsZombie()) {
+      ++nFailed;
+      continue;
+    }
+
+    for (unsigned iT(0); iT != outputTrees.size(); ++iT) {
+      auto* tree(static_cast<TTree*>(source->Get(TString::Format("tree%u", iT))));
+      if (tree == nullptr) {
+        ++nFailed;
+        continue;
+      }
+
+      TObjArray arr;
+      arr.Add(tree);
+      outputTrees[iT]->Merge(&arr);
+    }
+
+    source->Close();
+    gSystem->Unlink(path);
+  }
+
+  if (mainException)
+    std::rethrow_exception(mainException);
+
+  if (forkFailed)
+    throw std::runtime_error("Failed to fork worker processes");
+
+  if (nFailed != 0)
+    throw std::runtime_error(TString::Format("%u worker processes failed", nFailed).Data());
+
+  accumulator.addTo(hists);
+
+  _synchTools.totalEvents += accumulator.getCounter(0);
+
+  unsigned iC(1);
+  for (auto* cut : cuts) {
+    cut->setCount(cut->getCount() + accumulator.getCounter(iC++));
+    for (unsigned iF(0); iF != cut->getNFillers(); ++iF) {
+      auto* filler(cut->getFiller(iF));
+      filler->setCount(filler->getCount() + accumulator.getCounter(iC++));
+    }
+  }
+}
+
+typedef std::chrono::steady_clock SteadyClock;
+
+double
+millisec(SteadyClock::duration const& interval)
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(interval).count() * 1.e-6;
+}
+
+// Global to be used by functions executed within expressions
+namespace multidraw {
+  thread_local TTree* currentTree{nullptr};
+}
+
+//! Per-configuration part of the event loop.
+/*!
+ * Holds the cuts, fillers, aliases, and weights of one MultiDraw object bound to the formula and function
+ * libraries of the event loop. executeOne_ creates one processor for itself and one for each companion
+ * MultiDraw (see MultiDrawGroup), and handles the tree I/O common to all processors.
+ */
+class multidraw::MultiDraw::EventProcessor {
+public:
+  EventProcessor(MultiDraw&, TChain&, FormulaLibrary&, FunctionLibrary&, ReweightLibrary&, SynchTools&, bool isMainThread, long long const& iEntry, unsigned index);
+  ~EventProcessor();
+
+  //! Called at a tree transition, before the formula leaves are updated
+  void prepareTree();
+  //! Called at a tree transition, after the formula leaves are updated. Returns false if the current event must be skipped.
+  bool beginTree(unsigned treeNumber);
+  void processEvent();
+  //! Print the time profile and unlink or merge the cuts
+  void finish(long long nEntries, SteadyClock::duration const& ioTimer);
+
+private:
+  struct AliasSpec {
+    TBranch* nbranch{nullptr};
+    TBranch* vbranch{nullptr};
     unsigned nD{0};
     std::vector<double> values{};
     std::unique_ptr<CompiledExpr> sourceExpr{};
   };
 
-  std::unique_ptr<TTree> aliasesTree(nullptr);
-  std::vector<AliasSpec> aliases;
+  MultiDraw& md_;
+  TChain& tree_;
+  FormulaLibrary& library_;
+  SynchTools& synchTools_;
+  bool isMainThread_;
+  long long const& iEntry_;
+
+  int printLevel_{-1};
+  bool doTimeProfile_{false};
+
+  std::vector<SteadyClock::duration> cutTimers_{};
+  SteadyClock::duration ioTimer_{SteadyClock::duration::zero()};
+  SteadyClock::duration eventTimer_{SteadyClock::duration::zero()};
+
+  std::unique_ptr<TTree> aliasesTree_{};
+  std::vector<AliasSpec> aliases_{};
+
+  CutPtr filter_{};
+  std::vector<CutPtr> cuts_{};
+  //! Original cuts of the clones (non-main threads)
+  std::vector<Cut*> cutSources_{};
+  bool filterHasAliases_{false};
+
+  ReweightPtr globalReweight_{};
+  std::unordered_map<unsigned, std::pair<ReweightPtr, bool>> treeReweights_{};
+
+  // Weight and event number branches are read through the formula library so that the branches are loaded
+  // only once per entry even if they also appear in the expressions
+  TTreeFormulaCached* weightFormula_{nullptr};
+  TTreeFormulaCached* evtNumFormula_{nullptr};
+
+  std::function<bool()> isGoodRunEvent_{};
+
+  double treeWeight_{1.};
+  //! Non-factorized reweights applied to the current tree, resolved at each tree transition. The flag is
+  //! set for the factors whose number of instances determines the number of event weights.
+  std::vector<std::pair<Reweight*, bool>> weightFactors_{};
+  bool skipEvent_{false};
+
+  std::vector<double> eventWeights_{};
+};
+
+multidraw::MultiDraw::EventProcessor::EventProcessor(MultiDraw& _md, TChain& _tree, FormulaLibrary& _library, FunctionLibrary& _flibrary, ReweightLibrary& _rlibrary, SynchTools& _synchTools, bool _isMainThread, long long const& _iEntry, unsigned _index) :
+  md_(_md),
+  tree_(_tree),
+  library_(_library),
+  synchTools_(_synchTools),
+  isMainThread_(_isMainThread),
+  iEntry_(_iEntry)
+{
+  if (isMainThread_) {
+    printLevel_ = md_.printLevel_;
+    doTimeProfile_ = md_.doTimeProfile_;
+  }
+
+  int printLevel(printLevel_);
+
+  // If we have custom-defined aliases, must compile them before cuts and fillers refer to them
 
   //int const maxTreeSize(100);
 
-  if (!aliases_.empty()) {
+  if (!md_.aliases_.empty()) {
     {
-      std::lock_guard<std::mutex> lock(_synchTools.mutex);
+      std::lock_guard<std::mutex> lock(synchTools_.mutex);
       TDirectory::TContext(nullptr);
-      aliasesTree = std::make_unique<TTree>("_aliases", "");
+      if (_index == 0)
+        aliasesTree_ = std::make_unique<TTree>("_aliases", "");
+      else
+        aliasesTree_ = std::make_unique<TTree>(TString::Format("_aliases%u", _index), "");
     }
 
-    _tree.AddFriend(aliasesTree.get());
+    _tree.AddFriend(aliasesTree_.get());
 
-    aliases.reserve(aliases_.size());
+    aliases_.reserve(md_.aliases_.size());
 
     std::vector<TString> negativeMultiplicity;
 
     // Adding aliases in given order - aliases dependent on others must be declared in order
-    for (auto& v : aliases_) {
+    for (auto& v : md_.aliases_) {
       auto& name(v.first);
       auto& exprSource(v.second);
 
       if (_tree.GetBranch(name) != nullptr)
         throw std::runtime_error(("Branch with name " + name + " already exists in the input tree. Cannot define alias.").Data());
 
-      aliases.resize(aliases.size() + 1);
-      auto& varspec(aliases.back());
+      aliases_.resize(aliases_.size() + 1);
+      auto& varspec(aliases_.back());
 
-      varspec.sourceExpr = std::move(exprSource.compile(library, flibrary));
+      varspec.sourceExpr = std::move(exprSource.compile(_library, _flibrary));
 
       int multiplicity(0);
 
@@ -815,6 +1620,12 @@ multidraw::MultiDraw::executeOne_(long _nEntries, unsigned long _firstEntry, TCh
 
         multiplicity = formulaManager->GetMultiplicity();
       }
+      else if (varspec.sourceExpr->getNode() != nullptr) {
+        if (printLevel >= 1)
+          std::cout << " = " << exprSource.getFormula();
+
+        multiplicity = varspec.sourceExpr->getMultiplicity();
+      }
       else {
         multiplicity = varspec.sourceExpr->getFunction()->getMultiplicity();
 
@@ -828,7 +1639,7 @@ multidraw::MultiDraw::executeOne_(long _nEntries, unsigned long _firstEntry, TCh
       if (multiplicity == 0) {
         // singlet branch
         varspec.values.resize(1);
-        varspec.vbranch = aliasesTree->Branch(name, varspec.values.data(), name + "/D");
+        varspec.vbranch = aliasesTree_->Branch(name, varspec.values.data(), name + "/D");
       }
       else {
         if (multiplicity < 0)
@@ -838,8 +1649,8 @@ multidraw::MultiDraw::executeOne_(long _nEntries, unsigned long _firstEntry, TCh
         // give some reasonable initial size
         varspec.values.resize(64);
         // array, or expression composed of dynamic array elements
-        varspec.nbranch = aliasesTree->Branch("size__" + name, &varspec.nD, "size__" + name + "/i");
-        varspec.vbranch = aliasesTree->Branch(name, varspec.values.data(), name + "[size__" + name + "]/D");
+        varspec.nbranch = aliasesTree_->Branch("size__" + name, &varspec.nD, "size__" + name + "/i");
+        varspec.vbranch = aliasesTree_->Branch(name, varspec.values.data(), name + "[size__" + name + "]/D");
       }
     }
 
@@ -861,105 +1672,79 @@ multidraw::MultiDraw::executeOne_(long _nEntries, unsigned long _firstEntry, TCh
   }
 
   // Set up the cuts and filler objects
-  CutPtr filter;
-  std::vector<CutPtr> cuts;
+  if (isMainThread_) {
+    filter_ = std::move(md_.filter_);
+    filter_->setPrintLevel(printLevel);
+    filter_->bindTree(_library, _flibrary, _rlibrary);
 
-  if (isMainThread) {
-    filter = std::move(filter_);
-    filter->setPrintLevel(printLevel);
-    filter->bindTree(library, flibrary);
-
-    filter->initialize();
+    filter_->initialize();
 
-    for (auto& namecut : cuts_) {
-      if (namecut.first.Length() != 0 && namecut.second->getNFillers() == 0)
+    for (auto& namecut : md_.cuts_) {
+      if (!isActiveCut_(*filter_, namecut.first, *namecut.second))
         continue;
 
-      cuts.emplace_back(std::move(namecut.second));
-      cuts.back()->setPrintLevel(printLevel);
-      cuts.back()->bindTree(library, flibrary);
+      cuts_.emplace_back(std::move(namecut.second));
+      cuts_.back()->setPrintLevel(printLevel);
+      cuts_.back()->bindTree(_library, _flibrary, _rlibrary);
 
       if (printLevel >= 1)
         std::cout << "Initializing cut \"" << namecut.first << "\"" << std::endl;
 
-      cuts.back()->initialize();
+      cuts_.back()->initialize();
     }
   }
   else {
-    filter = filter_->threadClone(library, flibrary);
+    filter_ = md_.filter_->threadClone(_library, _flibrary, _rlibrary);
+
+    filter_->initialize();
 
-    for (auto& namecut : cuts_) {
-      if (namecut.first.Length() != 0 && namecut.second->getNFillers() == 0)
+    for (auto& namecut : md_.cuts_) {
+      if (!isActiveCut_(*filter_, namecut.first, *namecut.second))
         continue;
 
-      cuts.emplace_back(namecut.second->threadClone(library, flibrary));
+      cuts_.emplace_back(namecut.second->threadClone(_library, _flibrary, _rlibrary));
+      cutSources_.push_back(namecut.second.get());
 
-      cuts.back()->initialize();
+      cuts_.back()->initialize();
     }
   }
 
-  if (isMainThread && doTimeProfile)
-    cutTimers.assign(1 + cuts.size(), SteadyClock::duration::zero());
-
-  // Compile the reweight expressions
-  ReweightPtr globalReweight{nullptr};
-  std::unordered_map<unsigned, std::pair<ReweightPtr, bool>> treeReweights;
-
-  if (globalReweightSource_)
-    globalReweight = globalReweightSource_->compile(library, flibrary);
-
-  for (auto& tr : treeReweightSources_)
-    treeReweights.emplace(tr.first, std::make_pair(tr.second.first->compile(library, flibrary), tr.second.second));
-
-  // Preparing for the event loop
-  std::vector<double> eventWeights;
-
-  long long iEntry(0);
-  int treeNumber(-1);
-
-  union FloatingPoint {
-    Float_t f;
-    Double_t d;
-  } weight;
-
-  std::function<Double_t()> getWeight([]()->Double_t { return 1.; });
-
-  union Integer {
-    Int_t i;
-    UInt_t ui;
-    Long64_t l;
-    ULong64_t ul;
-  } evtNum;
+  for (unsigned iF(0); iF != filter_->getNFillers(); ++iF) {
+    auto* group(dynamic_cast<PlotGroupFiller*>(filter_->getFiller(iF)));
+    if (group != nullptr)
+      group->bindCuts(*filter_, cuts_);
+  }
 
-  // by default, use iEntry as the event number
-  std::function<ULong64_t()> getEvtNum([&iEntry]()->ULong64_t { return iEntry; });
+  if (isMainThread_ && doTimeProfile_)
+    cutTimers_.assign(1 + cuts_.size(), SteadyClock::duration::zero());
 
-  TBranch* weightBranch(nullptr);
-  TBranch* evtNumBranch(nullptr);
+  // Compile the reweight expressions
+  if (md_.globalReweightSource_)
+    globalReweight_ = md_.globalReweightSource_->compile(_library, _flibrary);
 
-  double treeWeight(1.);
-  Reweight* treeReweight{nullptr};
-  bool exclusiveTreeReweight(false);
+  for (auto& tr : md_.treeReweightSources_)
+    treeReweights_.emplace(tr.first, std::make_pair(tr.second.first->compile(_library, _flibrary), tr.second.second));
 
   // Applying good run list
-  std::function<bool()> isGoodRunEvent;
-  TTreeFormula* goodRunBranch[2]{};
-  if (goodRunBranch_[0].Length() != 0) {
-    goodRunBranch[0] = &library.getFormula(goodRunBranch_[0]);
-    if (goodRunBranch_[1].Length() == 0) {
-      isGoodRunEvent = [this, goodRunBranch]()->bool {
+  if (md_.goodRunBranch_[0].Length() != 0) {
+    auto& goodRuns(md_.goodRuns_);
+
+    TTreeFormula* goodRunBranch[2]{};
+    goodRunBranch[0] = &_library.getFormula(md_.goodRunBranch_[0]);
+    if (md_.goodRunBranch_[1].Length() == 0) {
+      isGoodRunEvent_ = [&goodRuns, goodRunBranch]()->bool {
         goodRunBranch[0]->GetNdata();
         unsigned v1(goodRunBranch[0]->EvalInstance(0));
-        return this->goodRuns_.count(v1) != 0;
+        return goodRuns.count(v1) != 0;
       };
     }
-    else { 
-      goodRunBranch[1] = &library.getFormula(goodRunBranch_[1]);
-      isGoodRunEvent = [this, goodRunBranch]()->bool {
+    else {
+      goodRunBranch[1] = &_library.getFormula(md_.goodRunBranch_[1]);
+      isGoodRunEvent_ = [&goodRuns, goodRunBranch]()->bool {
         goodRunBranch[0]->GetNdata();
         unsigned v1(goodRunBranch[0]->EvalInstance(0));
-        auto rItr(this->goodRuns_.find(v1));
-        if (rItr == this->goodRuns_.end())
+        auto rItr(goodRuns.find(v1));
+        if (rItr == goodRuns.end())
           return false;
 
         goodRunBranch[1]->GetNdata();
@@ -969,6 +1754,410 @@ multidraw::MultiDraw::executeOne_(long _nEntries, unsigned long _firstEntry, TCh
     }
   }
 
+  filterHasAliases_ = aliasesTree_ && filter_->dependsOn(*aliasesTree_);
+}
+
+multidraw::MultiDraw::EventProcessor::~EventProcessor()
+{
+  if (aliasesTree_)
+    tree_.RemoveFriend(aliasesTree_.get());
+}
+
+void
+multidraw::MultiDraw::EventProcessor::prepareTree()
+{
+  auto& weightBranchName(md_.weightBranchName_);
+  auto& evtNumBranchName(md_.evtNumBranchName_);
+
+  if (weightBranchName.Length() != 0) {
+    if (tree_.GetBranch(weightBranchName) == nullptr)
+      throw std::runtime_error(("Could not find branch " + weightBranchName).Data());
+
+    if (weightFormula_ == nullptr)
+      weightFormula_ = &library_.getFormula(weightBranchName);
+  }
+
+  if (md_.prescale_ > 1 && evtNumBranchName.Length() != 0) {
+    if (tree_.GetBranch(evtNumBranchName) == nullptr)
+      throw std::runtime_error(("Could not find branch " + evtNumBranchName).Data());
+
+    if (evtNumFormula_ == nullptr)
+      evtNumFormula_ = &library_.getFormula(evtNumBranchName);
+  }
+}
+
+bool
+multidraw::MultiDraw::EventProcessor::beginTree(unsigned _treeNumber)
+{
+  if (isGoodRunEvent_ && !isGoodRunEvent_()) {
+    skipEvent_ = true;
+    return false;
+  }
+
+  // Constant overall tree weights
+  auto wItr(md_.treeWeights_.find(_treeNumber));
+  if (wItr == md_.treeWeights_.end())
+    treeWeight_ = md_.globalWeight_;
+  else if (wItr->second.second) // exclusive tree-by-tree weight
+    treeWeight_ = wItr->second.first;
+  else
+    treeWeight_ = md_.globalWeight_ * wItr->second.first;
+
+  weightFactors_.clear();
+
+  auto addFactors([this](Reweight& _reweight) {
+      std::vector<Reweight*> factors;
+      _reweight.collectFactors(factors);
+      // The number of instances of a factorized reweight is that of its first factor
+      for (unsigned iF(0); iF != factors.size(); ++iF)
+        this->weightFactors_.emplace_back(factors[iF], iF == 0);
+    });
+
+  auto rItr(treeReweights_.find(_treeNumber));
+  if (rItr == treeReweights_.end()) {
+    if (globalReweight_)
+      addFactors(*globalReweight_);
+  }
+  else {
+    addFactors(*rItr->second.first);
+    if (globalReweight_ && !rItr->second.second) // non-exclusive tree-by-tree reweight
+      addFactors(*globalReweight_);
+  }
+
+  return true;
+}
+
+void
+multidraw::MultiDraw::EventProcessor::processEvent()
+{
+  if (skipEvent_) {
+    skipEvent_ = false;
+    return;
+  }
+
+  int printLevel(printLevel_);
+  bool doTimeProfile(doTimeProfile_);
+  auto& filter(filter_);
+  auto& cuts(cuts_);
+  auto& cutTimers(cutTimers_);
+  auto& eventWeights(eventWeights_);
+
+  SteadyClock::time_point start;
+  if (doTimeProfile)
+    start = SteadyClock::now();
+
+  if (md_.prescale_ > 1) {
+    // by default, use iEntry as the event number
+    ULong64_t eventNumber(iEntry_);
+    if (evtNumFormula_ != nullptr) {
+      // EvalInstance64 to preserve the full precision of 64-bit integers (bypasses the formula cache)
+      evtNumFormula_->GetNdata();
+      eventNumber = evtNumFormula_->EvalInstance64(0);
+    }
+
+    if (printLevel > 3)
+      std::cout << "        Event number " << eventNumber << std::endl;
+
+    if (eventNumber % md_.prescale_ != 0)
+      return;
+  }
+
+  if (doTimeProfile) {
+    ioTimer_ += SteadyClock::now() - start;
+    start = SteadyClock::now();
+  }
+
+  if (!filterHasAliases_) {
+    // Optimization in the case when the global filter does not depend on aliases
+
+    bool passFilter(filter->evaluate());
+
+    if (doTimeProfile) {
+      cutTimers.back() += SteadyClock::now() - start;
+      start = SteadyClock::now();
+    }
+
+    if (!passFilter)
+      return;
+  }
+
+  if (aliasesTree_) {
+    // Need to set fReadEntry to the current number first for aliases dependent on other aliases to work
+    // Need to set fEntries before fReadEntry (the latter has to be always smaller than the former)
+    aliasesTree_->SetEntries(aliasesTree_->GetEntries() + 1);
+    aliasesTree_->LoadTree(aliasesTree_->GetEntries() - 1);
+
+    for (auto& v : aliases_) {
+      if (v.nbranch == nullptr) {
+        v.sourceExpr->getNdata();
+        v.values[0] = v.sourceExpr->evaluate(0);
+
+        if (printLevel > 3)
+          std::cout << "        Alias " << v.vbranch->GetName() << ": static value " << v.values[0] << std::endl;
+
+        v.vbranch->Fill();
+      }
+      else {
+        auto* currentData(v.values.data());
+        auto* batch(v.sourceExpr->getValues());
+
+        if (batch != nullptr) {
+          v.nD = batch->size();
+          v.values.assign(batch->begin(), batch->end());
+        }
+        else {
+          v.nD = v.sourceExpr->getNdata();
+          v.values.resize(v.nD);
+        }
+
+        if (v.values.data() != currentData) {
+          // vector was reallocated
+          v.vbranch->SetAddress(v.values.data());
+        }
+
+        if (batch == nullptr) {
+          for (unsigned iD(0); iD != v.nD; ++iD)
+            v.values[iD] = v.sourceExpr->evaluate(iD);
+        }
+
+        if (printLevel > 3) {
+          std::cout << "        Alias " << v.vbranch->GetName() << ": dynamic size " << v.nD;
+          std::cout << " values [";
+          for (unsigned iD(0); iD != v.nD; ++iD) {
+            std::cout << v.values[iD];
+            if (iD != v.nD - 1)
+              std::cout << ", ";
+          }
+          std::cout << "]" << std::endl;
+        }
+
+        v.nbranch->Fill();
+        v.vbranch->Fill();
+      }
+    }
+
+    // tree KeepCircular is a protected method
+    // it essentially does the following to keep the in-memory buffer finite
+    // buffer size 10000 to have fewer cycles
+    // NEVER MIND THIS SEGFAULTS FOR WHATEVER REASON - 22.11.2018
+    // if (aliasesTree->GetEntries() > maxTreeSize) {
+    //   int newSize(maxTreeSize - maxTreeSize / 10);
+    //   for (auto& v : aliases) {
+    //     v.vbranch->KeepCircular(newSize);
+    //     if (v.nbranch != nullptr)
+    //       v.nbranch->KeepCircular(newSize);
+    //   }
+    //   aliasesTree->SetEntries(newSize);
+    // }
+  }
+
+  if (filterHasAliases_) {
+    bool passFilter(filter->evaluate());
+
+    if (doTimeProfile) {
+      cutTimers.back() += SteadyClock::now() - start;
+      start = SteadyClock::now();
+    }
+
+    if (!passFilter)
+      return;
+  }
+
+  double inputWeight(1.);
+
+  if (weightFormula_ != nullptr) {
+    weightFormula_->GetNdata();
+    inputWeight = weightFormula_->EvalInstance(0);
+
+    if (printLevel > 3)
+      std::cout << "        Input weight " << inputWeight << std::endl;
+  }
+
+  if (doTimeProfile) {
+    ioTimer_ += SteadyClock::now() - start;
+    start = SteadyClock::now();
+  }
+
+  double commonWeight(inputWeight * treeWeight_);
+
+  if (!weightFactors_.empty()) {
+    unsigned nD(0);
+    for (auto& factor : weightFactors_) {
+      unsigned n(factor.first->load());
+      if (factor.second)
+        nD = std::max(nD, n);
+    }
+
+    if (nD == 0)
+      return; // skip event
+
+    eventWeights.assign(nD, commonWeight);
+
+    for (auto& factor : weightFactors_) {
+      for (unsigned iD(0); iD != nD; ++iD)
+        eventWeights[iD] *= factor.first->evaluateLoaded(iD);
+    }
+  }
+  else {
+    eventWeights.assign(1, commonWeight);
+  }
+
+  if (printLevel > 3) {
+    std::cout << "         Global weights: ";
+    for (double w : eventWeights)
+      std::cout << w << " ";
+    std::cout << std::endl;
+  }
+
+  if (doTimeProfile) {
+    eventTimer_ += SteadyClock::now() - start;
+    start = SteadyClock::now();
+  }
+
+  for (unsigned iC(0); iC != cuts.size(); ++iC) {
+    if (cuts[iC]->evaluate())
+      cuts[iC]->fillExprs(eventWeights);
+
+    if (doTimeProfile) {
+      cutTimers[iC] += SteadyClock::now() - start;
+      start = SteadyClock::now();
+    }
+  }
+
+  // Filled last because plot groups read the results of all cuts
+  filter->fillExprs(eventWeights);
+
+  if (doTimeProfile)
+    cutTimers.back() += SteadyClock::now() - start;
+}
+
+void
+multidraw::MultiDraw::EventProcessor::finish(long long _nEntries, SteadyClock::duration const& _ioTimer)
+{
+  auto& filter(filter_);
+  auto& cuts(cuts_);
+  auto& cutTimers(cutTimers_);
+  long long iEntry(_nEntries);
+
+  filter->finalize();
+  for (auto& cut : cuts)
+    cut->finalize();
+
+  if (printLevel_ >= 0 && doTimeProfile_) {
+    SteadyClock::duration ioTimer(_ioTimer + ioTimer_);
+
+    double totalTime(millisec(ioTimer) + millisec(eventTimer_));
+    totalTime += millisec(std::accumulate(cutTimers.begin(), cutTimers.end(), SteadyClock::duration::zero()));
+    std::cout << std::endl;
+    std::cout << " Execution time: " << (totalTime / iEntry) << " ms/evt" << std::endl;
+
+    std::cout << "        Time spent on tree input: " << (millisec(ioTimer) / iEntry) << " ms/evt" << std::endl;
+    std::cout << "        Time spent on event reweighting: " << (millisec(eventTimer_) / iEntry) << " ms/evt" << std::endl;
+
+    if (printLevel_ > 0) {
+      std::cout << "        cut " << filter->getName() << ": ";
+      std::cout << (millisec(cutTimers.back()) / iEntry) << " ms/evt" << std::endl;
+      for (unsigned iC(0); iC != cuts.size(); ++iC) {
+        std::cout << "        cut " << cuts[iC]->getName() << ": ";
+        std::cout << (millisec(cutTimers[iC]) / cuts[0]->getCount()) << " ms/evt" << std::endl;
+      }
+    }
+  }
+
+  if (isMainThread_) {
+    // unlink and return pointers
+
+    filter->unlinkTree();
+    md_.filter_ = std::move(filter);
+
+    for (auto& cut : cuts) {
+      cut->unlinkTree();
+      md_.cuts_[cut->getName()] = std::move(cut);
+    }
+  }
+  else {
+    // merge & cleanup
+
+    // Again we'll just lock the entire block
+    std::unique_lock<std::mutex> lock(synchTools_.mutex);
+    synchTools_.condition.wait(lock, [this]() { return this->synchTools_.mainDone; });
+
+    if (synchTools_.mergeCounts) {
+      auto mergeCounts([](Cut const& _clone, Cut& _target) {
+          _target.setCount(_target.getCount() + _clone.getCount());
+          for (unsigned iF(0); iF != _clone.getNFillers(); ++iF) {
+            auto* filler(_target.getFiller(iF));
+            filler->setCount(filler->getCount() + _clone.getFiller(iF)->getCount());
+          }
+        });
+
+      mergeCounts(*filter, *md_.filter_);
+      for (unsigned iC(0); iC != cuts.size(); ++iC)
+        mergeCounts(*cuts[iC], *cutSources_[iC]);
+    }
+
+    // Clone fillers will merge themselves to the main object in the destructor of the cuts
+    filter.reset();
+    cuts.clear();
+  }
+}
+
+long
+#if ROOT_VERSION_CODE < ROOT_VERSION(6,12,0)
+multidraw::MultiDraw::executeOne_(long _nEntries, unsigned long _firstEntry, TChain& _tree, SynchTools& _synchTools, unsigned _treeNumberOffset/* = 0*/, Long64_t* _treeOffsets/* = nullptr*/, bool _byTree/* = false*/)
+#else
+multidraw::MultiDraw::executeOne_(long _nEntries, unsigned long _firstEntry, TChain& _tree, SynchTools& _synchTools, unsigned _treeNumberOffset/* = 0*/, bool _byTree/* = false*/)
+#endif
+{
+  // treeNumberOffset: The offset of the given tree with respect to the original
+
+  SteadyClock::duration ioTimer(SteadyClock::duration::zero());
+  SteadyClock::time_point start;
+
+  bool isMainThread(std::this_thread::get_id() == _synchTools.mainThread);
+
+  int printLevel(-1);
+  bool doTimeProfile(false);
+
+  if (isMainThread) {
+    printLevel = printLevel_;
+    doTimeProfile = doTimeProfile_;
+  }
+
+  if (_tree.GetNtrees() == 0) {
+    // TTreeFormula compilation crashes if there is no tree in the chain
+    if (printLevel >= 0)
+      std::cout << "Input tree is empty." << std::endl;
+
+    return 0;
+  }
+
+  currentTree = &_tree;
+
+  // Create the repository of all TTreeFormulas
+  FormulaLibrary library(_tree);
+  if (doFactorizeExpressions_)
+    library.enableGraph();
+  // and of all TTreeFunctions
+  FunctionLibrary flibrary(_tree, &library);
+  // and of the filler reweights
+  ReweightLibrary rlibrary(library, flibrary);
+
+  long long iEntry(0);
+
+  // Cuts, fillers, and weights of this object and of the companions share the libraries
+  std::vector<std::unique_ptr<EventProcessor>> processors;
+  processors.push_back(std::make_unique<EventProcessor>(*this, _tree, library, flibrary, rlibrary, _synchTools, isMainThread, iEntry, 0));
+  for (unsigned iC(0); iC != companions_.size(); ++iC)
+    processors.push_back(std::make_unique<EventProcessor>(*companions_[iC], _tree, library, flibrary, rlibrary, _synchTools, isMainThread, iEntry, iC + 1));
+
+  // Preparing for the event loop
+  int treeNumber(-1);
+
+  std::unique_ptr<FilePrefetcher> prefetcher;
+  if (prefetchDepth_ > 0)
+    prefetcher = std::make_unique<FilePrefetcher>(_tree, prefetchDepth_, _byTree ? _nEntries : -1);
+
   // Replace branches in the expressions
   for (auto& repl : branchReplacements_) {
     library.replaceAll(repl.first, repl.second);
@@ -994,8 +2183,6 @@ multidraw::MultiDraw::executeOne_(long _nEntries, unsigned long _firstEntry, TCh
   long nextTreeBoundary(0);
 #endif
 
-  bool filterHasAliases(filter->dependsOn(*aliasesTree.get()));
-
   long nEntries(_byTree ? -1 : _nEntries);
 
   long printEvery(100000);
@@ -1018,7 +2205,7 @@ multidraw::MultiDraw::executeOne_(long _nEntries, unsigned long _firstEntry, TCh
 
 #if ROOT_VERSION_CODE < ROOT_VERSION(6,12,0)
     long long iLocalEntry(0);
-    
+
     if (treeOffsets != nullptr && iEntryNumber >= nextTreeBoundary) {
       // we are crossing a tree boundary in a multi-thread environment
       std::lock_guard<std::mutex> lock(_synchTools.mutex);
@@ -1035,8 +2222,6 @@ multidraw::MultiDraw::executeOne_(long _nEntries, unsigned long _firstEntry, TCh
     if (iLocalEntry < 0)
       break;
 
-    flibrary.setEntry(iEntryNumber);
-
     ++iEntry;
 
     // Print progress
@@ -1062,303 +2247,49 @@ multidraw::MultiDraw::executeOne_(long _nEntries, unsigned long _firstEntry, TCh
 
       treeNumber = _tree.GetTreeNumber();
 
+      if (prefetcher)
+        prefetcher->setTreeNumber(treeNumber);
+
+      {
+        // Remember the size of the file for partitioning in later executions
+        std::lock_guard<std::mutex> lock(_synchTools.mutex);
+        fileEntries_[_tree.GetListOfFiles()->At(treeNumber)->GetTitle()] = _tree.GetTree()->GetEntries();
+      }
+
 #if ROOT_VERSION_CODE < ROOT_VERSION(6,12,0)
       if (treeOffsets != nullptr)
         nextTreeBoundary = treeOffsets[treeNumber + 1] - treeOffsets[0];
 #endif
 
-      if (weightBranchName_.Length() != 0) {
-        weightBranch = _tree.GetBranch(weightBranchName_);
-        if (!weightBranch)
-          throw std::runtime_error(("Could not find branch " + weightBranchName_).Data());
-
-        auto* leaves(weightBranch->GetListOfLeaves());
-        if (leaves->GetEntries() == 0) // shouldn't happen
-          throw std::runtime_error(("Branch " + weightBranchName_ + " does not have any leaves").Data());
-
-        weightBranch->SetAddress(&weight);
-
-        auto* leaf(static_cast<TLeaf*>(leaves->At(0)));
-
-        if (leaf->InheritsFrom(TLeafF::Class()))
-          getWeight = [&weight]()->Double_t { return weight.f; };
-        else if (leaf->InheritsFrom(TLeafD::Class()))
-          getWeight = [&weight]()->Double_t { return weight.d; };
-        else
-          throw std::runtime_error(("I do not know how to read the leaf type of branch " + weightBranchName_).Data());
-      }
-
-      if (prescale_ > 1 && evtNumBranchName_.Length() != 0) {
-        evtNumBranch = _tree.GetBranch(evtNumBranchName_);
-        if (!evtNumBranch)
-          throw std::runtime_error(("Could not find branch " + evtNumBranchName_).Data());
-
-        auto* leaves(evtNumBranch->GetListOfLeaves());
-        if (leaves->GetEntries() == 0) // shouldn't happen
-          throw std::runtime_error(("Branch " + evtNumBranchName_ + " does not have any leaves").Data());
-
-        evtNumBranch->SetAddress(&evtNum);
-
-        auto* leaf(static_cast<TLeaf*>(leaves->At(0)));
-
-        if (leaf->InheritsFrom(TLeafI::Class())) {
-          if (leaf->IsUnsigned())
-            getEvtNum = [&evtNum]()->ULong64_t { return evtNum.ui; };
-          else
-            getEvtNum = [&evtNum]()->ULong64_t { return evtNum.i; };
-        }
-        else if (leaf->InheritsFrom(TLeafL::Class())) {
-          if (leaf->IsUnsigned())
-            getEvtNum = [&evtNum]()->ULong64_t { return evtNum.ul; };
-          else
-            getEvtNum = [&evtNum]()->ULong64_t { return evtNum.l; };
-        }
-        else
-          throw std::runtime_error(("I do not know how to read the leaf type of branch " + evtNumBranchName_).Data());
-      }
+      for (auto& processor : processors)
+        processor->prepareTree();
 
       // Underlying tree changed; formulas must update their pointers
       library.updateFormulaLeaves();
 
-      if (isGoodRunEvent && !isGoodRunEvent())
-        continue;
-
-      // Constant overall tree weights
-      auto wItr(treeWeights_.find(treeNumber + _treeNumberOffset));
-      if (wItr == treeWeights_.end())
-        treeWeight = globalWeight_;
-      else if (wItr->second.second) // exclusive tree-by-tree weight
-        treeWeight = wItr->second.first;
-      else
-        treeWeight = globalWeight_ * wItr->second.first;
-
-      auto rItr(treeReweights.find(treeNumber + _treeNumberOffset));
-      if (rItr == treeReweights.end()) {
-        treeReweight = globalReweight.get();
-        exclusiveTreeReweight = true;
-      }
-      else {
-        treeReweight = rItr->second.first.get();
-        exclusiveTreeReweight = (!globalReweight || rItr->second.second);
-      }
-    }
-
-    if (prescale_ > 1) {
-      if (evtNumBranch != nullptr)
-        evtNumBranch->GetEntry(iLocalEntry);
-
-      if (printLevel > 3)
-        std::cout << "        Event number " << getEvtNum() << std::endl;
-
-      if (getEvtNum() % prescale_ != 0)
-        continue;
+      for (auto& processor : processors)
+        processor->beginTree(treeNumber + _treeNumberOffset);
     }
 
-    // Reset formula cache
+    // Reset formula and reweight caches
     library.resetCache();
+    rlibrary.resetCache();
 
-    if (doTimeProfile) {
-      ioTimer += SteadyClock::now() - start;
-      start = SteadyClock::now();
-    }
-
-    if (!filterHasAliases) {
-      // Optimization in the case when the global filter does not depend on aliases
-
-      bool passFilter(filter->evaluate());
-
-      if (doTimeProfile) {
-        cutTimers.back() += SteadyClock::now() - start;
-        start = SteadyClock::now();
-      }
-
-      if (!passFilter)
-        continue;
-    }
-
-    if (aliasesTree) {
-      // Need to set fReadEntry to the current number first for aliases dependent on other aliases to work
-      // Need to set fEntries before fReadEntry (the latter has to be always smaller than the former)
-      aliasesTree->SetEntries(aliasesTree->GetEntries() + 1);
-      aliasesTree->LoadTree(aliasesTree->GetEntries() - 1);
-
-      for (auto& v : aliases) {
-        if (v.nbranch == nullptr) {
-          v.sourceExpr->getNdata();
-          v.values[0] = v.sourceExpr->evaluate(0);
-
-          if (printLevel > 3)
-            std::cout << "        Alias " << v.vbranch->GetName() << ": static value " << v.values[0] << std::endl;
-
-          v.vbranch->Fill();
-        }
-        else {
-          auto* currentData(v.values.data());
-          v.nD = v.sourceExpr->getNdata();
-          v.values.resize(v.nD);
-
-          if (v.values.data() != currentData) {
-            // vector was reallocated
-            v.vbranch->SetAddress(v.values.data());
-          }
-
-          for (unsigned iD(0); iD != v.nD; ++iD)
-            v.values[iD] = v.sourceExpr->evaluate(iD);
-
-          if (printLevel > 3) {
-            std::cout << "        Alias " << v.vbranch->GetName() << ": dynamic size " << v.nD;
-            std::cout << " values [";
-            for (unsigned iD(0); iD != v.nD; ++iD) {
-              std::cout << v.values[iD];
-              if (iD != v.nD - 1)
-                std::cout << ", ";
-            }
-            std::cout << "]" << std::endl;
-          }
-
-          v.nbranch->Fill();
-          v.vbranch->Fill();
-        }
-      }
-      
-      // tree KeepCircular is a protected method
-      // it essentially does the following to keep the in-memory buffer finite
-      // buffer size 10000 to have fewer cycles
-      // NEVER MIND THIS SEGFAULTS FOR WHATEVER REASON - 22.11.2018
-      // if (aliasesTree->GetEntries() > maxTreeSize) {
-      //   int newSize(maxTreeSize - maxTreeSize / 10);
-      //   for (auto& v : aliases) {
-      //     v.vbranch->KeepCircular(newSize);
-      //     if (v.nbranch != nullptr)
-      //       v.nbranch->KeepCircular(newSize);
-      //   }
-      //   aliasesTree->SetEntries(newSize);
-      // }
-    }
-
-    if (filterHasAliases) {
-      bool passFilter(filter->evaluate());
-
-      if (doTimeProfile) {
-        cutTimers.back() += SteadyClock::now() - start;
-        start = SteadyClock::now();
-      }
-
-      if (!passFilter)
-        continue;
-    }
-
-    if (weightBranch != nullptr) {
-      weightBranch->GetEntry(iLocalEntry);
-
-      if (printLevel > 3)
-        std::cout << "        Input weight " << getWeight() << std::endl;
-    }
+    // After the cache reset, so that functions reading through the formulas see the current entry
+    flibrary.setEntry(iEntryNumber);
 
-    if (doTimeProfile) {
+    if (doTimeProfile)
       ioTimer += SteadyClock::now() - start;
-      start = SteadyClock::now();
-    }
-
-    double commonWeight(getWeight() * treeWeight);
-
-    if (treeReweight != nullptr) {
-      unsigned nD(treeReweight->getNdata());
-      if (!exclusiveTreeReweight)
-        nD = std::max(nD, globalReweight->getNdata());
-      
-      if (nD == 0)
-        continue; // skip event
-
-      eventWeights.resize(nD);
 
-      for (unsigned iD(0); iD != nD; ++iD) {
-        eventWeights[iD] = treeReweight->evaluate(iD) * commonWeight;
-        if (!exclusiveTreeReweight)
-          eventWeights[iD] *= globalReweight->evaluate(iD);
-      }
-    }
-    else {
-      eventWeights.assign(1, commonWeight);
-    }
-
-    if (printLevel > 3) {
-      std::cout << "         Global weights: ";
-      for (double w : eventWeights)
-        std::cout << w << " ";
-      std::cout << std::endl;
-    }
-
-    if (doTimeProfile) {
-      eventTimer += SteadyClock::now() - start;
-      start = SteadyClock::now();
-    }
-
-    filter->fillExprs(eventWeights);
-
-    if (doTimeProfile) {
-      cutTimers.back() += SteadyClock::now() - start;
-      start = SteadyClock::now();
-    }
-
-    for (unsigned iC(0); iC != cuts.size(); ++iC) {
-      if (cuts[iC]->evaluate())
-        cuts[iC]->fillExprs(eventWeights);
-
-      if (doTimeProfile) {
-        cutTimers[iC] += SteadyClock::now() - start;
-        start = SteadyClock::now();
-      }
-    }
+    for (auto& processor : processors)
+      processor->processEvent();
   }
 
   // Add the residual number of events
   _synchTools.totalEvents += (iEntry % printEvery);
 
-  if (printLevel >= 0 && doTimeProfile) {
-    double totalTime(millisec(ioTimer) + millisec(eventTimer));
-    totalTime += millisec(std::accumulate(cutTimers.begin(), cutTimers.end(), SteadyClock::duration::zero()));
-    std::cout << std::endl;
-    std::cout << " Execution time: " << (totalTime / iEntry) << " ms/evt" << std::endl;
-
-    std::cout << "        Time spent on tree input: " << (millisec(ioTimer) / iEntry) << " ms/evt" << std::endl;
-    std::cout << "        Time spent on event reweighting: " << (millisec(eventTimer) / iEntry) << " ms/evt" << std::endl;
-
-    if (printLevel > 0) {
-      std::cout << "        cut " << filter->getName() << ": ";
-      std::cout << (millisec(cutTimers.back()) / iEntry) << " ms/evt" << std::endl;
-      for (unsigned iC(0); iC != cuts.size(); ++iC) {
-        std::cout << "        cut " << cuts[iC]->getName() << ": ";
-        std::cout << (millisec(cutTimers[iC]) / cuts[0]->getCount()) << " ms/evt" << std::endl;
-      }
-    }
-  }
-
-  if (isMainThread) {
-    // unlink and return pointers
-
-    filter->unlinkTree();
-    filter_ = std::move(filter);
-
-    for (auto& cut : cuts) {
-      cut->unlinkTree();
-      cuts_[cut->getName()] = std::move(cut);
-    }
-  }
-  else {
-    // merge & cleanup
-
-    // Again we'll just lock the entire block
-    std::unique_lock<std::mutex> lock(_synchTools.mutex);
-    _synchTools.condition.wait(lock, [&_synchTools]() { return _synchTools.mainDone; });
-
-    // Clone fillers will merge themselves to the main object in the destructor of the cuts
-    filter.reset();
-    cuts.clear();
-  }
-
-  if (aliasesTree)
-    _tree.RemoveFriend(aliasesTree.get());
+  for (auto& processor : processors)
+    processor->finish(iEntry, ioTimer);
 
   return iEntry;
 }
@@ -0,0 +1,190 @@
+#include "../interface/MultiDrawBatch.h"
+
+#include "TChainElement.h"
+#include "TEntryList.h"
+#include "TError.h"
+
+#include <stdexcept>
+#include <iostream>
+#include <algorithm>
+#include <numeric>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <exception>
+
+void
+multidraw::MultiDrawBatch::addDrawer(MultiDraw& _drawer)
+{
+  for (auto* drawer : drawers_) {
+    if (drawer == &_drawer)
+      throw std::invalid_argument("Drawer is already in the batch");
+  }
+
+  drawers_.push_back(&_drawer);
+}
+
+void
+multidraw::MultiDrawBatch::execute()
+{
+  if (nThreads_ == 0)
+    throw std::runtime_error("MultiDrawBatch needs at least one thread");
+
+  for (auto* drawer : drawers_) {
+    if (!drawer->friendTrees_.empty() || drawer->incrementalCachePath_.Length() != 0 || !drawer->companions_.empty())
+      throw std::runtime_error("Drawers with friend trees, incremental cache, or checkpoints cannot be executed in a batch");
+  }
+
+  MultiDraw::checkSharedFill_(std::vector<MultiDraw const*>(drawers_.begin(), drawers_.end()));
+
+  struct WorkUnit {
+    unsigned iDrawer{0};
+    unsigned treeNumberOffset{0};
+    double work{0.};
+    std::unique_ptr<TChain> tree{};
+  };
+
+  std::vector<WorkUnit> units;
+
+  for (unsigned iD(0); iD != drawers_.size(); ++iD) {
+    auto& drawer(*drawers_[iD]);
+    drawer.totalEvents_ = 0;
+
+    // The original cuts are not bound to a tree in the batch (which would reset the counts); the clone counts are added to them
+    drawer.filter_->resetCounts();
+    for (auto& cut : drawer.cuts_)
+      cut.second->resetCounts();
+
+    std::vector<TString> fileNames;
+    {
+      TChain chain(drawer.treeName_);
+      for (auto& path : drawer.inputPaths_)
+        chain.Add(path);
+
+      for (auto* elem : *chain.GetListOfFiles())
+        fileNames.emplace_back(elem->GetTitle());
+    }
+
+    if (fileNames.empty())
+      continue;
+
+    unsigned nUnits(std::min(unsigned(fileNames.size()), nThreads_));
+    auto work(drawer.estimateFileWork_(fileNames));
+    auto boundaries(drawer.partitionFiles_(fileNames, nUnits));
+
+    for (unsigned iU(0); iU != nUnits; ++iU) {
+      units.emplace_back();
+      auto& unit(units.back());
+
+      unit.iDrawer = iD;
+      unit.treeNumberOffset = boundaries[iU];
+      unit.work = std::accumulate(work.begin() + boundaries[iU], work.begin() + boundaries[iU + 1], 0.);
+      unit.tree = std::make_unique<TChain>(drawer.treeName_);
+
+      TEntryList* unitElist{nullptr};
+      if (drawer.entryList_ != nullptr) {
+        unitElist = new TEntryList(unit.tree.get());
+        unitElist->SetDirectory(nullptr);
+      }
+
+      for (unsigned iF(boundaries[iU]); iF != boundaries[iU + 1]; ++iF) {
+        unit.tree->Add(fileNames[iF]);
+        if (unitElist != nullptr)
+          unitElist->Add(drawer.entryList_->GetEntryList(drawer.treeName_, fileNames[iF]));
+      }
+
+      if (unitElist != nullptr)
+        unit.tree->SetEntryList(unitElist);
+    }
+  }
+
+  // Longest units first so that the short ones fill the gaps at the end
+  std::stable_sort(units.begin(), units.end(), [](WorkUnit const& _u1, WorkUnit const& _u2) { return _u1.work > _u2.work; });
+
+  // All units are executed as non-main threads of their drawers; the clones merge back as soon as a unit completes
+  std::vector<std::unique_ptr<MultiDraw::SynchTools>> synchTools;
+  for (unsigned iD(0); iD != drawers_.size(); ++iD) {
+    synchTools.push_back(std::make_unique<MultiDraw::SynchTools>());
+    synchTools.back()->mainDone = true;
+    synchTools.back()->mergeCounts = true;
+  }
+
+  if (printLevel_ >= 0)
+    std::cout << "Processing " << drawers_.size() << " drawers in " << units.size() << " work units with " << nThreads_ << " threads" << std::endl;
+
+  int abortLevel(gErrorAbortLevel);
+  if (std::any_of(drawers_.begin(), drawers_.end(), [](MultiDraw* _drawer) { return _drawer->doAbortOnReadError_; }))
+    gErrorAbortLevel = kError;
+
+  // threads will clone the histograms; need to disable adding to gDirectory
+  bool currentTH1AddDirectory(TH1::AddDirectoryStatus());
+  TH1::AddDirectory(false);
+
+  std::atomic_uint nextUnit(0);
+  std::atomic_uint nDone(0);
+  std::mutex exceptionMutex;
+  std::exception_ptr exception;
+
+  auto work([&]() {
+      while (true) {
+        unsigned iU(nextUnit++);
+        if (iU >= units.size())
+          break;
+
+        auto& unit(units[iU]);
+        auto& drawer(*this->drawers_[unit.iDrawer]);
+
+        try {
+#if ROOT_VERSION_CODE < ROOT_VERSION(6,12,0)
+          drawer.executeOne_(-1, 0, *unit.tree, *synchTools[unit.iDrawer], unit.treeNumberOffset, nullptr, true);
+#else
+          drawer.executeOne_(-1, 0, *unit.tree, *synchTools[unit.iDrawer], unit.treeNumberOffset, true);
+#endif
+        }
+        catch (...) {
+          std::lock_guard<std::mutex> lock(exceptionMutex);
+          if (!exception)
+            exception = std::current_exception();
+          // Stop handing out new units
+          nextUnit = units.size();
+          break;
+        }
+
+        unsigned n(++nDone);
+        if (this->printLevel_ >= 0)
+          (std::cout << "\r      " << n << "/" << units.size() << " work units").flush();
+      }
+    });
+
+  std::vector<std::thread> threads;
+  for (unsigned iT(0); iT != std::min(nThreads_, unsigned(units.size())); ++iT)
+    threads.emplace_back(work);
+
+  for (auto& thread : threads)
+    thread.join();
+
+  for (auto& unit : units) {
+    auto* unitElist(unit.tree->GetEntryList());
+    unit.tree->SetEntryList(nullptr);
+    delete unitElist;
+  }
+
+  TH1::AddDirectory(currentTH1AddDirectory);
+
+  gErrorAbortLevel = abortLevel;
+
+  if (exception)
+    std::rethrow_exception(exception);
+
+  for (unsigned iD(0); iD != drawers_.size(); ++iD)
+    drawers_[iD]->totalEvents_ = synchTools[iD]->totalEvents;
+
+  if (printLevel_ >= 0) {
+    std::cout << std::endl;
+    if (printLevel_ > 0) {
+      for (unsigned iD(0); iD != drawers_.size(); ++iD)
+        std::cout << "        Drawer " << iD << ": " << drawers_[iD]->totalEvents_ << " events" << std::endl;
+    }
+  }
+}
@@ -0,0 +1,92 @@
+#include "../interface/MultiDrawGroup.h"
+
+#include <stdexcept>
+
+void
+multidraw::MultiDrawGroup::addDrawer(MultiDraw& _drawer)
+{
+  for (auto* drawer : drawers_) {
+    if (drawer == &_drawer)
+      throw std::invalid_argument("Drawer is already in the group");
+  }
+
+  if (_drawer.incrementalCachePath_.Length() != 0)
+    throw std::invalid_argument("Drawers with incremental cache or checkpoint cannot be grouped");
+
+  if (!drawers_.empty()) {
+    auto& primary(*drawers_.front());
+
+    if (_drawer.treeName_ != primary.treeName_ || _drawer.inputPaths_ != primary.inputPaths_)
+      throw std::invalid_argument("Grouped drawers must have the same tree name and input paths");
+
+    if (_drawer.entryList_ != primary.entryList_)
+      throw std::invalid_argument("Grouped drawers must have the same entry list");
+
+    if (_drawer.branchReplacements_ != primary.branchReplacements_)
+      throw std::invalid_argument("Grouped drawers must have the same branch replacements");
+
+    if (!_drawer.friendTrees_.empty())
+      throw std::invalid_argument("Only the first drawer of a group can have friend trees");
+
+    TString alias(findAliasCollision_(_drawer, drawers_.size()));
+    if (alias.Length() != 0)
+      throw std::invalid_argument(("Alias " + alias + " is already defined in another drawer of the group").Data());
+  }
+
+  drawers_.push_back(&_drawer);
+}
+
+void
+multidraw::MultiDrawGroup::execute(long _nEntries/* = -1*/, unsigned long _firstEntry/* = 0*/)
+{
+  if (drawers_.empty())
+    return;
+
+  auto& primary(*drawers_.front());
+
+  // Configurations may have changed since addDrawer
+  if (primary.incrementalCachePath_.Length() != 0)
+    throw std::runtime_error("Drawers with incremental cache or checkpoint cannot be grouped");
+
+  for (unsigned iD(1); iD != drawers_.size(); ++iD) {
+    auto& drawer(*drawers_[iD]);
+    if (drawer.incrementalCachePath_.Length() != 0 || drawer.treeName_ != primary.treeName_ || drawer.inputPaths_ != primary.inputPaths_ ||
+        drawer.entryList_ != primary.entryList_ || drawer.branchReplacements_ != primary.branchReplacements_ || !drawer.friendTrees_.empty())
+      throw std::runtime_error("Configuration of a grouped drawer is incompatible with the first drawer");
+
+    TString alias(findAliasCollision_(drawer, iD));
+    if (alias.Length() != 0)
+      throw std::runtime_error(("Alias " + alias + " is defined in more than one drawer of the group").Data());
+  }
+
+  primary.companions_.assign(drawers_.begin() + 1, drawers_.end());
+
+  try {
+    primary.execute(_nEntries, _firstEntry);
+  }
+  catch (...) {
+    primary.companions_.clear();
+    throw;
+  }
+
+  primary.companions_.clear();
+
+  for (unsigned iD(1); iD != drawers_.size(); ++iD)
+    drawers_[iD]->totalEvents_ = primary.totalEvents_;
+}
+
+TString
+multidraw::MultiDrawGroup::findAliasCollision_(MultiDraw const& _drawer, unsigned _nDrawers) const
+{
+  // Each drawer adds its aliases as a friend tree; a branch name defined twice resolves to the first friend
+  for (auto& alias : _drawer.aliases_) {
+    for (unsigned iD(0); iD != _nDrawers; ++iD) {
+      for (auto& other : drawers_[iD]->aliases_) {
+        if (other.first == alias.first)
+          return alias.first;
+      }
+    }
+  }
+
+  return "";
+}
@@ -1,9 +1,12 @@
 #include "../interface/Plot1DFiller.h"
 #include "../interface/FormulaLibrary.h"
 
+#include "TProfile.h"
+
 #include <iostream>
 #include <sstream>
 #include <thread>
+#include <stdexcept>
 
 multidraw::Plot1DFiller::Plot1DFiller(TH1& _hist, CompiledExprSource const& _source, char const* _reweight/* = ""*/, Plot1DFiller::OverflowMode _mode/* = kDefault*/) :
   ExprFiller(_hist, _reweight),
@@ -23,18 +26,123 @@ multidraw::Plot1DFiller::Plot1DFiller(Plot1DFiller const& _orig) :
   ExprFiller(_orig),
   overflowMode_(_orig.overflowMode_)
 {
+  setSharedFill(_orig.sharedFill_);
 }
 
 multidraw::Plot1DFiller::Plot1DFiller(TH1& _hist, Plot1DFiller const& _orig) :
   ExprFiller(_hist, _orig),
-  overflowMode_(_orig.overflowMode_)
+  overflowMode_(_orig.overflowMode_),
+  sharedFill_(_orig.sharedFill_)
 {
 }
 
 multidraw::Plot1DFiller::Plot1DFiller(TObjArray& _histlist, Plot1DFiller const& _orig) :
   ExprFiller(_histlist, _orig),
-  overflowMode_(_orig.overflowMode_)
+  overflowMode_(_orig.overflowMode_),
+  sharedFill_(_orig.sharedFill_)
+{
+}
+
+TString
+multidraw::Plot1DFiller::getSignature() const
+{
+  return ExprFiller::getSignature() + TString::Format("overflow%d", overflowMode_);
+}
+
+void
+multidraw::Plot1DFiller::setSharedFill(bool _shared)
+{
+  sharedFill_ = _shared;
+  sharedBins_.clear();
+
+  if (!_shared)
+    return;
+
+  std::vector<TObject*> objs;
+  collectObjs(objs);
+
+  for (auto* obj : objs) {
+    auto& hist(static_cast<TH1&>(*obj));
+    if (hist.GetDimension() != 1 || !FastBinArray::isSupported(hist))
+      throw std::invalid_argument(TString::Format("Histogram %s cannot be filled from shared threads", hist.GetName()).Data());
+
+    // One set of stripe locks per histogram
+    if (sharedBins_.count(&hist) == 0)
+      sharedBins_.emplace(&hist, std::make_unique<SharedBinArray>());
+  }
+}
+
+void
+multidraw::Plot1DFiller::initialize_()
 {
+  std::vector<TObject*> objs;
+  collectObjs(objs);
+
+  targets_.clear();
+  targets_.resize(objs.size());
+
+  for (unsigned iT(0); iT != objs.size(); ++iT) {
+    auto& hist(static_cast<TH1&>(*objs[iT]));
+    auto& target(targets_[iT]);
+
+    target.axis = FastAxis(*hist.GetXaxis());
+    target.hist = &hist;
+    target.lastLowEdge = target.axis.getBinLowEdge(target.axis.getNbins());
+    target.lastUpEdge = target.axis.getBinUpEdge(target.axis.getNbins());
+
+    bool supported(hist.GetDimension() == 1 && FastBinArray::isSupported(hist));
+
+    // Shared arrays are owned by the original filler
+    auto& owner(cloneSource_ == nullptr ? *this : static_cast<Plot1DFiller&>(*cloneSource_));
+
+    auto sItr(owner.sharedBins_.find(&hist));
+
+    if (sharedFill_ && supported && sItr != owner.sharedBins_.end()) {
+      target.shared.set(*sItr->second, hist);
+      target.mode = FillTarget::kShared;
+    }
+    else if (cloneSource_ == nullptr) {
+      if (supported && target.bins.set(hist))
+        target.mode = FillTarget::kDirect;
+    }
+    else if (supported) {
+      // Storage is allocated at the first fill
+      target.local.set(hist);
+      target.mode = FillTarget::kLocal;
+    }
+    else {
+      std::stringstream name;
+      name << hist.GetName() << "_thread" << std::this_thread::get_id();
+
+      target.clone.reset(static_cast<TH1*>(hist.Clone(name.str().c_str())));
+      target.clone->Reset();
+      target.hist = target.clone.get();
+    }
+
+    if (target.mode == FillTarget::kHist && !hist.InheritsFrom(TProfile::Class())) {
+      // TProfile::Fill(x, w) is a fill of x with value w and has no FillN equivalent with unit weights
+      target.buffered = true;
+      target.xBuffer.reserve(kFillBufferSize);
+      target.wBuffer.reserve(kFillBufferSize);
+    }
+  }
+}
+
+template<class Bins>
+void
+multidraw::Plot1DFiller::fillBin_(Bins& _bins, int _bin, int _nbins, double _x)
+{
+  double w(entryWeight_);
+
+  _bins.add(_bin, w);
+
+  if ((_bin != 0 && _bin <= _nbins) || _bins.getStatOverflows()) {
+    double* stats(_bins.getStats());
+    stats[0] += w;
+    stats[1] += w * w;
+    stats[2] += w * _x;
+    stats[3] += w * _x * _x;
+  }
 }
 
 void
@@ -45,67 +153,117 @@ multidraw::Plot1DFiller::doFill_(unsigned _iD, int _icat/* = -1*/)
   if (printLevel_ > 3)
     std::cout << "            Fill(" << x << "; " << entryWeight_ << ")" << std::endl;
 
-  auto& hist(getHist(_icat));
+  fillValue_(x, _icat);
+}
+
+void
+multidraw::Plot1DFiller::fillValue_(double _x, int _icat)
+{
+  double x(_x);
+
+  auto& target(targets_[categorized_ ? _icat : 0]);
+
+  int nbins(target.axis.getNbins());
+  int bin(-1);
 
+  // Overflow handling is folded into the bin index
   switch (overflowMode_) {
   case OverflowMode::kDefault:
     break;
   case OverflowMode::kDedicated:
-    if (x > hist.GetXaxis()->GetBinLowEdge(hist.GetNbinsX()))
-      x = hist.GetXaxis()->GetBinLowEdge(hist.GetNbinsX());
+    if (x > target.lastLowEdge) {
+      x = target.lastLowEdge;
+      bin = nbins;
+    }
     break;
   case OverflowMode::kMergeLast:
-    if (x > hist.GetXaxis()->GetBinUpEdge(hist.GetNbinsX()))
-      x = hist.GetXaxis()->GetBinLowEdge(hist.GetNbinsX());
+    if (x > target.lastUpEdge) {
+      x = target.lastLowEdge;
+      bin = nbins;
+    }
     break;
   }
 
-  hist.Fill(x, entryWeight_);
+  if (target.mode == FillTarget::kHist) {
+    if (!target.buffered) {
+      target.hist->Fill(x, entryWeight_);
+      return;
+    }
+
+    target.xBuffer.push_back(x);
+    target.wBuffer.push_back(entryWeight_);
+    if (target.xBuffer.size() == kFillBufferSize)
+      flushBuffer_(target);
+
+    return;
+  }
+
+  if (bin < 0)
+    bin = target.axis.findBin(x);
+
+  if (target.mode == FillTarget::kDirect)
+    fillBin_(target.bins, bin, nbins, x);
+  else if (target.mode == FillTarget::kShared)
+    fillBin_(target.shared, bin, nbins, x);
+  else
+    fillBin_(target.local, bin, nbins, x);
 }
 
-multidraw::ExprFiller*
-multidraw::Plot1DFiller::clone_()
+void
+multidraw::Plot1DFiller::flushBuffer_(FillTarget& _target)
 {
-  if (categorized_) {
-    auto& myArray(static_cast<TObjArray&>(tobj_));
+  if (_target.xBuffer.empty())
+    return;
 
-    // this array will be deleted in the clone dtor
-    auto* array(new TObjArray());
-    array->SetOwner(true);
+  _target.hist->FillN(_target.xBuffer.size(), _target.xBuffer.data(), _target.wBuffer.data());
 
-    for (auto* obj : myArray) {
-      std::stringstream name;
-      name << obj->GetName() << "_thread" << std::this_thread::get_id();
+  _target.xBuffer.clear();
+  _target.wBuffer.clear();
+}
 
-      array->Add(obj->Clone(name.str().c_str()));
-    }
+void
+multidraw::Plot1DFiller::finalize_()
+{
+  for (auto& target : targets_) {
+    if (target.buffered)
+      flushBuffer_(target);
 
-    return new Plot1DFiller(*array, *this);
+    if (target.mode == FillTarget::kDirect)
+      target.bins.flush();
+    else if (target.mode == FillTarget::kShared)
+      target.shared.flush();
   }
-  else {
-    auto& myHist(getHist());
+}
 
-    std::stringstream name;
-    name << myHist.GetName() << "_thread" << std::this_thread::get_id();
+multidraw::ExprFiller*
+multidraw::Plot1DFiller::clone_()
+{
+  // The clone fills into thread-local storage set up in initialize_()
+  Plot1DFiller* clone(nullptr);
+  if (categorized_)
+    clone = new Plot1DFiller(static_cast<TObjArray&>(tobj_), *this);
+  else
+    clone = new Plot1DFiller(getHist(), *this);
 
-    auto* hist(static_cast<TH1*>(myHist.Clone(name.str().c_str())));
+  clone->sharesObj_ = true;
 
-    return new Plot1DFiller(*hist, *this);
-  }
+  return clone;
 }
 
 void
 multidraw::Plot1DFiller::mergeBack_()
 {
-  if (categorized_) {
-    auto& cloneSource(static_cast<Plot1DFiller&>(*cloneSource_));
-    auto& myArray(static_cast<TObjArray&>(tobj_));
+  // tobj_ is the object of the clone source
+  std::vector<TObject*> objs;
+  collectObjs(objs);
 
-    for (int icat(0); icat < myArray.GetEntries(); ++icat)
-      cloneSource.getHist(icat).Add(&getHist(icat));
-  }
-  else {
-    auto& sourceHist(static_cast<TH1&>(cloneSource_->getObj()));
-    sourceHist.Add(&getHist());
+  for (unsigned iT(0); iT != targets_.size(); ++iT) {
+    auto& target(targets_[iT]);
+    auto& sourceHist(static_cast<TH1&>(*objs[iT]));
+
+    if (target.mode == FillTarget::kLocal)
+      target.local.addTo(sourceHist);
+    else if (target.clone && target.clone->GetEntries() != 0.)
+      sourceHist.Add(target.clone.get());
   }
 }
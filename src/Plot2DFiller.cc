@@ -1,9 +1,12 @@
 #include "../interface/Plot2DFiller.h"
 #include "../interface/FormulaLibrary.h"
 
+#include "TProfile2D.h"
+
 #include <iostream>
 #include <sstream>
 #include <thread>
+#include <stdexcept>
 
 multidraw::Plot2DFiller::Plot2DFiller(TH2& _hist, CompiledExprSource const& _xsource, CompiledExprSource const& _ysource, char const* _reweight/* = ""*/) :
   ExprFiller(_hist, _reweight)
@@ -22,75 +25,218 @@ multidraw::Plot2DFiller::Plot2DFiller(TObjArray& _histlist, CompiledExprSource c
 multidraw::Plot2DFiller::Plot2DFiller(Plot2DFiller const& _orig) :
   ExprFiller(_orig)
 {
+  setSharedFill(_orig.sharedFill_);
 }
 
 multidraw::Plot2DFiller::Plot2DFiller(TH2& _hist, Plot2DFiller const& _orig) :
-  ExprFiller(_hist, _orig)
+  ExprFiller(_hist, _orig),
+  sharedFill_(_orig.sharedFill_)
 {
 }
 
 multidraw::Plot2DFiller::Plot2DFiller(TObjArray& _histlist, Plot2DFiller const& _orig) :
-  ExprFiller(_histlist, _orig)
+  ExprFiller(_histlist, _orig),
+  sharedFill_(_orig.sharedFill_)
 {
 }
 
 void
-multidraw::Plot2DFiller::doFill_(unsigned _iD, int _icat/* = -1*/)
+multidraw::Plot2DFiller::setSharedFill(bool _shared)
 {
-  double x(compiledExprs_[0]->evaluate(_iD));
-  double y(compiledExprs_[1]->evaluate(_iD));
+  sharedFill_ = _shared;
+  sharedBins_.clear();
 
-  if (printLevel_ > 3)
-    std::cout << "            Fill(" << x << ", " << y << "; " << entryWeight_ << ")" << std::endl;
+  if (!_shared)
+    return;
 
-  auto& hist(getHist(_icat));
+  std::vector<TObject*> objs;
+  collectObjs(objs);
 
-  hist.Fill(x, y, entryWeight_);
+  for (auto* obj : objs) {
+    auto& hist(static_cast<TH2&>(*obj));
+    if (hist.GetDimension() != 2 || !FastBinArray::isSupported(hist))
+      throw std::invalid_argument(TString::Format("Histogram %s cannot be filled from shared threads", hist.GetName()).Data());
+
+    // One set of stripe locks per histogram
+    if (sharedBins_.count(&hist) == 0)
+      sharedBins_.emplace(&hist, std::make_unique<SharedBinArray>());
+  }
 }
 
-multidraw::ExprFiller*
-multidraw::Plot2DFiller::clone_()
+void
+multidraw::Plot2DFiller::initialize_()
 {
-  if (categorized_) {
-    auto& myArray(static_cast<TObjArray&>(tobj_));
+  std::vector<TObject*> objs;
+  collectObjs(objs);
+
+  targets_.clear();
+  targets_.resize(objs.size());
+
+  for (unsigned iT(0); iT != objs.size(); ++iT) {
+    auto& hist(static_cast<TH2&>(*objs[iT]));
+    auto& target(targets_[iT]);
+
+    target.xaxis = FastAxis(*hist.GetXaxis());
+    target.yaxis = FastAxis(*hist.GetYaxis());
+    target.hist = &hist;
+
+    bool supported(hist.GetDimension() == 2 && FastBinArray::isSupported(hist));
 
-    // this array will be deleted in the clone ctor
-    auto* array(new TObjArray());
-    array->SetOwner(true);
+    // Shared arrays are owned by the original filler
+    auto& owner(cloneSource_ == nullptr ? *this : static_cast<Plot2DFiller&>(*cloneSource_));
 
-    for (auto* obj : myArray) {
+    auto sItr(owner.sharedBins_.find(&hist));
+
+    if (sharedFill_ && supported && sItr != owner.sharedBins_.end()) {
+      target.shared.set(*sItr->second, hist);
+      target.mode = FillTarget::kShared;
+    }
+    else if (cloneSource_ == nullptr) {
+      if (supported && target.bins.set(hist))
+        target.mode = FillTarget::kDirect;
+    }
+    else if (supported) {
+      // Storage is allocated at the first fill, sparse for large histograms
+      target.local.set(hist);
+      target.mode = FillTarget::kLocal;
+    }
+    else {
       std::stringstream name;
-      name << obj->GetName() << "_thread" << std::this_thread::get_id();
+      name << hist.GetName() << "_thread" << std::this_thread::get_id();
 
-      array->Add(obj->Clone(name.str().c_str()));
+      target.clone.reset(static_cast<TH2*>(hist.Clone(name.str().c_str())));
+      target.clone->Reset();
+      target.hist = target.clone.get();
     }
 
-    return new Plot2DFiller(*array, *this);
+    if (target.mode == FillTarget::kHist && !hist.InheritsFrom(TProfile2D::Class())) {
+      // TProfile2D::Fill(x, y, w) is a fill of (x, y) with value w and has no FillN equivalent with unit weights
+      target.buffered = true;
+      target.xBuffer.reserve(kFillBufferSize);
+      target.yBuffer.reserve(kFillBufferSize);
+      target.wBuffer.reserve(kFillBufferSize);
+    }
+  }
+}
+
+template<class Bins>
+void
+multidraw::Plot2DFiller::fillBin_(Bins& _bins, int _bin, bool _inRange, double _x, double _y)
+{
+  double w(entryWeight_);
+
+  _bins.add(_bin, w);
+
+  if (_inRange || _bins.getStatOverflows()) {
+    double* stats(_bins.getStats());
+    stats[0] += w;
+    stats[1] += w * w;
+    stats[2] += w * _x;
+    stats[3] += w * _x * _x;
+    stats[4] += w * _y;
+    stats[5] += w * _y * _y;
+    stats[6] += w * _x * _y;
   }
-  else {
-    auto& myHist(getHist());
+}
+
+void
+multidraw::Plot2DFiller::doFill_(unsigned _iD, int _icat/* = -1*/)
+{
+  double x(compiledExprs_[0]->evaluate(_iD));
+  double y(compiledExprs_[1]->evaluate(_iD));
+
+  if (printLevel_ > 3)
+    std::cout << "            Fill(" << x << ", " << y << "; " << entryWeight_ << ")" << std::endl;
 
-    std::stringstream name;
-    name << myHist.GetName() << "_thread" << std::this_thread::get_id();
+  auto& target(targets_[categorized_ ? _icat : 0]);
+
+  if (target.mode == FillTarget::kHist) {
+    if (!target.buffered) {
+      target.hist->Fill(x, y, entryWeight_);
+      return;
+    }
 
-    auto* hist(static_cast<TH2*>(myHist.Clone(name.str().c_str())));
+    target.xBuffer.push_back(x);
+    target.yBuffer.push_back(y);
+    target.wBuffer.push_back(entryWeight_);
+    if (target.xBuffer.size() == kFillBufferSize)
+      flushBuffer_(target);
 
-    return new Plot2DFiller(*hist, *this);
+    return;
   }
+
+  int nbinsx(target.xaxis.getNbins());
+  int nbinsy(target.yaxis.getNbins());
+  int binx(target.xaxis.findBin(x));
+  int biny(target.yaxis.findBin(y));
+
+  int bin(biny * (nbinsx + 2) + binx);
+  bool inRange(binx != 0 && binx <= nbinsx && biny != 0 && biny <= nbinsy);
+
+  if (target.mode == FillTarget::kDirect)
+    fillBin_(target.bins, bin, inRange, x, y);
+  else if (target.mode == FillTarget::kShared)
+    fillBin_(target.shared, bin, inRange, x, y);
+  else
+    fillBin_(target.local, bin, inRange, x, y);
 }
 
 void
-multidraw::Plot2DFiller::mergeBack_()
+multidraw::Plot2DFiller::flushBuffer_(FillTarget& _target)
 {
-  if (categorized_) {
-    auto& cloneSource(static_cast<Plot2DFiller&>(*cloneSource_));
-    auto& myArray(static_cast<TObjArray&>(tobj_));
+  if (_target.xBuffer.empty())
+    return;
+
+  _target.hist->FillN(_target.xBuffer.size(), _target.xBuffer.data(), _target.yBuffer.data(), _target.wBuffer.data());
+
+  _target.xBuffer.clear();
+  _target.yBuffer.clear();
+  _target.wBuffer.clear();
+}
 
-    for (int icat(0); icat < myArray.GetEntries(); ++icat)
-      cloneSource.getHist(icat).Add(&getHist(icat));
+void
+multidraw::Plot2DFiller::finalize_()
+{
+  for (auto& target : targets_) {
+    if (target.buffered)
+      flushBuffer_(target);
+
+    if (target.mode == FillTarget::kDirect)
+      target.bins.flush();
+    else if (target.mode == FillTarget::kShared)
+      target.shared.flush();
   }
-  else {
-    auto& sourceHist(static_cast<TH2&>(cloneSource_->getObj()));
-    sourceHist.Add(&getHist());
+}
+
+multidraw::ExprFiller*
+multidraw::Plot2DFiller::clone_()
+{
+  // The clone fills into thread-local storage set up in initialize_()
+  Plot2DFiller* clone(nullptr);
+  if (categorized_)
+    clone = new Plot2DFiller(static_cast<TObjArray&>(tobj_), *this);
+  else
+    clone = new Plot2DFiller(getHist(), *this);
+
+  clone->sharesObj_ = true;
+
+  return clone;
+}
+
+void
+multidraw::Plot2DFiller::mergeBack_()
+{
+  // tobj_ is the object of the clone source
+  std::vector<TObject*> objs;
+  collectObjs(objs);
+
+  for (unsigned iT(0); iT != targets_.size(); ++iT) {
+    auto& target(targets_[iT]);
+    auto& sourceHist(static_cast<TH2&>(*objs[iT]));
+
+    if (target.mode == FillTarget::kLocal)
+      target.local.addTo(sourceHist);
+    else if (target.clone && target.clone->GetEntries() != 0.)
+      sourceHist.Add(target.clone.get());
   }
 }
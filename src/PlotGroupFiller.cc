@@ -0,0 +1,204 @@
+#include "../interface/PlotGroupFiller.h"
+
+#include <iostream>
+#include <stdexcept>
+
+multidraw::PlotGroupFiller::PlotGroupFiller(CompiledExprSource const& _source, char const* _reweight/* = ""*/) :
+  ExprFiller(*(new TObjArray()), _reweight)
+{
+  sources_.push_back(_source);
+
+  // Identifies the group in printouts
+  static_cast<TObjArray&>(tobj_).SetName("group(" + _source.getSignature() + ")");
+}
+
+multidraw::PlotGroupFiller::PlotGroupFiller(TObjArray& _hists, PlotGroupFiller const& _orig) :
+  ExprFiller(_hists, _orig)
+{
+}
+
+multidraw::PlotGroupFiller::~PlotGroupFiller()
+{
+  // The list of all histograms is owned by the original group
+  if (cloneSource_ == nullptr)
+    delete &tobj_;
+}
+
+multidraw::Plot1DFiller&
+multidraw::PlotGroupFiller::addPlot(TH1* _hist, char const* _cutName/* = ""*/, Plot1DFiller::OverflowMode _overflowMode/* = kDefault*/)
+{
+  static_cast<TObjArray&>(tobj_).Add(_hist);
+
+  members_.push_back(Member{_cutName, std::make_unique<Plot1DFiller>(*_hist, sources_[0], "", _overflowMode), false});
+
+  return *members_.back().filler;
+}
+
+multidraw::Plot1DFiller&
+multidraw::PlotGroupFiller::addPlotList(TObjArray* _histlist, char const* _cutName, Plot1DFiller::OverflowMode _overflowMode/* = kDefault*/)
+{
+  for (auto* obj : *_histlist)
+    static_cast<TObjArray&>(tobj_).Add(obj);
+
+  members_.push_back(Member{_cutName, std::make_unique<Plot1DFiller>(*_histlist, sources_[0], "", _overflowMode), true});
+
+  return *members_.back().filler;
+}
+
+bool
+multidraw::PlotGroupFiller::hasCut(TString const& _cutName) const
+{
+  for (auto& member : members_) {
+    if (member.cutName == _cutName)
+      return true;
+  }
+
+  return false;
+}
+
+void
+multidraw::PlotGroupFiller::bindCuts(Cut const& _filter, std::vector<CutPtr> const& _cuts)
+{
+  for (auto& member : members_) {
+    member.cut = nullptr;
+
+    if (member.cutName.Length() == 0)
+      member.cut = &_filter;
+    else {
+      for (auto& cut : _cuts) {
+        if (cut->getName() == member.cutName) {
+          member.cut = cut.get();
+          break;
+        }
+      }
+    }
+
+    if (member.cut == nullptr)
+      throw std::runtime_error(("Cut " + member.cutName + " not defined").Data());
+
+    if (!member.categorized)
+      continue;
+
+    int ncat(member.cut->getNCategories());
+    std::vector<TObject*> objs;
+    member.filler->collectObjs(objs);
+
+    if (ncat != -1 && ncat != int(objs.size()))
+      throw std::runtime_error(("Size of histogram list does not match the number of categories of cut " + member.cutName).Data());
+  }
+}
+
+void
+multidraw::PlotGroupFiller::initialize_()
+{
+  for (auto& member : members_)
+    member.filler->initialize();
+
+  activeMembers_.clear();
+  activeMembers_.reserve(members_.size());
+}
+
+void
+multidraw::PlotGroupFiller::fill(std::vector<double> const& _eventWeights, std::vector<int> const&)
+{
+  activeMembers_.clear();
+  for (auto& member : members_) {
+    if (member.cut->getPassed())
+      activeMembers_.push_back(&member);
+  }
+
+  if (activeMembers_.empty())
+    return;
+
+  unsigned nD(exprGroup_.getNdata());
+
+  if (printLevel_ > 3)
+    std::cout << "          plot group " << sources_[0].getSignature() << "::fill() => " << nD << " iterations, " << activeMembers_.size() << " cuts" << std::endl;
+
+  auto& expr(*compiledExprs_[0]);
+  bool loaded(false);
+
+  for (unsigned iD(0); iD != nD; ++iD) {
+    bool evaluated(false);
+    double x(0.);
+
+    for (auto* member : activeMembers_) {
+      auto& categories(member->cut->getCategoryIndex());
+      auto& filler(*member->filler);
+      if (iD >= categories.size() || !acceptCategory_(categories[iD], filler.categoryBound_))
+        continue;
+
+      if (!evaluated) {
+        if (!loaded) {
+          expr.getNdata();
+          if (iD != 0) // need to always call EvalInstance(0)
+            expr.evaluate(0);
+
+          loaded = true;
+        }
+
+        x = expr.evaluate(iD);
+
+        if (iD < _eventWeights.size())
+          entryWeight_ = _eventWeights[iD];
+        else
+          entryWeight_ = _eventWeights.back();
+
+        if (sharedReweight_ != nullptr)
+          entryWeight_ *= sharedReweight_->getWeight(iD);
+
+        evaluated = true;
+        ++counter_;
+
+        if (printLevel_ > 3)
+          std::cout << "            Fill(" << x << "; " << entryWeight_ << ")" << std::endl;
+      }
+
+      filler.entryWeight_ = entryWeight_;
+      filler.fillValue_(x, categories[iD]);
+    }
+  }
+}
+
+void
+multidraw::PlotGroupFiller::finalize_()
+{
+  for (auto& member : members_)
+    member.filler->finalize();
+}
+
+TString
+multidraw::PlotGroupFiller::getSignature() const
+{
+  TString signature(ExprFiller::getSignature() + "group[");
+  for (auto& member : members_)
+    signature += member.cutName + ":" + member.filler->getSignature() + ";";
+  signature += "]";
+
+  return signature;
+}
+
+multidraw::ExprFiller*
+multidraw::PlotGroupFiller::clone_()
+{
+  auto* clone(new PlotGroupFiller(static_cast<TObjArray&>(tobj_), *this));
+  clone->sharesObj_ = true;
+
+  // Member clones fill into thread-local storage of the member histograms (see Plot1DFiller::clone_)
+  for (auto& member : members_) {
+    std::unique_ptr<Plot1DFiller> memberClone(static_cast<Plot1DFiller*>(member.filler->clone_()));
+    memberClone->cloneSource_ = member.filler.get();
+    memberClone->setPrintLevel(-1);
+
+    clone->members_.push_back(Member{member.cutName, std::move(memberClone), member.categorized});
+  }
+
+  return clone;
+}
+
+void
+multidraw::PlotGroupFiller::mergeBack_()
+{
+  for (auto& member : members_)
+    member.filler->mergeBack();
+}
@@ -0,0 +1,133 @@
+#include "../interface/PlotNDFiller.h"
+#include "../interface/FormulaLibrary.h"
+
+#include "THnSparse.h"
+
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <stdexcept>
+
+multidraw::PlotNDFiller::PlotNDFiller(THnBase& _hist, std::vector<CompiledExprSource> const& _sources, char const* _reweight/* = ""*/) :
+  ExprFiller(_hist, _reweight)
+{
+  for (auto& source : _sources)
+    sources_.push_back(source);
+
+  checkDimensions_();
+}
+
+multidraw::PlotNDFiller::PlotNDFiller(TObjArray& _histlist, std::vector<CompiledExprSource> const& _sources, char const* _reweight/* = ""*/) :
+  ExprFiller(_histlist, _reweight)
+{
+  for (auto& source : _sources)
+    sources_.push_back(source);
+
+  checkDimensions_();
+}
+
+multidraw::PlotNDFiller::PlotNDFiller(PlotNDFiller const& _orig) :
+  ExprFiller(_orig)
+{
+}
+
+multidraw::PlotNDFiller::PlotNDFiller(THnBase& _hist, PlotNDFiller const& _orig) :
+  ExprFiller(_hist, _orig)
+{
+}
+
+multidraw::PlotNDFiller::PlotNDFiller(TObjArray& _histlist, PlotNDFiller const& _orig) :
+  ExprFiller(_histlist, _orig)
+{
+}
+
+void
+multidraw::PlotNDFiller::checkDimensions_()
+{
+  std::vector<TObject*> objs;
+  collectObjs(objs);
+
+  for (auto* obj : objs) {
+    if (!obj->InheritsFrom(THnBase::Class()))
+      throw std::runtime_error(TString::Format("Object %s is not a THnBase", obj->GetName()).Data());
+
+    auto& hist(static_cast<THnBase&>(*obj));
+    if (hist.GetNdimensions() != int(sources_.size()))
+      throw std::runtime_error(TString::Format("Histogram %s has %d dimensions but %d expressions are given", hist.GetName(), hist.GetNdimensions(), int(sources_.size())).Data());
+  }
+}
+
+void
+multidraw::PlotNDFiller::initialize_()
+{
+  std::vector<TObject*> objs;
+  collectObjs(objs);
+
+  hists_.clear();
+  for (auto* obj : objs)
+    hists_.push_back(static_cast<THnBase*>(obj));
+
+  coords_.resize(sources_.size());
+}
+
+void
+multidraw::PlotNDFiller::doFill_(unsigned _iD, int _icat/* = -1*/)
+{
+  for (unsigned iX(0); iX != compiledExprs_.size(); ++iX)
+    coords_[iX] = compiledExprs_[iX]->evaluate(_iD);
+
+  if (printLevel_ > 3) {
+    std::cout << "            Fill(";
+    for (double x : coords_)
+      std::cout << x << ", ";
+    std::cout << entryWeight_ << ")" << std::endl;
+  }
+
+  hists_[categorized_ ? _icat : 0]->Fill(coords_.data(), entryWeight_);
+}
+
+multidraw::ExprFiller*
+multidraw::PlotNDFiller::clone_()
+{
+  // Sparse copy with the same axes; starts empty and only allocates the filled bins
+  auto sparseClone([](THnBase& hist)->THnBase* {
+      std::stringstream name;
+      name << hist.GetName() << "_thread" << std::this_thread::get_id();
+
+      auto* clone(THnSparse::CreateSparse(name.str().c_str(), hist.GetTitle(), &hist));
+      clone->Reset();
+
+      return clone;
+    });
+
+  if (categorized_) {
+    auto& myArray(static_cast<TObjArray&>(tobj_));
+
+    // this array will be deleted in the clone dtor
+    auto* array(new TObjArray());
+    array->SetOwner(true);
+
+    for (auto* obj : myArray)
+      array->Add(sparseClone(static_cast<THnBase&>(*obj)));
+
+    return new PlotNDFiller(*array, *this);
+  }
+  else
+    return new PlotNDFiller(*sparseClone(getHist()), *this);
+}
+
+void
+multidraw::PlotNDFiller::mergeBack_()
+{
+  if (categorized_) {
+    auto& cloneSource(static_cast<PlotNDFiller&>(*cloneSource_));
+    auto& myArray(static_cast<TObjArray&>(tobj_));
+
+    for (int icat(0); icat < myArray.GetEntries(); ++icat)
+      cloneSource.getHist(icat).Add(&getHist(icat));
+  }
+  else {
+    auto& sourceHist(static_cast<THnBase&>(cloneSource_->getObj()));
+    sourceHist.Add(&getHist());
+  }
+}
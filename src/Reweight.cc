@@ -3,12 +3,60 @@
 #include "../interface/FunctionLibrary.h"
 
 #include "TClass.h"
-#include "TTreeFormulaManager.h"
+#include "TMD5.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace {
+
+  //! Checksum of the contents of a reweight source object (objects are identified by name otherwise)
+  TString
+  sourceChecksum(TObject const& _source)
+  {
+    TString checksum;
+    std::vector<double> values;
+
+    if (_source.InheritsFrom(TH1::Class())) {
+      auto& hist(static_cast<TH1 const&>(_source));
+      checksum = "x" + multidraw::FastAxis::getSignature(*hist.GetXaxis());
+      if (hist.GetDimension() > 1)
+        checksum += "y" + multidraw::FastAxis::getSignature(*hist.GetYaxis());
+
+      for (int iBin(0); iBin != hist.GetNcells(); ++iBin)
+        values.push_back(hist.GetBinContent(iBin));
+    }
+    else if (_source.InheritsFrom(TGraph::Class())) {
+      auto& graph(static_cast<TGraph const&>(_source));
+      values.assign(graph.GetX(), graph.GetX() + graph.GetN());
+      values.insert(values.end(), graph.GetY(), graph.GetY() + graph.GetN());
+    }
+    else if (_source.InheritsFrom(TF1::Class())) {
+      auto& fct(static_cast<TF1 const&>(_source));
+      checksum = fct.GetTitle();
+
+      double range[4]{};
+      fct.GetRange(range[0], range[1], range[2], range[3]);
+      values.assign(range, range + 4);
+      if (fct.GetNpar() != 0)
+        values.insert(values.end(), fct.GetParameters(), fct.GetParameters() + fct.GetNpar());
+    }
+
+    TMD5 md5;
+    md5.Update(reinterpret_cast<UChar_t const*>(values.data()), values.size() * sizeof(double));
+    md5.Final();
+    checksum += TString("#") + md5.AsString();
+
+    return checksum;
+  }
+
+}
 
 multidraw::Reweight::Reweight(CompiledExprPtr&& _x, TObject const* _source/* = nullptr*/) :
   source_(_source)
 {
   exprs_.emplace_back(std::move(_x));
+  exprGroup_.add(*exprs_[0]);
   setEvalType_();
 }
   
@@ -17,12 +65,9 @@ multidraw::Reweight::Reweight(CompiledExprPtr&& _x, CompiledExprPtr&& _y, TObjec
 {
   exprs_.emplace_back(std::move(_x));
   exprs_.emplace_back(std::move(_y));
-  
-  if (exprs_[0]->getFormula() != nullptr && exprs_[1]->getFormula() != nullptr) {
-    auto* manager(exprs_[0]->getFormula()->GetManager());
-    manager->Add(exprs_[1]->getFormula());
-    manager->Sync();
-  }
+
+  for (auto& expr : exprs_)
+    exprGroup_.add(*expr);
 
   setEvalType_();
 }
@@ -31,19 +76,28 @@ void
 multidraw::Reweight::setEvalType_()
 {
   if (source_ == nullptr)
-    evaluate_ = [this](unsigned i)->double { return this->evaluateRaw_(i); };
+    evalType_ = kRaw;
   else if (source_->InheritsFrom(TH1::Class())) {
     auto& hist(static_cast<TH1 const&>(*source_));
 
     if (hist.GetDimension() != int(exprs_.size()))
       throw std::runtime_error(std::string("Invalid number of formulas given for histogram source of type ") + hist.IsA()->GetName());
 
-    evaluate_ = [this](unsigned i)->double { return this->evaluateTH1_(i); };
+    // Flat copy of the histogram to bypass FindFixBin and GetBinContent
+    histAxes_[0] = FastAxis(*hist.GetXaxis());
+    if (exprs_.size() == 2)
+      histAxes_[1] = FastAxis(*hist.GetYaxis());
+
+    histContents_.resize(hist.GetNcells());
+    for (int iBin(0); iBin != hist.GetNcells(); ++iBin)
+      histContents_[iBin] = hist.GetBinContent(iBin);
+
+    evalType_ = kTH1;
   }
   else if (source_->InheritsFrom(TGraph::Class())) {
     spline_.reset(new TSpline3("interpolation", static_cast<TGraph const*>(source_)));
   
-    evaluate_ = [this](unsigned i)->double { return this->evaluateTGraph_(i); };
+    evalType_ = kTGraph;
   }
   else if (source_->InheritsFrom(TF1::Class())) {
     auto& fct(static_cast<TF1 const&>(*source_));
@@ -51,7 +105,7 @@ multidraw::Reweight::setEvalType_()
     if (fct.GetNdim() != int(exprs_.size()))
       throw std::runtime_error(std::string("Invalid number of formulas given for function source of type ") + fct.IsA()->GetName());
 
-    evaluate_ = [this](unsigned i)->double { return this->evaluateTF1_(i); };
+    evalType_ = kTF1;
   }
   else
     throw std::runtime_error(TString::Format("Object of incompatible class %s passed to Reweight", source_->IsA()->GetName()).Data());
@@ -69,90 +123,180 @@ multidraw::Reweight::getFormula(unsigned i/* = 0*/) const
 unsigned
 multidraw::Reweight::getNdata()
 {
-  if (exprs_.empty())
-    return 1;
+  return exprGroup_.getNdata();
+}
+
+void
+multidraw::Reweight::tabulate(unsigned _nPoints)
+{
+  if (source_ == nullptr || !(source_->InheritsFrom(TGraph::Class()) || source_->InheritsFrom(TF1::Class())))
+    return;
+
+  if (_nPoints < 2)
+    throw std::invalid_argument("Tabulation requires at least two points per dimension");
+
+  unsigned nDim(exprs_.size());
 
-  return exprs_[0]->getNdata();
+  if (source_->InheritsFrom(TGraph::Class())) {
+    auto& graph(static_cast<TGraph const&>(*source_));
+    if (graph.GetN() == 0)
+      return;
+
+    gridMin_[0] = *std::min_element(graph.GetX(), graph.GetX() + graph.GetN());
+    gridMax_[0] = *std::max_element(graph.GetX(), graph.GetX() + graph.GetN());
+  }
+  else {
+    auto& fct(static_cast<TF1 const&>(*source_));
+    if (nDim == 1)
+      fct.GetRange(gridMin_[0], gridMax_[0]);
+    else
+      fct.GetRange(gridMin_[0], gridMin_[1], gridMax_[0], gridMax_[1]);
+  }
+
+  for (unsigned iDim(0); iDim != nDim; ++iDim) {
+    if (!(gridMax_[iDim] > gridMin_[iDim]))
+      return;
+
+    gridN_[iDim] = _nPoints;
+    gridInvStep_[iDim] = (_nPoints - 1) / (gridMax_[iDim] - gridMin_[iDim]);
+  }
+
+  // Values are stored x-major: index = ix + nx * iy
+  unsigned ny(nDim == 2 ? gridN_[1] : 1);
+  gridValues_.resize(gridN_[0] * ny);
+
+  double x[2]{};
+  for (unsigned iy(0); iy != ny; ++iy) {
+    if (nDim == 2)
+      x[1] = gridMin_[1] + iy / gridInvStep_[1];
+
+    for (unsigned ix(0); ix != gridN_[0]; ++ix) {
+      x[0] = gridMin_[0] + ix / gridInvStep_[0];
+      gridValues_[ix + gridN_[0] * iy] = evaluateSource_(x);
+    }
+  }
+
+  evalType_ = kTable;
 }
 
-double
-multidraw::Reweight::evaluateRaw_(unsigned _iD)
+unsigned
+multidraw::Reweight::load()
 {
-  if (exprs_[0]->getFormula() != nullptr) {
-    exprs_[0]->getNdata();
-    if (_iD != 0)
-      exprs_[0]->evaluate(0);
+  unsigned nD(exprGroup_.getNdata());
+
+  // EvalInstance(0) must always be called first
+  for (auto& expr : exprs_) {
+    if (expr->getFormula() != nullptr) {
+      expr->getNdata();
+      expr->evaluate(0);
+    }
   }
-  
-  return exprs_[0]->evaluate(_iD);
+
+  return nD;
 }
 
 double
-multidraw::Reweight::evaluateTH1_(unsigned _iD)
+multidraw::Reweight::evaluate(unsigned _iD/* = 0*/) const
 {
-  auto& hist(static_cast<TH1 const&>(*source_));
-
-  double x[2]{};
-  for (unsigned iDim(0); iDim != exprs_.size(); ++iDim) {
-    auto& expr(*exprs_[iDim]);
-    if (expr.getFormula() != nullptr) {
-      expr.getNdata();
+  for (auto& expr : exprs_) {
+    if (expr->getFormula() != nullptr) {
+      expr->getNdata();
       if (_iD != 0)
-        expr.evaluate(0);
+        expr->evaluate(0);
     }
-    
-    x[iDim] = expr.evaluate(_iD);
   }
 
-  int iBin(hist.FindFixBin(x[0], x[1]));
+  return evaluateLoaded(_iD);
+}
+
+double
+multidraw::Reweight::evaluateTH1_(unsigned _iD) const
+{
+  // Same as TH1::FindFixBin
+  int iBin(histAxes_[0].findBin(exprs_[0]->evaluate(_iD)));
+  if (exprs_.size() == 2)
+    iBin += (histAxes_[0].getNbins() + 2) * histAxes_[1].findBin(exprs_[1]->evaluate(_iD));
 
   // not handling over/underflow at the moment
 
-  return hist.GetBinContent(iBin);
+  return histContents_[iBin];
 }
 
 double
-multidraw::Reweight::evaluateTGraph_(unsigned _iD)
+multidraw::Reweight::evaluateTGraph_(unsigned _iD) const
 {
   auto& graph(static_cast<TGraph const&>(*source_));
 
-  if (exprs_[0]->getFormula() != nullptr) {
-    exprs_[0]->getNdata();
-    if (_iD != 0)
-      exprs_[0]->evaluate(0);
-  }
-  
-  double x(exprs_[0]->evaluate(_iD));
-
-  return graph.Eval(x, spline_.get());
+  return graph.Eval(exprs_[0]->evaluate(_iD), spline_.get());
 }
 
 double
-multidraw::Reweight::evaluateTF1_(unsigned _iD)
+multidraw::Reweight::evaluateTF1_(unsigned _iD) const
 {
   auto& fct(static_cast<TF1 const&>(*source_));
 
   double x[2]{};
-  for (unsigned iDim(0); iDim != exprs_.size(); ++iDim) {
-    auto& expr(*exprs_[iDim]);
-    if (expr.getFormula() != nullptr) {
-      expr.getNdata();
-      if (_iD != 0)
-        expr.evaluate(0);
-    }
-      
-    x[iDim] = expr.evaluate(_iD);
-  }
-  
+  for (unsigned iDim(0); iDim != exprs_.size(); ++iDim)
+    x[iDim] = exprs_[iDim]->evaluate(_iD);
+
   return fct.Eval(x[0], x[1]);
 }
 
+double
+multidraw::Reweight::evaluateTable_(unsigned _iD) const
+{
+  unsigned nDim(exprs_.size());
+
+  double x[2]{};
+  unsigned index[2]{};
+  double frac[2]{};
+  for (unsigned iDim(0); iDim != nDim; ++iDim)
+    x[iDim] = exprs_[iDim]->evaluate(_iD);
+
+  for (unsigned iDim(0); iDim != nDim; ++iDim) {
+    if (!(x[iDim] >= gridMin_[iDim] && x[iDim] <= gridMax_[iDim]))
+      return evaluateSource_(x);
+
+    double u((x[iDim] - gridMin_[iDim]) * gridInvStep_[iDim]);
+    index[iDim] = std::min(unsigned(u), gridN_[iDim] - 2);
+    frac[iDim] = u - index[iDim];
+  }
+
+  double const* v(gridValues_.data() + index[0]);
+
+  if (nDim == 1)
+    return v[0] + frac[0] * (v[1] - v[0]);
+
+  v += gridN_[0] * index[1];
+  double low(v[0] + frac[0] * (v[1] - v[0]));
+  v += gridN_[0];
+  double high(v[0] + frac[0] * (v[1] - v[0]));
+
+  return low + frac[1] * (high - low);
+}
+
+double
+multidraw::Reweight::evaluateSource_(double const* _x) const
+{
+  if (source_->InheritsFrom(TGraph::Class()))
+    return static_cast<TGraph const&>(*source_).Eval(_x[0], spline_.get());
+  else
+    return static_cast<TF1 const&>(*source_).Eval(_x[0], _x[1]);
+}
+
 
 multidraw::FactorizedReweight::FactorizedReweight(ReweightPtr&& _ptr1, ReweightPtr&& _ptr2) :
   subReweights_{{std::move(_ptr1), std::move(_ptr2)}}
 {
 }
 
+void
+multidraw::FactorizedReweight::collectFactors(std::vector<Reweight*>& _factors)
+{
+  subReweights_[0]->collectFactors(_factors);
+  subReweights_[1]->collectFactors(_factors);
+}
+
 TTreeFormulaCached*
 multidraw::FactorizedReweight::getFormula(unsigned i/* = 0*/) const
 {
@@ -164,7 +308,8 @@ multidraw::FactorizedReweight::getFormula(unsigned i/* = 0*/) const
 
 multidraw::ReweightSource::ReweightSource(ReweightSource const& _orig) :
   exprs_(_orig.exprs_),
-  source_(_orig.source_)
+  source_(_orig.source_),
+  tabulationPoints_(_orig.tabulationPoints_)
 {
   if (_orig.subReweights_[0]) {
     subReweights_[0] = std::make_unique<ReweightSource>(*_orig.subReweights_[0]);
@@ -172,14 +317,75 @@ multidraw::ReweightSource::ReweightSource(ReweightSource const& _orig) :
   }
 }
 
+void
+multidraw::ReweightSource::setPerFile(bool _perFile)
+{
+  for (auto& expr : exprs_)
+    expr.setPerFile(_perFile);
+
+  if (subReweights_[0]) {
+    subReweights_[0]->setPerFile(_perFile);
+    subReweights_[1]->setPerFile(_perFile);
+  }
+}
+
+void
+multidraw::ReweightSource::setTabulation(unsigned _nPoints)
+{
+  tabulationPoints_ = _nPoints;
+
+  if (subReweights_[0]) {
+    subReweights_[0]->setTabulation(_nPoints);
+    subReweights_[1]->setTabulation(_nPoints);
+  }
+}
+
+TString
+multidraw::ReweightSource::getSignature() const
+{
+  if (subReweights_[0])
+    return "(" + subReweights_[0]->getSignature() + ")*(" + subReweights_[1]->getSignature() + ")";
+
+  TString signature;
+  for (auto& expr : exprs_)
+    signature += expr.getSignature() + ",";
+
+  if (source_ != nullptr)
+    signature += TString::Format("%s:%s", source_->IsA()->GetName(), source_->GetName()) + sourceChecksum(*source_);
+
+  if (tabulationPoints_ != 0)
+    signature += TString::Format("~%u", tabulationPoints_);
+
+  return signature;
+}
+
+TString
+multidraw::ReweightSource::getKey() const
+{
+  if (subReweights_[0])
+    return "(" + subReweights_[0]->getKey() + ")*(" + subReweights_[1]->getKey() + ")";
+
+  // Distinct objects can have the same class and name
+  if (source_ != nullptr)
+    return getSignature() + TString::Format("@%p", static_cast<void const*>(source_));
+
+  return getSignature();
+}
+
 multidraw::ReweightPtr
 multidraw::ReweightSource::compile(FormulaLibrary& _formulaLibrary, FunctionLibrary& _functionLibrary) const
 {
   if (subReweights_[0])
     return ReweightPtr(new FactorizedReweight(subReweights_[0]->compile(_formulaLibrary, _functionLibrary), subReweights_[1]->compile(_formulaLibrary, _functionLibrary)));
 
+  ReweightPtr reweight;
   if (exprs_.size() == 1)
-    return std::make_unique<Reweight>(exprs_[0].compile(_formulaLibrary, _functionLibrary), source_);
+    reweight = std::make_unique<Reweight>(exprs_[0].compile(_formulaLibrary, _functionLibrary), source_);
   else
-    return std::make_unique<Reweight>(exprs_[0].compile(_formulaLibrary, _functionLibrary), exprs_[1].compile(_formulaLibrary, _functionLibrary), source_);
+    reweight = std::make_unique<Reweight>(exprs_[0].compile(_formulaLibrary, _functionLibrary), exprs_[1].compile(_formulaLibrary, _functionLibrary), source_);
+
+  if (tabulationPoints_ != 0)
+    reweight->tabulate(tabulationPoints_);
+
+  return reweight;
 }
@@ -0,0 +1,53 @@
+#include "../interface/ReweightLibrary.h"
+
+multidraw::SharedReweight::SharedReweight(ReweightPtr&& _reweight) :
+  reweight_(std::move(_reweight))
+{
+  reweight_->collectFactors(factors_);
+}
+
+double
+multidraw::SharedReweight::computeWeight_(unsigned _iD)
+{
+  if (loadedEvent_ != event_) {
+    for (auto* factor : factors_)
+      factor->load();
+
+    loadedEvent_ = event_;
+  }
+
+  if (_iD >= weights_.size()) {
+    weights_.resize(_iD + 1);
+    cacheEvents_.resize(_iD + 1, 0);
+  }
+
+  double weight(1.);
+  for (auto* factor : factors_)
+    weight *= factor->evaluateLoaded(_iD);
+
+  weights_[_iD] = weight;
+  cacheEvents_[_iD] = event_;
+
+  return weight;
+}
+
+multidraw::SharedReweight&
+multidraw::ReweightLibrary::getReweight(ReweightSource const& _source)
+{
+  std::string key(_source.getKey().Data());
+
+  auto rItr(reweights_.find(key));
+  if (rItr == reweights_.end()) {
+    rItr = reweights_.emplace(key, std::make_unique<SharedReweight>(_source.compile(formulaLibrary_, functionLibrary_))).first;
+    reweightList_.push_back(rItr->second.get());
+  }
+
+  return *rItr->second;
+}
+
+void
+multidraw::ReweightLibrary::resetCache()
+{
+  for (auto* reweight : reweightList_)
+    reweight->resetCache();
+}
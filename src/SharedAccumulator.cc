@@ -0,0 +1,140 @@
+#include "../interface/SharedAccumulator.h"
+
+#include "TProfile.h"
+#include "TProfile2D.h"
+#include "TProfile3D.h"
+#include "TArrayD.h"
+
+#include <stdexcept>
+#include <cmath>
+
+#include <sys/mman.h>
+
+multidraw::SharedAccumulator::SharedAccumulator(std::vector<TH1*> const& _hists, unsigned _nCounters) :
+  nCounters_(_nCounters)
+{
+  // Per histogram: bin contents, sumw2, stats, entries, sumw2 flag
+  std::size_t nData(0);
+  for (auto* hist : _hists) {
+    // Profiles have additional per-bin arrays that cannot be set through the TH1 interface
+    if (hist->InheritsFrom(TProfile::Class()) || hist->InheritsFrom(TProfile2D::Class()) || hist->InheritsFrom(TProfile3D::Class()))
+      throw std::runtime_error(TString::Format("Profile histogram %s cannot be filled in multi-process mode", hist->GetName()).Data());
+
+    offsets_.push_back(nData);
+    nData += 2 * hist->GetNcells() + TH1::kNstat + 2;
+  }
+
+  // Keep the counters and the histogram data 8-byte aligned
+  std::size_t mutexSize((sizeof(pthread_mutex_t) + 63) / 64 * 64);
+  size_ = mutexSize + sizeof(unsigned long long) * nCounters_ + sizeof(double) * nData;
+
+  // Anonymous mappings are zero-initialized
+  void* region(mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0));
+  if (region == MAP_FAILED)
+    throw std::runtime_error("Failed to map shared memory for multi-process execution");
+
+  region_ = static_cast<char*>(region);
+  mutex_ = reinterpret_cast<pthread_mutex_t*>(region_);
+  counters_ = reinterpret_cast<unsigned long long*>(region_ + mutexSize);
+  data_ = reinterpret_cast<double*>(counters_ + nCounters_);
+
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutex_init(mutex_, &attr);
+  pthread_mutexattr_destroy(&attr);
+}
+
+multidraw::SharedAccumulator::~SharedAccumulator()
+{
+  pthread_mutex_destroy(mutex_);
+  munmap(region_, size_);
+}
+
+void
+multidraw::SharedAccumulator::add(std::vector<TH1*> const& _hists, std::vector<unsigned long long> const& _counters)
+{
+  if (_hists.size() != offsets_.size() || _counters.size() != nCounters_)
+    throw std::invalid_argument("SharedAccumulator: inconsistent list of objects");
+
+  pthread_mutex_lock(mutex_);
+
+  for (unsigned iC(0); iC != nCounters_; ++iC)
+    counters_[iC] += _counters[iC];
+
+  for (unsigned iH(0); iH != _hists.size(); ++iH) {
+    auto& hist(*_hists[iH]);
+    double* data(data_ + offsets_[iH]);
+    int nCells(hist.GetNcells());
+
+    for (int iB(0); iB != nCells; ++iB)
+      data[iB] += hist.GetBinContent(iB);
+
+    // The sum of squared weights is always accumulated, so that it is complete if any worker has sumw2.
+    // Without sumw2, all fills had unit weight and the sum is the absolute bin content (same as TH1::Sumw2).
+    if (hist.GetSumw2N() != 0) {
+      double const* sumw2(hist.GetSumw2()->GetArray());
+      for (int iB(0); iB != nCells; ++iB)
+        data[nCells + iB] += sumw2[iB];
+
+      data[2 * nCells + TH1::kNstat + 1] = 1.;
+    }
+    else {
+      for (int iB(0); iB != nCells; ++iB)
+        data[nCells + iB] += std::abs(hist.GetBinContent(iB));
+    }
+
+    double stats[TH1::kNstat]{};
+    hist.GetStats(stats);
+    for (int iS(0); iS != TH1::kNstat; ++iS)
+      data[2 * nCells + iS] += stats[iS];
+
+    data[2 * nCells + TH1::kNstat] += hist.GetEntries();
+  }
+
+  pthread_mutex_unlock(mutex_);
+}
+
+void
+multidraw::SharedAccumulator::addTo(std::vector<TH1*> const& _hists) const
+{
+  if (_hists.size() != offsets_.size())
+    throw std::invalid_argument("SharedAccumulator: inconsistent list of objects");
+
+  for (unsigned iH(0); iH != _hists.size(); ++iH) {
+    auto& hist(*_hists[iH]);
+    double const* data(data_ + offsets_[iH]);
+    int nCells(hist.GetNcells());
+
+    // Stats must be read before the bin contents are touched
+    double stats[TH1::kNstat]{};
+    hist.GetStats(stats);
+    double entries(hist.GetEntries());
+
+    // A worker filled with weights; the parent share so far had unit weights
+    if (data[2 * nCells + TH1::kNstat + 1] != 0. && hist.GetSumw2N() == 0) {
+      // Sumw2 copies the contents only if the histogram has entries
+      hist.Sumw2();
+      double* sumw2(hist.GetSumw2()->GetArray());
+      for (int iB(0); iB != nCells; ++iB)
+        sumw2[iB] = std::abs(hist.GetBinContent(iB));
+    }
+
+    for (int iB(0); iB != nCells; ++iB) {
+      if (data[iB] != 0.)
+        hist.AddBinContent(iB, data[iB]);
+    }
+
+    if (hist.GetSumw2N() != 0) {
+      double* sumw2(hist.GetSumw2()->GetArray());
+      for (int iB(0); iB != nCells; ++iB)
+        sumw2[iB] += data[nCells + iB];
+    }
+
+    for (int iS(0); iS != TH1::kNstat; ++iS)
+      stats[iS] += data[2 * nCells + iS];
+
+    hist.PutStats(stats);
+    hist.SetEntries(entries + data[2 * nCells + TH1::kNstat]);
+  }
+}
@@ -98,14 +98,29 @@ TTreeFormulaCached::ConvertSubformulas()
 Int_t
 TTreeFormulaCached::GetNdata()
 {
+  if (fCache && fCache->fNdata >= 0)
+    return fCache->fNdata;
+
   Int_t ndata(TTreeFormula::GetNdata());
 
-  if (fCache && fCache->fValues.empty())
+  if (fCache) {
+    fCache->fNdata = ndata;
     fCache->fValues.assign(ndata, std::pair<Bool_t, Double_t>(false, 0.));
+  }
 
   return ndata;
 }
 
+void
+TTreeFormulaCached::ResetCache()
+{
+  if (!fCache)
+    return;
+
+  fCache->fNdata = -1;
+  fCache->fValues.clear();
+}
+
 Double_t
 TTreeFormulaCached::EvalInstance(Int_t _i, char const* _stringStack[]/* = nullptr*/)
 {
@@ -1,4 +1,5 @@
 #include "../interface/TTreeFunction.h"
+#include "../interface/FunctionLibrary.h"
 
 multidraw::TTreeFunctionPtr
 multidraw::TTreeFunction::linkedCopy(FunctionLibrary& _library) const
@@ -6,6 +7,38 @@ multidraw::TTreeFunction::linkedCopy(FunctionLibrary& _library) const
   auto* copy{clone()};
   copy->bindTree_(_library);
   copy->linked_ = true;
+  copy->library_ = &_library;
 
   return TTreeFunctionPtr(copy);
 }
+
+std::vector<double> const*
+multidraw::TTreeFunction::getValues()
+{
+  if (noBatch_ || library_ == nullptr)
+    return nullptr;
+
+  prepareEvent();
+
+  long long iEntry(library_->getEntry());
+  if (iEntry < 0 || iEntry != valuesEntry_) {
+    values_.clear();
+    if (!evaluateBatch(values_)) {
+      noBatch_ = true;
+      return nullptr;
+    }
+    valuesEntry_ = iEntry;
+  }
+
+  return &values_;
+}
+
+void
+multidraw::TTreeFunction::prepareEvent_()
+{
+  long long iEntry(pendingEntry_);
+  pendingEntry_ = -1;
+
+  library_->loadEntry();
+  beginEvent(iEntry);
+}
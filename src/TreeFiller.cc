@@ -134,6 +134,27 @@ multidraw::TreeFiller::addBranch(char const* _bname, char const* _expr, bool _re
   sources_.emplace_back(_expr);
 }
 
+TString
+multidraw::TreeFiller::getSignature() const
+{
+  TString signature(ExprFiller::getSignature() + "branches:");
+  for (auto& bname : bnames_)
+    signature += bname + ",";
+
+  return signature;
+}
+
+void
+multidraw::TreeFiller::initialize_()
+{
+  std::vector<TObject*> objs;
+  collectObjs(objs);
+
+  trees_.clear();
+  for (auto* obj : objs)
+    trees_.push_back(static_cast<TTree*>(obj));
+}
+
 void
 multidraw::TreeFiller::doFill_(unsigned _iD, int _icat/* = -1*/)
 {
@@ -153,7 +174,7 @@ multidraw::TreeFiller::doFill_(unsigned _iD, int _icat/* = -1*/)
   if (printLevel_ > 3)
     std::cout << "; " << entryWeight_ << ")" << std::endl;
 
-  getTree(_icat).Fill();
+  trees_[categorized_ ? _icat : 0]->Fill();
 }
 
 multidraw::ExprFiller*